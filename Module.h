@@ -25,36 +25,111 @@ THE SOFTWARE.
 #ifndef _WAFFLE_MODULE_H_
 #define _WAFFLE_MODULE_H_
 
+#include "arena.h"
+
 #include <iostream>
+#include <new>
 #include <set>
 
 namespace waffle {
 
+//type of the samples modules pass each other. "make FLOAT=1" builds with float, twice as many samples per
+//vector and half the memory traffic. Modules keep state that needs the precision (oscillator phase, filter
+//memory) in double either way.
+#ifdef WAFFLE_FLOAT
+typedef float sample_t;
+#else
+typedef double sample_t;
+#endif
+
+//largest number of frames a module is ever asked to process at once,
+//the engine splits bigger buffers into blocks of at most this size
+static const int MAX_BLOCK_SIZE = 256;
+
 //base module class
 class Module {
 public:
-	Module() : m_cachedValue(0.0), m_dirtyCache(true){};
+	Module() : m_output(NULL), m_constant(false), m_stride(1){
+		Arena *arena = Arena::current();
+		if(arena != NULL)
+			arena->adopt(this);
+	};
 	virtual ~Module(){};
 
-	virtual double run()=0;
+	//modules made inside an Arena::Scope go into that arena, see arena.h
+	static void *operator new(size_t size) {
+		Arena *arena = Arena::current();
+		return arena != NULL ? arena->create(size) : ::operator new(size);
+	}
+	static void operator delete(void *p) {
+		Arena *arena = Arena::current();
+		if(arena != NULL && arena->owns(p))
+			arena->forget(p);
+		else
+			::operator delete(p);
+	}
+
+	//render nframes (<= MAX_BLOCK_SIZE) samples into out, reading the
+	//inputs from their output slots
+	virtual void process(sample_t *out, int nframes)=0;
 	virtual bool isValid()=0;
-	virtual void reset() { m_dirtyCache = true; }
-	virtual double getValue() {
-		if(m_dirtyCache) {
-			m_dirtyCache = false;
-			m_cachedValue = run();
+
+	//direct inputs, walked when a patch is compiled
+	virtual int getInputCount() { return 0; }
+	virtual Module *getInput(int n) { return NULL; }
+	virtual void setInput(int n, Module *m) {}
+
+	//inputs that aren't always needed. needsInput() is asked before a lazy input is rendered and can
+	//only look at the inputs that come before it: every eager input and the lazy ones with lower indices.
+	//if the input's subtree only feeds this module, it's skipped when the answer is no.
+	virtual bool isLazyInput(int n) { return false; }
+	virtual bool needsInput(int n, int nframes) { return true; }
+
+	//inputs that only modulate (a frequency, a cutoff), where a signal evaluated at control rate and
+	//interpolated is good enough. Used by Patch::inferControlRate()
+	virtual bool isControlInput(int n) { return false; }
+
+	//used by Patch::optimize(). pure modules output a function of their inputs' current samples, and
+	//can be folded away when every input is constant. equivalent() is asked of two modules of the
+	//same class with the same inputs: true if they'd produce the same output from now on.
+	virtual bool isPure() { return false; }
+	virtual bool equivalent(Module *other) { return false; }
+
+	//called instead of process() when nothing needs this block, inputs are stale. should keep state
+	//moving as if the block had run, modules that can't must return false from canSkip().
+	virtual bool canSkip() { return true; }
+
+	//false for modules that can't run at control rate, with frames m_stride samples apart
+	virtual bool canStride() { return true; }
+	virtual void skip(int nframes) {}
+
+	//samples produced by the last call to process()
+	const sample_t *getOutput() const { return m_output; }
+
+	//every sample of the last block had the same value, set by process() (cleared before each call)
+	bool isConstant() const { return m_constant; }
+	bool isSilent() const { return m_constant && m_output[0] == 0.0; }
+
+	void gatherSubModules(std::set<Module *> &modules) {
+		for(int i = 0, len = getInputCount(); i < len; ++i) {
+			Module *m = getInput(i);
+			if(m != NULL && modules.insert(m).second)
+				m->gatherSubModules(modules);
 		}
-		return m_cachedValue;
 	}
-	
-	//TODO: profile and optimize this
-	virtual void gatherSubModules(std::set<Module *> &modules) = 0;
 
 protected:
-	double m_cachedValue;
-	bool m_dirtyCache;
-};
+	friend class Patch;
+	friend class ControlRate;
+	friend class Program;
 
+	//output slot, assigned when the owning patch is compiled
+	sample_t *m_output;
+	bool m_constant;
+	//samples each frame stands for, more than one for modules running at control rate. modules that
+	//count time (phase, filter coefficients, envelope stages) have to scale by it
+	int m_stride;
+};
 }
 
 #endif
@@ -0,0 +1,158 @@
+/*
+Copyright (c) 2009-2010 Brett Lajzer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+// Waffle - accuracy.cpp
+// Compares a float build against a double build on a set of patches.
+// Run with "make accuracy": the double build writes its output, the float build reads it back and reports
+// the largest error and the signal to error ratio for each patch.
+
+#include "waffle.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+using namespace waffle;
+
+static const float SAMPLE_RATE = 48000.0f;
+static const int BLOCKS = 1000;
+
+static Module *sine(double freq) {
+	return new GenSine(new Value(freq), new Value(0.0));
+}
+
+//the lw-example voice
+static Module *exampleVoice() {
+	Module *g = new Add(new GenSine(new Value(440.0), new Value(0.0)),
+						new GenSquare(new Add(new Mult(new GenSine(new Value(0.5), new Value(0.0)),
+												new Value(20.0)),new Value(440.0)),
+										new Value(0.0),
+										new Value(0.5)));
+	return new Mult(new Envelope(0.5, 0.01, 0.01, 0.5, 0.01, new Value(1.0), g), new Value(0.5));
+}
+
+//an fm chain, errors in the modulators grow as they go down it
+static Module *fmChain() {
+	Module *m = sine(1.0);
+	for(int i = 1; i < 8; ++i)
+		m = new GenSine(new Add(new Mult(m, new Value(10.0)), new Value(100.0 * i)), new Value(0.0));
+	return m;
+}
+
+static Module *additive() {
+	Add *add = new Add();
+	for(int h = 1; h <= 16; ++h)
+		add->addChild(new Mult(sine(110.0 * h), new Value(0.5 / h)));
+	return add;
+}
+
+static Module *wavetable() {
+	std::vector<double> amplitudes;
+	for(int h = 1; h <= 16; ++h)
+		amplitudes.push_back(0.5 / h);
+	return new GenWavetable(Wavetable::fromHarmonics(amplitudes), new Add(new Mult(sine(3.0), new Value(50.0)), new Value(220.0)), new Value(0.0));
+}
+
+static Module *filtered() {
+	return new HighPass(new Value(200.0), new LowPass(new Value(800.0), new GenSawtooth(new Value(55.0), new Value(0.0))));
+}
+
+static Module *delayed() {
+	return new Delay(0.25, 0.5, new Mult(new GenTriangle(new Value(330.0), new Value(0.0)), new Value(0.5)), new Value(1.0),
+		new Add(new Mult(sine(0.5), new Value(0.01)), new Value(0.1)));
+}
+
+struct Case {
+	const char *name;
+	Module *(*build)();
+};
+
+static const Case CASES[] = {
+	{ "example voice", exampleVoice },
+	{ "fm chain, depth 8", fmChain },
+	{ "16 sines", additive },
+	{ "wavetable, vibrato", wavetable },
+	{ "saw, lowpass, highpass", filtered },
+	{ "modulated delay", delayed },
+};
+
+static void render(Module *(*build)(), std::vector<double> &out) {
+	Patch *p = new Patch(build());
+	p->compile();
+	out.resize(BLOCKS * MAX_BLOCK_SIZE);
+	for(int b = 0; b < BLOCKS; ++b) {
+		p->process(MAX_BLOCK_SIZE);
+		for(int i = 0; i < MAX_BLOCK_SIZE; ++i)
+			out[b * MAX_BLOCK_SIZE + i] = p->getOutput()[i];
+	}
+	delete p;
+}
+
+int main(int argc, char *argv[]) {
+	if(argc != 3 || (strcmp(argv[1], "write") != 0 && strcmp(argv[1], "compare") != 0)) {
+		fprintf(stderr, "usage: %s write|compare file\n", argv[0]);
+		return 1;
+	}
+	Waffle::sampleRate = SAMPLE_RATE;
+	bool write = strcmp(argv[1], "write") == 0;
+
+	FILE *f = fopen(argv[2], write ? "wb" : "rb");
+	if(f == NULL) {
+		fprintf(stderr, "can't open %s\n", argv[2]);
+		return 1;
+	}
+
+	if(!write)
+		printf("%-32s %12s %12s\n", "patch", "max error", "SNR");
+
+	int cases = sizeof(CASES) / sizeof(CASES[0]);
+	for(int c = 0; c < cases; ++c) {
+		std::vector<double> out;
+		render(CASES[c].build, out);
+
+		if(write) {
+			fwrite(&out[0], sizeof(double), out.size(), f);
+			continue;
+		}
+
+		std::vector<double> ref(out.size());
+		if(fread(&ref[0], sizeof(double), ref.size(), f) != ref.size()) {
+			fprintf(stderr, "%s is too short, write it with the other build\n", argv[2]);
+			return 1;
+		}
+
+		double worst = 0.0, signal = 0.0, noise = 0.0;
+		for(int i = 0, len = out.size(); i < len; ++i) {
+			double e = fabs(out[i] - ref[i]);
+			worst = std::max(worst, e);
+			signal += ref[i] * ref[i];
+			noise += e * e;
+		}
+		double snr = (noise > 0.0) ? 10.0 * log10(signal / noise) : INFINITY;
+		printf("%-32s %12.3g %9.1f dB\n", CASES[c].name, worst, snr);
+	}
+	fclose(f);
+	return 0;
+}
@@ -0,0 +1,133 @@
+// Waffle - arena.cpp
+// Bump allocator that a patch's modules are placed into
+/*
+Copyright (c) 2009-2010 Brett Lajzer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "arena.h"
+#include "Module.h"
+
+#include <cstdlib>
+#include <new>
+
+using namespace waffle;
+
+static thread_local Arena *s_current = NULL;
+
+Arena::Arena(size_t chunkSize) : m_top(NULL), m_chunkSize(chunkSize), m_used(0) {
+	//a chunk always holds at least one cache line
+	if(m_chunkSize < CACHE_LINE_SIZE)
+		m_chunkSize = CACHE_LINE_SIZE;
+	m_modules.reserve(32);
+}
+
+Arena::~Arena() {
+	//last made first, so a module goes before the inputs it was made from
+	for(int i = m_modules.size() - 1; i >= 0; --i)
+		m_modules[i].module->~Module();
+
+	for(int i = 0, len = m_chunks.size(); i < len; ++i)
+		free(m_chunks[i].begin);
+}
+
+Arena::Scope::Scope(Arena *arena) : m_prev(s_current) {
+	s_current = arena;
+}
+
+Arena::Scope::~Scope() {
+	s_current = m_prev;
+}
+
+Arena *Arena::current() {
+	return s_current;
+}
+
+void *Arena::allocate(size_t size) {
+	size = (size + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+
+	if(m_chunks.empty() || (size_t)(m_top - m_chunks.back().begin) < size) {
+		//each chunk twice the last, up to the size asked for in the constructor
+		size_t chunkSize = m_chunks.empty() ? CACHE_LINE_SIZE * 64 : (m_chunks.back().end - m_chunks.back().begin) * 2;
+		if(chunkSize > m_chunkSize)
+			chunkSize = m_chunkSize;
+		if(chunkSize < size)
+			chunkSize = size;
+
+		void *memory = NULL;
+		if(posix_memalign(&memory, CACHE_LINE_SIZE, chunkSize) != 0)
+			throw std::bad_alloc();
+
+		Chunk chunk;
+		chunk.begin = (char *)memory;
+		chunk.end = chunk.begin + chunkSize;
+		m_chunks.push_back(chunk);
+		m_top = chunk.end;
+	}
+
+	m_top -= size;
+	m_used += size;
+	return m_top;
+}
+
+bool Arena::owns(const void *p) const {
+	const char *c = (const char *)p;
+	for(int i = m_chunks.size() - 1; i >= 0; --i) {
+		if(c >= m_chunks[i].begin && c < m_chunks[i].end)
+			return true;
+	}
+	return false;
+}
+
+void *Arena::create(size_t size) {
+	Slot slot;
+	slot.begin = (char *)allocate(size);
+	slot.size = size;
+	slot.module = NULL;
+	m_pending.push_back(slot);
+	return slot.begin;
+}
+
+void Arena::adopt(Module *m) {
+	const char *c = (const char *)m;
+	for(int i = m_pending.size() - 1; i >= 0; --i) {
+		if(c >= m_pending[i].begin && c < m_pending[i].begin + m_pending[i].size) {
+			m_pending[i].module = m;
+			m_modules.push_back(m_pending[i]);
+			m_pending.erase(m_pending.begin() + i);
+			return;
+		}
+	}
+}
+
+void Arena::forget(void *p) {
+	for(int i = m_pending.size() - 1; i >= 0; --i) {
+		if(m_pending[i].begin == p) {
+			m_pending.erase(m_pending.begin() + i);
+			return;
+		}
+	}
+	for(int i = m_modules.size() - 1; i >= 0; --i) {
+		if(m_modules[i].begin == p) {
+			m_modules.erase(m_modules.begin() + i);
+			return;
+		}
+	}
+}
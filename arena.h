@@ -0,0 +1,100 @@
+// Waffle - arena.h
+// Bump allocator that a patch's modules are placed into
+/*
+Copyright (c) 2009-2010 Brett Lajzer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef _WAFFLE_ARENA_H_
+#define _WAFFLE_ARENA_H_
+
+#include <cstddef>
+#include <vector>
+
+namespace waffle {
+
+class Module;
+
+//module state is packed on cache line boundaries so two modules never share a line
+static const size_t CACHE_LINE_SIZE = 64;
+
+//! Memory for the modules of one patch. Modules made with new while a Scope is open are placed in the
+//! arena instead of the heap. Hand the arena to the Patch along with its modules: the patch owns it, and
+//! deleting the arena destroys every module it holds and frees the memory in one go.
+//! Don't delete modules that live in an arena yourself.
+class Arena {
+public:
+	Arena(size_t chunkSize = 16384);
+	~Arena();
+
+	//! makes this the current arena for the calling thread until it goes out of scope, scopes nest
+	class Scope {
+	public:
+		Scope(Arena *arena);
+		~Scope();
+	private:
+		Arena *m_prev;
+	};
+
+	//! the calling thread's current arena, NULL outside of any Scope
+	static Arena *current();
+
+	//! size bytes aligned to a cache line
+	void *allocate(size_t size);
+	bool owns(const void *p) const;
+
+	//! bytes handed out so far
+	size_t getUsed() const { return m_used; }
+
+private:
+	friend class Module;
+
+	//room for a module, destroyed along with the arena once its constructor adopt()s it
+	void *create(size_t size);
+	//a Module being constructed: if it lies in room from create() it's one of ours. The Module may not be at
+	//the start of that room, when it isn't the first base of the class
+	void adopt(Module *m);
+	//undo create() when the constructor throws
+	void forget(void *p);
+
+	struct Chunk {
+		char *begin;
+		char *end;
+	};
+
+	//chunks fill from the top down, so a module made inside another's constructor arguments (its input)
+	//lands below it and the graph ends up in memory in an order it can be evaluated in
+	std::vector<Chunk> m_chunks;
+	char *m_top;
+	size_t m_chunkSize;
+	size_t m_used;
+
+	struct Slot {
+		char *begin;
+		size_t size;
+		Module *module;	//NULL until adopted
+	};
+	//created but not adopted yet, innermost last: an input's constructor runs before its consumer's
+	std::vector<Slot> m_pending;
+	std::vector<Slot> m_modules;
+};
+
+}
+#endif
@@ -0,0 +1,52 @@
+/*
+Copyright (c) 2009-2010 Brett Lajzer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef _WAFFLE_AUX_H_
+#define _WAFFLE_AUX_H_
+
+#include "Module.h"
+
+#include <cstddef>
+
+namespace waffle {
+
+//! The input of an aux bus's effect: the sum of what patches send to it, written by Waffle. See Waffle::addAux()
+class AuxInput : public Module {
+public:
+	AuxInput() : Module(), m_in(NULL) {}
+
+	virtual void process(sample_t *out, int nframes);
+	//the sends are summed either way, keep reading along
+	virtual void skip(int nframes) { m_in += nframes; }
+	virtual bool isValid() { return true; }
+	//one sample per frame
+	virtual bool canStride() { return false; }
+
+private:
+	friend class Waffle;
+
+	//the rest of the current piece of the callback, set by Waffle before the effect renders it
+	const float *m_in;
+};
+
+}
+#endif
@@ -0,0 +1,58 @@
+/*
+Copyright (c) 2009-2010 Brett Lajzer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef _WAFFLE_BACKEND_H_
+#define _WAFFLE_BACKEND_H_
+
+#include <string>
+
+namespace waffle {
+
+//! Where the engine's audio goes: owns the output ports and drives the process callback
+class AudioBackend {
+public:
+	typedef void *Port;
+	typedef void (*ProcessCallback)(int nframes, void *arg);
+
+	virtual ~AudioBackend(){}
+
+	//! start/stop calling process with blocks of audio
+	virtual bool activate(ProcessCallback process, void *arg) = 0;
+	virtual void deactivate() = 0;
+
+	//! mono output ports, one per patch
+	virtual Port registerPort(const std::string &name) = 0;
+	virtual void unregisterPort(Port port) = 0;
+	virtual float *getPortBuffer(Port port, int nframes) = 0;
+
+	virtual float getSampleRate() = 0;
+	virtual int getBufferSize() = 0;
+
+	//! SCHED_FIFO priority of the thread calling process, -1 if it isn't realtime
+	virtual int getRealtimePriority() { return -1; }
+
+	//! buffers the audio system missed since activate(), for backends that can tell
+	virtual unsigned long getXrunCount() { return 0; }
+};
+
+}
+#endif
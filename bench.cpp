@@ -0,0 +1,531 @@
+/*
+Copyright (c) 2009-2010 Brett Lajzer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+// Waffle - bench.cpp
+// Offline benchmarks: single modules, synthetic patch shapes and whole-engine load.
+// Run with "make bench", optionally passing seconds of audio per case and worker threads: ./lw-bench 5 3
+
+#include "waffle.h"
+#include "fixed.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+using namespace waffle;
+
+static const float SAMPLE_RATE = 48000.0f;
+static const int BUFFER_SIZE = 256;
+
+static double g_seconds = 2.0;
+
+static double now() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+//samples is the number of samples produced, frames the length of audio rendered
+static void report(const std::string &name, double elapsed, double samples, double frames) {
+	printf("%-32s %10.2f ns/sample %10.2f Msamples/s %9.1fx realtime\n",
+		name.c_str(), elapsed * 1e9 / samples, samples / elapsed * 1e-6,
+		(frames / SAMPLE_RATE) / elapsed);
+}
+
+//time a module's own process() against fixed inputs, the rest of the patch runs once to fill them
+static void benchModule(const std::string &name, Module *m) {
+	Patch *p = new Patch(m);
+	if(!p->compile()) {
+		printf("%-32s failed to compile\n", name.c_str());
+		delete p;
+		return;
+	}
+
+	//warm up and reach a steady state (e.g. envelope sustain)
+	for(int i = 0; i < 100; ++i)
+		p->process(BUFFER_SIZE);
+
+	sample_t *out = new sample_t[MAX_BLOCK_SIZE];
+	long blocks = (long)(g_seconds * SAMPLE_RATE) / BUFFER_SIZE;
+	double start = now();
+	for(long i = 0; i < blocks; ++i)
+		m->process(out, BUFFER_SIZE);
+	double elapsed = now() - start;
+
+	report(name, elapsed, (double)blocks * BUFFER_SIZE, (double)blocks * BUFFER_SIZE);
+	delete [] out;
+	delete p;
+}
+
+//time a whole patch through the compiled schedule
+static void benchPatch(const std::string &name, Module *m, bool optimize = false, Arena *arena = NULL) {
+	Patch *p = new Patch(m, arena);
+	if(optimize)
+		p->optimize();
+	if(!p->compile()) {
+		printf("%-32s failed to compile\n", name.c_str());
+		delete p;
+		return;
+	}
+
+	long blocks = (long)(g_seconds * SAMPLE_RATE) / BUFFER_SIZE;
+	double start = now();
+	for(long i = 0; i < blocks; ++i)
+		p->process(BUFFER_SIZE);
+	double elapsed = now() - start;
+
+	report(name, elapsed, (double)blocks * BUFFER_SIZE, (double)blocks * BUFFER_SIZE);
+	delete p;
+}
+
+//time a patch through the modules or lowered to bytecode, in blocks of frames
+static void benchLowered(const std::string &name, Module *m, bool lower, int frames) {
+	Patch *p = new Patch(m);
+	if(!p->compile()) {
+		printf("%-32s failed to compile\n", name.c_str());
+		delete p;
+		return;
+	}
+	if(lower)
+		p->lower();
+
+	long blocks = (long)(g_seconds * SAMPLE_RATE) / frames;
+	double start = now();
+	for(long i = 0; i < blocks; ++i)
+		p->process(frames);
+	double elapsed = now() - start;
+
+	report(name, elapsed, (double)blocks * frames, (double)blocks * frames);
+	delete p;
+}
+
+static Module *sine(double freq) {
+	return new GenSine(new Value(freq), new Value(0.0));
+}
+
+//the lw-example voice, with the envelope held open or closed
+static Module *exampleVoice(double freq, double gate = 1.0) {
+	Module *g = new Add(new GenSine(new Value(freq), new Value(0.0)),
+						new GenSquare(new Add(new Mult(new GenSine(new Value(0.5), new Value(0.0)),
+												new Value(20.0)),new Value(freq)),
+										new Value(0.0),
+										new Value(0.5)));
+	return new Envelope(0.5, 0.01, 0.01, 0.5, 0.01, new Value(gate), g);
+}
+
+//the example voice written with Constants, and a vibrato LFO repeated per oscillator
+static Module *constantVoice(double freq) {
+	Module *vibrato = new Add(new Mult(new GenSine(new Constant(5.0), new Constant(0.0)), new Constant(2.0)), new Constant(freq));
+	Module *vibrato2 = new Add(new Mult(new GenSine(new Constant(5.0), new Constant(0.0)), new Constant(2.0)), new Constant(freq));
+	Add *g = new Add(new GenSine(vibrato, new Constant(0.0)),
+					new GenSquare(new Add(new Mult(new GenSine(new Constant(0.5), new Constant(0.0)),
+											new Constant(20.0)), vibrato2),
+									new Constant(0.0),
+									new Sub(new Constant(1.0), new Constant(0.5))));
+	Module *level = new Mult(new Mult(g, new Constant(0.5)), new Constant(0.8));
+	return new Envelope(0.5, 0.01, 0.01, 0.5, 0.01, new Value(1.0), level);
+}
+
+//constantVoice() as a fixed:: graph, the gate is read through the Value
+static Module *fixedVoice(double freq, Value *gate) {
+	namespace fx = waffle::fixed;
+	auto vibrato = fx::GenSine(5.0, 0.0) * 2.0 + freq;
+	auto g = fx::GenSine(vibrato, 0.0) + fx::GenSquare(fx::GenSine(0.5, 0.0) * 20.0 + vibrato, 0.0, 0.5);
+	return fx::module(fx::Envelope(0.5, 0.01, 0.01, 0.5, 0.01, gate, g * 0.4));
+}
+
+//oscillators each with their own vibrato LFO, at audio rate or through ControlRate
+static Module *vibratoBank(int width, int period) {
+	Add *add = new Add();
+	for(int i = 0; i < width; ++i) {
+		Module *lfo = new Add(new Mult(new GenSine(new Constant(4.0 + 0.1 * i), new Constant(0.0)), new Constant(3.0)),
+							new Constant(220.0 + 10.0 * i));
+		if(period > 0)
+			lfo = new ControlRate(lfo, period);
+		add->addChild(new GenSawtooth(lfo, new Constant(0.0)));
+	}
+	return new Mult(add, new Constant(1.0 / width));
+}
+
+//an fm chain: each oscillator's frequency is modulated by the next one down
+static Module *deepPatch(int depth) {
+	Module *m = sine(1.0);
+	for(int i = 1; i < depth; ++i)
+		m = new GenSine(new Add(new Mult(m, new Value(10.0)), new Value(100.0 * i)), new Value(0.0));
+	return m;
+}
+
+//a chain of filters and arithmetic on one oscillator, like patches generated by control software
+static Module *filterChain(int depth) {
+	Module *m = new GenSawtooth(new Value(110.0), new Value(0.0));
+	for(int i = 0; i < depth; ++i) {
+		if(i % 2 == 0)
+			m = new LowPass(new Value(4000.0 - 10.0 * i), m);
+		else
+			m = new Add(new Mult(m, new Value(0.9)), new Mult(new Abs(m), new Value(0.1)));
+	}
+	return m;
+}
+
+//a sawtooth-like timbre made of harmonics, as stacked sines
+static Module *additivePatch(double freq, int harmonics) {
+	Add *add = new Add();
+	for(int h = 1; h <= harmonics; ++h)
+		add->addChild(new Mult(sine(freq * h), new Value(1.0 / h)));
+	return add;
+}
+
+//the same timbre from a wavetable
+static Module *wavetablePatch(double freq, int harmonics) {
+	std::vector<double> amplitudes;
+	for(int h = 1; h <= harmonics; ++h)
+		amplitudes.push_back(1.0 / h);
+	return new GenWavetable(Wavetable::fromHarmonics(amplitudes), new Value(freq), new Value(0.0));
+}
+
+//a bank of oscillators summed into one output
+static Module *widePatch(int width) {
+	Add *add = new Add();
+	for(int i = 0; i < width; ++i)
+		add->addChild(sine(110.0 + i));
+	return new Mult(add, new Value(1.0 / width));
+}
+
+static void benchModules() {
+	printf("\n== modules ==\n");
+	benchModule("Value", new Value(1.0));
+	benchModule("GenSine", sine(440.0));
+	benchModule("GenTriangle", new GenTriangle(new Value(440.0), new Value(0.0)));
+	benchModule("GenSawtooth", new GenSawtooth(new Value(440.0), new Value(0.0)));
+	benchModule("GenRevSawtooth", new GenRevSawtooth(new Value(440.0), new Value(0.0)));
+	benchModule("GenSquare", new GenSquare(new Value(440.0), new Value(0.0), new Value(0.5)));
+	benchModule("GenWavetable", wavetablePatch(440.0, 16));
+	benchModule("GenNoise", new GenNoise());
+	benchModule("Add", new Add(new GenNoise(), new GenNoise()));
+	benchModule("Sub", new Sub(new GenNoise(), new GenNoise()));
+	benchModule("Mult", new Mult(new GenNoise(), new GenNoise()));
+	benchModule("Abs", new Abs(new GenNoise()));
+	benchModule("LowPass", new LowPass(new Value(1000.0), new GenNoise()));
+	benchModule("HighPass", new HighPass(new Value(1000.0), new GenNoise()));
+	benchModule("Envelope", new Envelope(0.5, 0.01, 0.01, 0.5, 0.01, new Value(1.0), new GenNoise()));
+	benchModule("Delay (0.5s)", new Delay(0.5, 0.5, new GenNoise(), new Value(1.0)));
+	benchModule("Delay (modulated)", new Delay(0.5, 0.5, new GenNoise(), new Value(1.0),
+		new Add(new Mult(sine(0.5), new Value(0.01)), new Value(0.25))));
+	Delay *tapped = new Delay(0.5, 0.5, new GenNoise(), new Value(1.0));
+	benchModule("DelayTap", new DelayTap(tapped, new Value(0.125)));
+}
+
+static void benchShapes() {
+	printf("\n== patch depth ==\n");
+	int depths[] = { 1, 4, 16, 64 };
+	for(int i = 0; i < 4; ++i) {
+		char name[64];
+		snprintf(name, sizeof(name), "fm chain, depth %d", depths[i]);
+		benchPatch(name, deepPatch(depths[i]));
+	}
+
+	printf("\n== patch width ==\n");
+	int widths[] = { 1, 4, 16, 64 };
+	for(int i = 0; i < 4; ++i) {
+		char name[64];
+		snprintf(name, sizeof(name), "oscillator bank, width %d", widths[i]);
+		benchPatch(name, widePatch(widths[i]));
+	}
+
+	printf("\n== silence ==\n");
+	benchPatch("example voice, held", exampleVoice(110.0));
+	benchPatch("example voice, envelope off", exampleVoice(110.0, 0.0));
+
+	printf("\n== optimizer ==\n");
+	Patch *p = new Patch(constantVoice(110.0));
+	int removed = p->optimize();
+	printf("%-32s %10d modules removed\n", "constant voice", removed);
+	delete p;
+	benchPatch("constant voice", constantVoice(110.0));
+	benchPatch("constant voice, optimized", constantVoice(110.0), true);
+
+	printf("\n== control rate ==\n");
+	benchPatch("16 vibrato voices, audio rate", vibratoBank(16, 0));
+	benchPatch("16 vibrato voices, every 64", vibratoBank(16, 64));
+	benchPatch("16 vibrato voices, every 256", vibratoBank(16, 256));
+
+	printf("\n== bytecode ==\n");
+	int frames[] = { 256, 32 };
+	for(int i = 0; i < 2; ++i) {
+		char name[64];
+		snprintf(name, sizeof(name), "fm chain 64, %d, modules", frames[i]);
+		benchLowered(name, deepPatch(64), false, frames[i]);
+		snprintf(name, sizeof(name), "fm chain 64, %d, bytecode", frames[i]);
+		benchLowered(name, deepPatch(64), true, frames[i]);
+		snprintf(name, sizeof(name), "filter chain 128, %d, modules", frames[i]);
+		benchLowered(name, filterChain(128), false, frames[i]);
+		snprintf(name, sizeof(name), "filter chain 128, %d, bytecode", frames[i]);
+		benchLowered(name, filterChain(128), true, frames[i]);
+	}
+
+	printf("\n== fixed patches ==\n");
+	Value *gate = new Value(1.0);
+	benchPatch("constant voice, optimized", constantVoice(110.0), true);
+	benchPatch("constant voice, fixed", fixedVoice(110.0, gate));
+	delete gate;
+
+	printf("\n== additive timbre ==\n");
+	int harmonics[] = { 4, 16 };
+	for(int i = 0; i < 2; ++i) {
+		char name[64];
+		snprintf(name, sizeof(name), "%d harmonics, GenSines", harmonics[i]);
+		benchPatch(name, additivePatch(110.0, harmonics[i]));
+		snprintf(name, sizeof(name), "%d harmonics, GenWavetable", harmonics[i]);
+		benchPatch(name, wavetablePatch(110.0, harmonics[i]));
+	}
+}
+
+//the lw-example voice, played by a VoicePool
+static Module *poolVoice(Module *freq, Module *gate, Module *velocity, void *arg) {
+	Module *g = new Add(new GenSine(freq, new Value(0.0)),
+						new GenSquare(freq, new Value(0.0), new Value(0.5)));
+	return new Mult(new Envelope(0.5, 0.01, 0.01, 0.5, 0.01, gate, g), velocity);
+}
+
+//a 64 voice pool with some of its voices sounding
+static void benchVoices() {
+	printf("\n== voice pool, 64 voices ==\n");
+	int held[] = { 8, 64 };
+	for(int i = 0; i < 2; ++i) {
+		VoicePool *pool = new VoicePool(64, poolVoice, NULL, VoicePool::STEAL_QUIETEST, true);
+		for(int n = 0; n < held[i]; ++n)
+			pool->noteOn(n, 110.0 + n, 1.0 / 64);
+
+		char name[64];
+		snprintf(name, sizeof(name), "%d notes held", held[i]);
+		benchPatch(name, pool);
+	}
+}
+
+//one big patch: a bank of filtered oscillators under a single envelope
+static Module *hugePatch(int width) {
+	Add *add = new Add();
+	for(int i = 0; i < width; ++i)
+		add->addChild(new LowPass(new Value(2000.0 + i), new GenSawtooth(new Value(55.0 + i), new Value(0.0))));
+	return new Envelope(0.5, 0.01, 0.01, 0.5, 0.01, new Value(1.0), new Mult(add, new Value(1.0 / width)));
+}
+
+//patches made, compiled and freed over and over, from the heap or an arena
+static void benchChurn() {
+	printf("\n== patch churn ==\n");
+	int count = (int)(g_seconds * 5000);
+	for(int useArena = 0; useArena < 2; ++useArena) {
+		double start = now();
+		for(int i = 0; i < count; ++i) {
+			Arena *arena = useArena ? new Arena() : NULL;
+			Arena::Scope scope(arena);
+			Patch *p = new Patch(exampleVoice(110.0 + i), arena);
+			p->compile();
+			delete p;
+		}
+		double elapsed = now() - start;
+		printf("%-32s %10.2f us/patch\n", useArena ? "example voice, arena" : "example voice, heap", elapsed * 1e6 / count);
+	}
+
+	//modules scattered between other allocations, against packed together
+	std::vector<void *> clutter;
+	Module *scattered;
+	{
+		Add *add = new Add();
+		for(int i = 0; i < 256; ++i) {
+			clutter.push_back(malloc(64 + (i * 37) % 512));
+			add->addChild(new LowPass(new Value(2000.0 + i), new GenSawtooth(new Value(55.0 + i), new Value(0.0))));
+		}
+		scattered = add;
+	}
+	benchPatch("256 voices, heap", scattered);
+	for(int i = 0, len = clutter.size(); i < len; ++i)
+		free(clutter[i]);
+
+	Arena *arena = new Arena();
+	Arena::Scope scope(arena);
+	Add *add = new Add();
+	for(int i = 0; i < 256; ++i)
+		add->addChild(new LowPass(new Value(2000.0 + i), new GenSawtooth(new Value(55.0 + i), new Value(0.0))));
+	benchPatch("256 voices, arena", add, false, arena);
+}
+
+//render one patch through the engine, returns the time taken
+static double benchSinglePatch(const std::string &name, Module *m, int threads) {
+	OfflineBackend *backend = new OfflineBackend(SAMPLE_RATE, BUFFER_SIZE);
+	Waffle *w = new Waffle(backend);
+	w->setWorkerThreads(threads);
+	w->addPatch("huge", new Patch(m));
+	w->start("huge");
+
+	long frames = (long)(g_seconds * SAMPLE_RATE);
+	double start = now();
+	backend->renderFrames(frames);
+	double elapsed = now() - start;
+
+	report(name, elapsed, (double)frames, (double)frames);
+	delete w;
+	return elapsed;
+}
+
+//a single wide patch split across threads against rendering it on one
+static void benchIntraPatch(int threads) {
+	printf("\n== single wide patch, %d worker threads ==\n", threads);
+	int widths[] = { 64, 256 };
+	for(int i = 0; i < 2; ++i) {
+		char name[64];
+		snprintf(name, sizeof(name), "%d voices, serial", widths[i]);
+		double serial = benchSinglePatch(name, hugePatch(widths[i]), 0);
+		snprintf(name, sizeof(name), "%d voices, parallel", widths[i]);
+		double parallel = benchSinglePatch(name, hugePatch(widths[i]), threads);
+		printf("%-32s %10.2fx\n", "speedup", serial / parallel);
+	}
+}
+
+//a quarter second echo, built around its input for addAux()
+static Module *echo(Module *input, void *) {
+	return new Delay(0.25, 0.0, input, new Constant(1.0));
+}
+
+//many playing patches through Waffle::run and the offline backend
+static void benchEngine(int threads) {
+	if(threads)
+		printf("\n== engine, %d worker threads ==\n", threads);
+	else
+		printf("\n== engine ==\n");
+
+	int counts[] = { 1, 10, 100 };
+	for(int c = 0; c < 3; ++c) {
+		OfflineBackend *backend = new OfflineBackend(SAMPLE_RATE, BUFFER_SIZE);
+		Waffle *w = new Waffle(backend);
+		w->setWorkerThreads(threads);
+
+		for(int i = 0; i < counts[c]; ++i) {
+			char name[32];
+			snprintf(name, sizeof(name), "voice%d", i);
+			w->addPatch(name, new Patch(exampleVoice(110.0 + i)));
+			w->start(name);
+		}
+
+		long frames = (long)(g_seconds * SAMPLE_RATE);
+		double start = now();
+		backend->renderFrames(frames);
+		double elapsed = now() - start;
+
+		char name[64];
+		snprintf(name, sizeof(name), "engine, %d example patches", counts[c]);
+		report(name, elapsed, (double)frames * counts[c], (double)frames);
+		delete w;
+	}
+
+	//the same, panned into one stereo bus instead of a port each
+	for(int c = 0; c < 3; ++c) {
+		OfflineBackend *backend = new OfflineBackend(SAMPLE_RATE, BUFFER_SIZE);
+		Waffle *w = new Waffle(backend);
+		w->setWorkerThreads(threads);
+		w->addBus("main", 2);
+
+		for(int i = 0; i < counts[c]; ++i) {
+			char name[32];
+			snprintf(name, sizeof(name), "voice%d", i);
+			w->addPatch(name, new Patch(exampleVoice(110.0 + i)), "main", 0.1f, (i % 9) / 4.0f - 1.0f);
+			w->start(name);
+		}
+
+		long frames = (long)(g_seconds * SAMPLE_RATE);
+		double start = now();
+		backend->renderFrames(frames);
+		double elapsed = now() - start;
+
+		char name[64];
+		snprintf(name, sizeof(name), "engine, %d patches on a bus", counts[c]);
+		report(name, elapsed, (double)frames * counts[c], (double)frames);
+		delete w;
+	}
+
+	//an echo on every patch, then one aux echo they all send to
+	for(int aux = 0; aux < 2; ++aux) {
+		for(int c = 0; c < 3; ++c) {
+			OfflineBackend *backend = new OfflineBackend(SAMPLE_RATE, BUFFER_SIZE);
+			Waffle *w = new Waffle(backend);
+			w->setWorkerThreads(threads);
+			w->addBus("main", 2);
+			if(aux)
+				w->addAux("echo", echo, NULL, "main", 0.5f);
+
+			for(int i = 0; i < counts[c]; ++i) {
+				char name[32];
+				snprintf(name, sizeof(name), "voice%d", i);
+				Module *voice = exampleVoice(110.0 + i);
+				if(!aux)
+					voice = new Add(voice, new Mult(echo(voice, NULL), new Constant(0.5)));
+				w->addPatch(name, new Patch(voice), "main", 0.1f, (i % 9) / 4.0f - 1.0f);
+				w->start(name);
+				if(aux)
+					w->setSend(name, "echo", 1.0f);
+			}
+
+			long frames = (long)(g_seconds * SAMPLE_RATE);
+			double start = now();
+			backend->renderFrames(frames);
+			double elapsed = now() - start;
+
+			char name[64];
+			snprintf(name, sizeof(name), aux ? "engine, %d patches, one aux echo" : "engine, %d patches, an echo each",
+				counts[c]);
+			report(name, elapsed, (double)frames * counts[c], (double)frames);
+			delete w;
+		}
+	}
+}
+
+int main(int argc, char *argv[]) {
+	if(argc > 1)
+		g_seconds = atof(argv[1]);
+
+	Waffle::sampleRate = SAMPLE_RATE;
+	Waffle::bufferSize = BUFFER_SIZE;
+
+	printf("waffle bench: %.1fs of audio per case, %.0f Hz, %d frame buffers, %s samples\n", g_seconds, SAMPLE_RATE, BUFFER_SIZE,
+		sizeof(sample_t) == sizeof(float) ? "float" : "double");
+	benchModules();
+	benchShapes();
+	benchVoices();
+	benchChurn();
+	benchEngine(0);
+
+	//a worker per spare cpu unless told otherwise. More workers than spare cpus measures what splitting costs
+	//when it can't pay off
+	int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int threads = (argc > 2) ? atoi(argv[2]) : cpus - 1;
+	if(threads > 0) {
+		if(threads >= cpus)
+			printf("\n%d worker threads on %d cpus: no speedup to expect below\n", threads, cpus);
+		benchEngine(threads);
+		benchIntraPatch(threads);
+	}
+	return 0;
+}
@@ -0,0 +1,419 @@
+/*
+Copyright (c) 2009-2010 Brett Lajzer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "bytecode.h"
+#include "filters.h"
+#include "generators.h"
+#include "waffle.h"
+
+#include <cmath>
+#include <typeinfo>
+
+using namespace waffle;
+
+Program::Program(Patch *patch) : m_registers(&patch->m_slots[0]), m_fallbacks(0) {
+	const std::vector<Module *> &schedule = patch->m_schedule;
+	m_constant = new bool[schedule.size()];
+	for(int i = 0, len = schedule.size(); i < len; ++i) {
+		m_lowered.push_back(lower(schedule[i]));
+		m_constant[i] = schedule[i]->m_constant;
+	}
+
+	//modules still running themselves read their inputs' flags from the modules, and so does whoever
+	//reads the patch's output
+	m_lowered.back().publish = true;
+	for(int i = 0, len = schedule.size(); i < len; ++i) {
+		if(m_lowered[i].op != OP_MODULE)
+			continue;
+		for(int n = 0, count = schedule[i]->getInputCount(); n < count; ++n)
+			m_lowered[reg(schedule[i]->getInput(n))].publish = true;
+	}
+
+	emit(schedule, patch->m_guards);
+	for(int p = 0, len = patch->m_parts.size(); p < len; ++p)
+		emit(patch->m_parts[p], patch->m_partGuards[p]);
+	if(!patch->m_parts.empty())
+		emit(patch->m_tail, patch->m_tailGuards);
+}
+
+Program::Instruction Program::lower(Module *m) {
+	Instruction ins = { OP_MODULE, false, reg(m), { 0, 0, 0 }, 0, m->m_stride, m };
+	const std::type_info &type = typeid(*m);
+
+	if(type == typeid(Value) || type == typeid(Constant)) {
+		Value *v = static_cast<Value *>(m);
+		ins.op = OP_VALUE;
+		ins.state = m_state.size();
+		m_state.push_back(v->m_filled == m->m_output ? v->m_filledFrames : 0);
+	} else if(type == typeid(GenSine) || type == typeid(GenTriangle) || type == typeid(GenSawtooth)
+		|| type == typeid(GenRevSawtooth) || type == typeid(GenSquare)) {
+		ins.op = (type == typeid(GenSine)) ? OP_SINE : (type == typeid(GenTriangle)) ? OP_TRIANGLE
+			: (type == typeid(GenSawtooth)) ? OP_SAWTOOTH : (type == typeid(GenRevSawtooth)) ? OP_REVSAWTOOTH : OP_SQUARE;
+		for(int n = 0, len = m->getInputCount(); n < len; ++n)
+			ins.in[n] = reg(m->getInput(n));
+		ins.state = m_state.size();
+		m_state.push_back(static_cast<WaveformGenerator *>(m)->m_pos);
+	} else if(type == typeid(Add) || type == typeid(Mult)) {
+		bool add = (type == typeid(Add));
+		ins.op = add ? OP_ADD : OP_MULT;
+		ins.in[0] = m_args.size();
+		ins.in[1] = m->getInputCount();
+		for(int n = 0, len = m->getInputCount(); n < len; ++n)
+			m_args.push_back(reg(m->getInput(n)));
+		ins.in[2] = add ? static_cast<Add *>(m)->hasOffset() : static_cast<Mult *>(m)->hasFactor();
+		ins.state = m_state.size();
+		m_state.push_back(add ? static_cast<Add *>(m)->getOffset() : static_cast<Mult *>(m)->getFactor());
+	} else if((type == typeid(Sub) && m->getInputCount() == 2) || (type == typeid(Abs) && m->getInputCount() == 1)) {
+		ins.op = (type == typeid(Sub)) ? OP_SUB : OP_ABS;
+		for(int n = 0, len = m->getInputCount(); n < len; ++n)
+			ins.in[n] = reg(m->getInput(n));
+	} else if((type == typeid(LowPass) || type == typeid(HighPass)) && m->getInputCount() == 2) {
+		ins.op = (type == typeid(LowPass)) ? OP_LOWPASS : OP_HIGHPASS;
+		ins.in[0] = reg(m->getInput(0));
+		ins.in[1] = reg(m->getInput(1));
+		ins.state = m_state.size();
+		m_state.push_back(type == typeid(LowPass) ? static_cast<LowPass *>(m)->m_prev : static_cast<HighPass *>(m)->m_prev);
+	} else if(type == typeid(Envelope) && m->getInputCount() == 2) {
+		ins.op = OP_ENVELOPE;
+		ins.in[0] = reg(m->getInput(0));
+		ins.in[1] = reg(m->getInput(1));
+		ins.state = m_envelopes.size();
+		m_envelopes.push_back(static_cast<Envelope *>(m)->m_env);
+	} else {
+		++m_fallbacks;
+	}
+	return ins;
+}
+
+void Program::emit(const std::vector<Module *> &modules, const std::vector<Patch::Guard> &guards) {
+	m_code.push_back(std::vector<Instruction>());
+	std::vector<Instruction> &code = m_code.back();
+
+	//guards go in front of the first module of their run, outermost first as Patch::run() takes them
+	std::vector<int> start(modules.size() + 1);
+	std::vector<int> ends;
+	for(int i = 0, g = 0, len = modules.size(); i <= len; ++i) {
+		start[i] = code.size();
+		for( ; g < (int)guards.size() && guards[g].begin == i; ++g) {
+			const Patch::Guard &guard = guards[g];
+			Instruction ins = { OP_GUARD, false, 0, { guard.input, 0, reg(guard.consumer) }, 0, 1, guard.consumer };
+			code.push_back(ins);
+			ends.push_back(guard.end);
+		}
+		if(i < len)
+			code.push_back(m_lowered[reg(modules[i])]);
+	}
+
+	for(int pc = 0, g = 0, len = code.size(); pc < len; ++pc) {
+		if(code[pc].op == OP_GUARD)
+			code[pc].in[1] = start[ends[g++]];
+	}
+}
+
+Program::~Program() {
+	for(int r = 0, len = m_lowered.size(); r < len; ++r) {
+		const Instruction &ins = m_lowered[r];
+		Module *m = ins.module;
+		if(ins.op != OP_MODULE)
+			m->m_constant = m_constant[r];
+
+		switch(ins.op) {
+			case OP_VALUE:
+				if(m_state[ins.state] > 0) {
+					static_cast<Value *>(m)->m_filled = m->m_output;
+					static_cast<Value *>(m)->m_filledFrames = (int)m_state[ins.state];
+				}
+				break;
+			case OP_SINE: case OP_TRIANGLE: case OP_SAWTOOTH: case OP_REVSAWTOOTH: case OP_SQUARE:
+				static_cast<WaveformGenerator *>(m)->m_pos = m_state[ins.state];
+				break;
+			case OP_LOWPASS:
+				static_cast<LowPass *>(m)->m_prev = m_state[ins.state];
+				break;
+			case OP_HIGHPASS:
+				static_cast<HighPass *>(m)->m_prev = m_state[ins.state];
+				break;
+			case OP_ENVELOPE:
+				static_cast<Envelope *>(m)->m_env = m_envelopes[ins.state];
+				break;
+		}
+	}
+	delete [] m_constant;
+}
+
+static void fill(sample_t * __restrict out, sample_t v, int nframes) {
+	for(int i = 0; i < nframes; ++i)
+		out[i] = v;
+}
+
+//shape counts from sine in the order of the opcodes
+static double oscillate(int shape, sample_t * __restrict out, const sample_t * __restrict freq, bool freqConstant,
+	const sample_t * __restrict phase, bool phaseConstant, const sample_t * __restrict thresh,
+	double start, double scale, int nframes) {
+	alignas(32) double pos[MAX_BLOCK_SIZE];
+	double next = kernels::advance(pos, freq, freqConstant, phase, phaseConstant, start, scale, nframes);
+	switch(shape) {
+		case 0: kernels::sine(out, pos, nframes); break;
+		case 1: kernels::triangle(out, pos, nframes); break;
+		case 2: kernels::sawtooth(out, pos, nframes); break;
+		case 3: kernels::revSawtooth(out, pos, nframes); break;
+		default: kernels::square(out, pos, thresh, nframes); break;
+	}
+	return next;
+}
+
+//one block of the code from begin to end. the same arithmetic as the modules' process(), see kernels.h,
+//except that pure modules whose inputs are all constant work out one sample and copy it (which gives the
+//same bits), and Add and Mult take their first two inputs in one pass
+void Program::run(const Instruction *code, int begin, int end, int nframes) {
+	for(int pc = begin; pc < end; ++pc) {
+		const Instruction &ins = code[pc];
+		sample_t * __restrict out = slot(ins.out);
+
+		switch(ins.op) {
+			case OP_GUARD:
+				if(!needs(ins, nframes)) {
+					//guards inside the run go with it
+					for(int k = pc + 1; k < ins.in[1]; ++k)
+						skip(code, k, nframes);
+					pc = ins.in[1] - 1;
+				}
+				continue;
+			case OP_VALUE: {
+				sample_t v = (sample_t)static_cast<Value *>(ins.module)->m_value;
+				double &filled = m_state[ins.state];
+				m_constant[ins.out] = true;
+				if(nframes <= filled && out[0] == v)
+					break;
+				fill(out, v, nframes);
+				filled = nframes;
+				break;
+			}
+			case OP_SINE: case OP_TRIANGLE: case OP_SAWTOOTH: case OP_REVSAWTOOTH: case OP_SQUARE:
+				m_state[ins.state] = oscillate(ins.op - OP_SINE, out, slot(ins.in[0]), m_constant[ins.in[0]], slot(ins.in[1]),
+					m_constant[ins.in[1]], slot(ins.in[2]), m_state[ins.state], ins.stride / Waffle::sampleRate, nframes);
+				m_constant[ins.out] = false;
+				break;
+			case OP_ADD: {
+				const int *args = &m_args[0] + ins.in[0];
+				int count = ins.in[1];
+				bool constant = true;
+				for(int c = 0; c < count; ++c)
+					constant = constant && m_constant[args[c]];
+				int len = constant ? 1 : nframes;
+
+				if(count == 0) {
+					out[0] = (sample_t)m_state[ins.state];
+				} else if(count == 1) {
+					const sample_t * __restrict a = slot(args[0]);
+					for(int i = 0; i < len; ++i)
+						out[i] = a[i];
+				} else {
+					const sample_t * __restrict a = slot(args[0]);
+					const sample_t * __restrict b = slot(args[1]);
+					for(int i = 0; i < len; ++i)
+						out[i] = a[i] + b[i];
+				}
+				for(int c = 2; c < count; ++c) {
+					const sample_t * __restrict in = slot(args[c]);
+					for(int i = 0; i < len; ++i)
+						out[i] += in[i];
+				}
+				if(count > 0 && ins.in[2]) {
+					sample_t offset = (sample_t)m_state[ins.state];
+					for(int i = 0; i < len; ++i)
+						out[i] += offset;
+				}
+
+				if(constant)
+					fill(out + 1, out[0], nframes - 1);
+				m_constant[ins.out] = constant;
+				break;
+			}
+			case OP_MULT: {
+				const int *args = &m_args[0] + ins.in[0];
+				int count = ins.in[1];
+				sample_t factor = (sample_t)m_state[ins.state];
+
+				//children after a silent one may have been skipped, a zero factor is the same
+				bool silent = (count == 0) || (ins.in[2] && factor == 0.0);
+				bool constant = true;
+				for(int c = 0; c < count && !silent; ++c) {
+					silent = m_constant[args[c]] && slot(args[c])[0] == 0.0;
+					constant = constant && m_constant[args[c]];
+				}
+				if(silent) {
+					fill(out, (count == 0) ? factor : 0.0, nframes);
+					m_constant[ins.out] = true;
+					break;
+				}
+				int len = constant ? 1 : nframes;
+
+				const sample_t * __restrict a = slot(args[0]);
+				if(count == 1) {
+					for(int i = 0; i < len; ++i)
+						out[i] = a[i];
+				} else {
+					const sample_t * __restrict b = slot(args[1]);
+					for(int i = 0; i < len; ++i)
+						out[i] = a[i] * b[i];
+				}
+				for(int c = 2; c < count; ++c) {
+					const sample_t * __restrict in = slot(args[c]);
+					for(int i = 0; i < len; ++i)
+						out[i] *= in[i];
+				}
+				if(ins.in[2]) {
+					for(int i = 0; i < len; ++i)
+						out[i] *= factor;
+				}
+
+				if(constant)
+					fill(out + 1, out[0], nframes - 1);
+				m_constant[ins.out] = constant;
+				break;
+			}
+			case OP_SUB: {
+				const sample_t * __restrict a = slot(ins.in[0]);
+				const sample_t * __restrict b = slot(ins.in[1]);
+				bool constant = m_constant[ins.in[0]] && m_constant[ins.in[1]];
+				if(constant) {
+					fill(out, a[0] - b[0], nframes);
+				} else {
+					for(int i = 0; i < nframes; ++i)
+						out[i] = a[i] - b[i];
+				}
+				m_constant[ins.out] = constant;
+				break;
+			}
+			case OP_ABS: {
+				const sample_t * __restrict in = slot(ins.in[0]);
+				bool constant = m_constant[ins.in[0]];
+				if(constant) {
+					fill(out, fabs(in[0]), nframes);
+				} else {
+					for(int i = 0; i < nframes; ++i)
+						out[i] = fabs(in[i]);
+				}
+				m_constant[ins.out] = constant;
+				break;
+			}
+			case OP_LOWPASS:
+				m_state[ins.state] = kernels::lowPass(out, slot(ins.in[0]), slot(ins.in[1]), m_state[ins.state],
+					ins.stride / Waffle::sampleRate, nframes);
+				m_constant[ins.out] = false;
+				break;
+			case OP_HIGHPASS:
+				m_state[ins.state] = kernels::highPass(out, slot(ins.in[0]), slot(ins.in[1]), m_state[ins.state],
+					ins.stride / Waffle::sampleRate, nframes);
+				m_constant[ins.out] = false;
+				break;
+			case OP_ENVELOPE: {
+				kernels::EnvelopeState &env = m_envelopes[ins.state];
+				const sample_t *trigger = slot(ins.in[1]);
+
+				//nothing to do while off, the signal may not even have been rendered
+				if(env.staysOff(trigger, m_constant[ins.in[1]], nframes)) {
+					fill(out, 0.0, nframes);
+					m_constant[ins.out] = true;
+					break;
+				}
+
+				const sample_t *data = slot(ins.in[0]);
+				for(int i = 0; i < nframes; ++i)
+					out[i] = env.step(data[i], trigger[i], ins.stride);
+				m_constant[ins.out] = false;
+				break;
+			}
+			case OP_MODULE:
+				ins.module->m_constant = false;
+				ins.module->process(out, nframes);
+				m_constant[ins.out] = ins.module->m_constant;
+				continue;
+		}
+
+		if(ins.publish)
+			ins.module->m_constant = m_constant[ins.out];
+	}
+}
+
+void Program::runProfiled(const Instruction *code, int end, int nframes, Profiler *profiler) {
+	for(int pc = 0; pc < end; ++pc) {
+		const Instruction &ins = code[pc];
+		if(ins.op == OP_GUARD) {
+			if(!needs(ins, nframes)) {
+				for(int k = pc + 1; k < ins.in[1]; ++k)
+					skip(code, k, nframes);
+				pc = ins.in[1] - 1;
+			}
+			continue;
+		}
+
+		uint64_t start = ticks();
+		run(code, pc, pc + 1, nframes);
+		profiler->addModule(typeid(*ins.module), ticks() - start);
+	}
+}
+
+//what the modules' skip() does
+void Program::skip(const Instruction *code, int pc, int nframes) {
+	const Instruction &ins = code[pc];
+	switch(ins.op) {
+		case OP_VALUE: case OP_ADD: case OP_MULT: case OP_SUB: case OP_ABS:
+			run(code, pc, pc + 1, nframes);
+			break;
+		case OP_SINE: case OP_TRIANGLE: case OP_SAWTOOTH: case OP_REVSAWTOOTH: case OP_SQUARE:
+			m_state[ins.state] = kernels::skipPhase(m_state[ins.state], slot(ins.in[0]), ins.stride / Waffle::sampleRate, nframes);
+			break;
+		case OP_ENVELOPE: {
+			kernels::EnvelopeState &env = m_envelopes[ins.state];
+			const sample_t *trigger = slot(ins.in[1]);
+			for(int i = 0; i < nframes; ++i)
+				env.step(0.0, trigger[i], ins.stride);
+			break;
+		}
+		case OP_MODULE:
+			ins.module->skip(nframes);
+			m_constant[ins.out] = ins.module->m_constant;
+			break;
+	}
+}
+
+bool Program::needs(const Instruction &guard, int nframes) {
+	const Instruction &consumer = m_lowered[guard.in[2]];
+	switch(consumer.op) {
+		case OP_ENVELOPE:
+			return !m_envelopes[consumer.state].staysOff(slot(consumer.in[1]), m_constant[consumer.in[1]], nframes);
+		case OP_MULT: {
+			if(consumer.in[2] && m_state[consumer.state] == 0.0)
+				return false;
+			const int *args = &m_args[0] + consumer.in[0];
+			for(int c = 0; c < guard.in[0]; ++c) {
+				if(m_constant[args[c]] && slot(args[c])[0] == 0.0)
+					return false;
+			}
+			return true;
+		}
+		default:
+			return consumer.module->needsInput(guard.in[0], nframes);
+	}
+}
@@ -0,0 +1,121 @@
+/*
+Copyright (c) 2009-2010 Brett Lajzer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef _WAFFLE_BYTECODE_H_
+#define _WAFFLE_BYTECODE_H_
+
+#include "Module.h"
+#include "kernels.h"
+#include "patch.h"
+
+#include <map>
+#include <vector>
+
+namespace waffle {
+
+//! A compiled patch lowered to register bytecode, see Patch::lower(). The registers are the patch's
+//! output slots. Values, oscillators, arithmetic, one pole filters and envelopes become
+//! opcodes run by one dispatch loop, with their state copied into flat arrays. Everything else runs through
+//! its own process() from the same loop. The output is sample for sample what the modules would render.
+class Program {
+public:
+	Program(Patch *patch);
+	//hands the state back to the modules
+	~Program();
+
+	//the whole schedule, or one of the patch's parts or its tail, which share the state. With a
+	//profiler, every instruction is timed for its module's class
+	void run(int nframes, Profiler *profiler = NULL) { run(m_code[0], nframes, profiler); }
+	void runPart(int part, int nframes, Profiler *profiler = NULL) { run(m_code[part + 1], nframes, profiler); }
+	void runTail(int nframes, Profiler *profiler = NULL) { run(m_code.back(), nframes, profiler); }
+
+	int getInstructionCount() const { return m_code[0].size(); }
+	//modules without an opcode of their own, run through process()
+	int getFallbackCount() const { return m_fallbacks; }
+
+private:
+	enum Opcode {
+		OP_VALUE,
+		OP_SINE,
+		OP_TRIANGLE,
+		OP_SAWTOOTH,
+		OP_REVSAWTOOTH,
+		OP_SQUARE,
+		OP_ADD,
+		OP_MULT,
+		OP_SUB,
+		OP_ABS,
+		OP_LOWPASS,
+		OP_HIGHPASS,
+		OP_ENVELOPE,
+		OP_MODULE,	//anything else, through process()
+		OP_GUARD	//skip to end unless the consumer needs its input, see Patch::Guard
+	};
+
+	struct Instruction {
+		short op;
+		//the module's isConstant() has to be kept current, someone outside the program reads it
+		bool publish;
+		int out;
+		//input registers in the order getInput() has them. ADD and MULT: first of their arguments in
+		//m_args, count and whether there's an offset or factor. GUARD: input, end and the consumer in m_lowered
+		int in[3];
+		//index into m_state (m_envelopes for ENVELOPE)
+		int state;
+		int stride;
+		Module *module;
+	};
+
+	Instruction lower(Module *m);
+	void emit(const std::vector<Module *> &modules, const std::vector<Patch::Guard> &guards);
+	void run(const std::vector<Instruction> &code, int nframes, Profiler *profiler) {
+		if(profiler != NULL)
+			runProfiled(&code[0], code.size(), nframes, profiler);
+		else
+			run(&code[0], 0, code.size(), nframes);
+	}
+	void run(const Instruction *code, int begin, int end, int nframes);
+	//one instruction at a time between two counter reads
+	void runProfiled(const Instruction *code, int end, int nframes, Profiler *profiler);
+
+	int reg(Module *m) const { return (m->m_output - m_registers) / MAX_BLOCK_SIZE; }
+	sample_t *slot(int r) const { return m_registers + r * MAX_BLOCK_SIZE; }
+
+	void skip(const Instruction *code, int pc, int nframes);
+	bool needs(const Instruction &guard, int nframes);
+
+	//the schedule, then the parts and the tail if there are any
+	std::vector< std::vector<Instruction> > m_code;
+	//every module of the schedule, by register
+	std::vector<Instruction> m_lowered;
+	std::vector<int> m_args;
+	std::vector<double> m_state;
+	std::vector<kernels::EnvelopeState> m_envelopes;
+
+	sample_t *m_registers;
+	//isConstant() of every register
+	bool *m_constant;
+	int m_fallbacks;
+};
+
+}
+#endif
@@ -0,0 +1,95 @@
+/*
+Copyright (c) 2009-2010 Brett Lajzer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "controlrate.h"
+
+#include <algorithm>
+#include <set>
+
+using namespace waffle;
+
+ControlRate::ControlRate(Module *m, int period) : Module(), m_period(std::max(period, 1)), m_valid(true), m_started(false),
+	m_next(0.0), m_step(0.0), m_left(0) {
+	std::set<Module *> modules;
+	modules.insert(m);
+	m->gatherSubModules(modules);
+	for(std::set<Module *>::iterator it = modules.begin(); it != modules.end(); ++it) {
+		if(!(*it)->canStride()) {
+			std::cerr << "ControlRate: subgraph has a module that has to run at audio rate" << std::endl;
+			m_valid = false;
+		}
+		(*it)->m_stride = m_period;
+	}
+
+	//the modules may be in the arena being filled, which outlives this. Not optimized here, that would delete
+	//modules the caller may hold: an optimized patch has its subgraphs optimized before they're inferred
+	m_patch = new Patch(m, Arena::current(), false);
+	if(m_valid && !m_patch->compile()) {
+		std::cerr << "ControlRate: subgraph failed to compile" << std::endl;
+		m_valid = false;
+	}
+}
+
+ControlRate::~ControlRate() {
+	delete m_patch;
+}
+
+void ControlRate::process(sample_t *out, int nframes) {
+	if(!m_valid) {
+		for(int i = 0; i < nframes; ++i)
+			out[i] = 0.0;
+		m_constant = true;
+		return;
+	}
+
+	//each frame of the subgraph is the value at the next control point, starting with this one
+	if(!m_started) {
+		m_patch->process(1);
+		m_next = m_patch->getOutput()[0];
+		m_started = true;
+	}
+
+	int points = (nframes > m_left) ? (nframes - m_left + m_period - 1) / m_period : 0;
+	if(points > 0)
+		m_patch->process(points);
+	const sample_t *values = m_patch->getOutput();
+
+	bool flat = true;
+	for(int i = 0, point = 0; i < nframes; ) {
+		if(m_left == 0) {
+			double prev = m_next;
+			m_next = values[point++];
+			m_step = (m_next - prev) / m_period;
+			m_left = m_period;
+		}
+
+		int n = std::min(m_left, nframes - i);
+		double start = m_next - m_step * m_left;
+		for(int j = 0; j < n; ++j)
+			out[i + j] = start + m_step * j;
+
+		flat = flat && m_step == 0.0;
+		i += n;
+		m_left -= n;
+	}
+	m_constant = flat;
+}
@@ -0,0 +1,68 @@
+/*
+Copyright (c) 2009-2010 Brett Lajzer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef _WAFFLE_CONTROLRATE_H_
+#define _WAFFLE_CONTROLRATE_H_
+
+#include "Module.h"
+#include "patch.h"
+
+namespace waffle {
+
+//! samples between control points when none is given
+static const int CONTROL_PERIOD = 64;
+//! fastest oscillator Patch::inferControlRate() treats as a slow modulation source, Hz
+static const double CONTROL_MAX_FREQ = 20.0;
+
+//! Runs a slow subgraph (an LFO, a modulation envelope) once every period samples instead of every sample,
+//! and ramps linearly between the points. The subgraph becomes a patch of its own, rendering a frame per
+//! control point, so it can't share modules with the rest of the patch. Good for inputs that only modulate:
+//! an oscillator's frequency or phase, a filter cutoff, a delay time. See Patch::inferControlRate() to have
+//! patches wrapped automatically.
+class ControlRate : public Module {
+public:
+	ControlRate(Module *m, int period = CONTROL_PERIOD);
+	virtual ~ControlRate();
+
+	virtual void process(sample_t *out, int nframes);
+	virtual bool isValid() { return m_valid; }
+	virtual void skip(int nframes) { process(m_output, nframes); }
+	//its subgraph already runs on its own clock
+	virtual bool canStride() { return false; }
+
+	int getPeriod() const { return m_period; }
+
+private:
+	friend class Patch;
+
+	Patch *m_patch;
+	int m_period;
+	bool m_valid;
+
+	bool m_started;
+	double m_next;	//value at the next control point
+	double m_step;	//per sample change until then
+	int m_left;		//samples to the next control point
+};
+
+}
+#endif
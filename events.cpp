@@ -0,0 +1,122 @@
+/*
+Copyright (c) 2009-2010 Brett Lajzer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "events.h"
+
+using namespace waffle;
+
+unsigned EventQueue::ms_opened = 0;
+std::atomic<unsigned> EventQueue::ms_closed(0);
+unsigned EventQueue::ms_visible = 0;
+
+bool EventTarget::post(uint64_t frame, double value, bool trigger, unsigned batch) {
+	EventQueue *events = m_events.load(std::memory_order_acquire);
+	if(events == NULL)
+		return false;
+
+	Event e = { frame, this, value, trigger, batch };
+	return events->push(e);
+}
+
+EventQueue::EventQueue() : m_head(0), m_tail(0), m_count(0) {
+	for(unsigned i = 0; i < QUEUE_SIZE; ++i)
+		m_queue[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+bool EventQueue::push(const Event &e) {
+	unsigned pos = m_head.load(std::memory_order_relaxed);
+	for(;;) {
+		Slot &slot = m_queue[pos % QUEUE_SIZE];
+		unsigned sequence = slot.sequence.load(std::memory_order_acquire);
+		int diff = (int)(sequence - pos);
+		if(diff == 0) {
+			if(m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+				slot.event = e;
+				slot.sequence.store(pos + 1, std::memory_order_release);
+				return true;
+			}
+		} else if(diff < 0) {
+			return false;	//full
+		} else {
+			pos = m_head.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+bool EventQueue::pop(Event &e) {
+	Slot &slot = m_queue[m_tail % QUEUE_SIZE];
+	if((int)(slot.sequence.load(std::memory_order_acquire) - (m_tail + 1)) < 0)
+		return false;
+	//still being built, the rest of the queue waits behind it
+	if(slot.event.batch != 0 && (int)(slot.event.batch - ms_visible) > 0)
+		return false;
+
+	e = slot.event;
+	slot.sequence.store(m_tail + QUEUE_SIZE, std::memory_order_release);
+	++m_tail;
+	return true;
+}
+
+unsigned EventQueue::openBatch() {
+	//0 is no batch
+	if(++ms_opened == 0)
+		++ms_opened;
+	return ms_opened;
+}
+
+void EventQueue::closeBatch(unsigned batch) {
+	ms_closed.store(batch, std::memory_order_release);
+}
+
+void EventQueue::insert(const Event &e) {
+	//usually pushed in time order, so look from the back
+	int i = m_count;
+	while(i > 0 && m_pending[i - 1].frame > e.frame) {
+		m_pending[i] = m_pending[i - 1];
+		--i;
+	}
+	m_pending[i] = e;
+	++m_count;
+}
+
+void EventQueue::apply(uint64_t frame) {
+	//whatever doesn't fit stays in the queue until some are applied
+	Event e;
+	while(m_count < (int)QUEUE_SIZE && pop(e))
+		insert(e);
+
+	while(m_count > 0 && m_pending[0].frame <= frame) {
+		e = m_pending[0];
+		--m_count;
+		for(int i = 0; i < m_count; ++i)
+			m_pending[i] = m_pending[i + 1];
+
+		e.target->receive(e.value);
+		if(e.trigger) {
+			//takes the place of the trigger, so there is always room. Late triggers still get their frame
+			e.frame = (e.frame < frame ? frame : e.frame) + 1;
+			e.value = 0.0;
+			e.trigger = false;
+			insert(e);
+		}
+	}
+}
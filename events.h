@@ -0,0 +1,116 @@
+/*
+Copyright (c) 2009-2010 Brett Lajzer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef _WAFFLE_EVENTS_H_
+#define _WAFFLE_EVENTS_H_
+
+#include <atomic>
+#include <cstddef>
+#include <stdint.h>
+
+namespace waffle {
+
+class EventQueue;
+
+//! A module that can be changed at an exact frame. Value and the OSC modules are targets.
+class EventTarget {
+public:
+	EventTarget() : m_events(NULL) {}
+	virtual ~EventTarget() {}
+
+	//on the audio thread between two blocks, at the event's frame
+	virtual void receive(double value) = 0;
+
+protected:
+	//queue value for an absolute frame (see Waffle::getFrame()), from any thread. A trigger is a one frame
+	//pulse: value for that frame, then 0. batch is 0 or one from EventQueue::openBatch(). False if the
+	//module isn't in a patch added to a Waffle, or the patch's queue is full
+	bool post(uint64_t frame, double value, bool trigger = false, unsigned batch = 0);
+	//whether the module is in a patch added to a Waffle, so the audio thread may be reading it
+	bool isAttached() const { return m_events.load(std::memory_order_acquire) != NULL; }
+
+private:
+	friend class Patch;
+
+	//the queue of the patch the module is in, set by Waffle::addPatch()
+	std::atomic<EventQueue *> m_events;
+};
+
+//! A change to a target at an absolute frame
+struct Event {
+	uint64_t frame;
+	EventTarget *target;
+	double value;
+	bool trigger;
+	unsigned batch;
+};
+
+//! Timed events for one patch. Any thread pushes, the audio thread keeps them in frame order and applies
+//! them when the patch gets there, see Patch::render()
+class EventQueue {
+public:
+	EventQueue();
+
+	bool push(const Event &e);
+
+	//audio thread: take in everything pushed so far, then apply the events due by frame. Late ones are applied now
+	void apply(uint64_t frame);
+
+	//events pushed with a batch wait, along with whatever is pushed to the same queue after them, until it is
+	//closed. Then a callback applies all of them or none, in every patch. For OSC bundles: one thread at a
+	//time builds batches
+	static unsigned openBatch();
+	static void closeBatch(unsigned batch);
+	//called by Waffle at the start of a callback, which applies the batches closed by then
+	static void startCallback() { ms_visible = ms_closed.load(std::memory_order_acquire); }
+	//the frame of the earliest pending event, NONE if there isn't one
+	uint64_t next() const { return m_count ? m_pending[0].frame : NONE; }
+
+	static const uint64_t NONE = ~(uint64_t)0;
+
+private:
+	//bounded multi-producer queue, as in VoicePool
+	static const unsigned QUEUE_SIZE = 256;
+	struct Slot {
+		std::atomic<unsigned> sequence;
+		Event event;
+	};
+
+	bool pop(Event &e);
+	void insert(const Event &e);
+
+	static unsigned ms_opened;
+	static std::atomic<unsigned> ms_closed;
+	//audio thread, workers read it during the callback
+	static unsigned ms_visible;
+
+	Slot m_queue[QUEUE_SIZE];
+	std::atomic<unsigned> m_head;
+	unsigned m_tail;
+
+	//audio thread only: popped events by frame, equal frames in the order they were pushed
+	Event m_pending[QUEUE_SIZE];
+	int m_count;
+};
+
+}
+#endif
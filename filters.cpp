@@ -27,12 +27,17 @@ THE SOFTWARE.
 
 using namespace waffle;
 
-static const double PI = 3.141592653589732384626;
-static const double TWO_PI = 2.0 * PI;
+bool Filter::childrenConstant() {
+	for(int i = 0; i < m_children.size(); ++i) {
+		if(!m_children[i]->isConstant())
+			return false;
+	}
+	return true;
+}
 
 //filter isValid
 bool Filter::isValid() {
-	for(int i; i < m_children.size(); ++i) {
+	for(int i = 0; i < m_children.size(); ++i) {
 		if(!m_children[i]->isValid())
 			return false;
 	}
@@ -60,146 +65,87 @@ void Filter::addChild(Module *m){
 	m_children.push_back(m);
 }
 
-void Filter::reset() {
-	if(!m_dirtyCache) {
-		m_dirtyCache = true;
-		for(int i; i < m_children.size(); ++i) {
-			m_children[i]->reset();
-		}
-	}
-}
-
-void Filter::gatherSubModules(std::set<Module *> &modules) {
-	for(int i = 0; i < m_children.size(); ++i) {
-		Module *pChild = m_children[i];
-		pChild->gatherSubModules(modules);
-		modules.insert(pChild);
-	}
-}
-
 //obligatory ADSR envelope
 Envelope::Envelope(double thresh, double a, double d, double s, double r, Module *t, Module *i):
-m_thresh(thresh), m_attack(a), m_decay(d), m_sustain(s), m_release(r), m_a_c(0), m_d_c(0), m_r_c(0), m_volume(0.0)
+m_attack(a), m_decay(d), m_release(r)
 {
 	m_children.push_back(i);
 	m_trig = t;
-	m_a_t = (int)(a * Waffle::sampleRate);
-	m_d_t = (int)(d * Waffle::sampleRate);
-	m_r_t = (int)(r * Waffle::sampleRate);
-	m_state = Envelope::OFF;
+	m_env.thresh = thresh;
+	m_env.sustain = s;
+	m_env.a_t = (int)(a * Waffle::sampleRate);
+	m_env.d_t = (int)(d * Waffle::sampleRate);
+	m_env.r_t = (int)(r * Waffle::sampleRate);
 }
 
 void Envelope::setThresh(double t){
-	m_thresh = t;
+	m_env.thresh = t;
 }
 
 void Envelope::setAttack(double a){
-	m_a_t = (int)(a * Waffle::sampleRate);
+	m_env.a_t = (int)(a * Waffle::sampleRate);
 }
 
 void Envelope::setDecay(double d){
-	m_d_t = (int)(d * Waffle::sampleRate);
+	m_env.d_t = (int)(d * Waffle::sampleRate);
 }
 
 void Envelope::setSustain(double s){
-	m_sustain = s;
+	m_env.sustain = s;
 }
 
 void Envelope::setRelease(double r){
-	m_r_t = (int)(r * Waffle::sampleRate);
+	m_env.r_t = (int)(r * Waffle::sampleRate);
 }
 
-void Envelope::reset() {
-	if(!m_dirtyCache) {
-		m_dirtyCache = true;
-		for(int i; i < m_children.size(); ++i) {
-			m_children[i]->reset();
-		}
-		m_trig->reset();
+void Envelope::process(sample_t *out, int nframes){
+	//nothing to do while off, the signal may not even have been rendered
+	if(staysOff(nframes)){
+		for(int i = 0; i < nframes; ++i)
+			out[i] = 0.0;
+		m_constant = true;
+		return;
 	}
+
+	const sample_t *data = m_children[0]->getOutput();
+	const sample_t *trigger = m_trig->getOutput();
+
+	for(int i = 0; i < nframes; ++i)
+		out[i] = m_env.step(data[i], trigger[i], m_stride);
 }
 
-double Envelope::run(){
-	double data = m_children[0]->getValue();
-	double trigger = m_trig->getValue();
-
-	switch(m_state){
-		case Envelope::OFF:
-			if(trigger < m_thresh){
-				return 0.0;
-			}else{
-				m_state = Envelope::ATTACK;
-				m_a_c = 0;
-				return 0.0;
-			}	
-			break;
-		case Envelope::ATTACK:		
-			++m_a_c;
-			if(m_a_c > m_a_t){
-				m_state = Envelope::DECAY;
-				m_d_c = 0;
-				return data;
-			}else{
-				if(trigger < m_thresh){
-					m_state = Envelope::RELEASE;
-					m_r_c = 0;
-				}
-				m_volume = ((double)m_a_c/(double)m_a_t);				
-				return data * m_volume;
-			}
-			break;
-		case Envelope::DECAY:
-			++m_d_c;
-			if(m_d_c > m_d_t){
-				m_state = Envelope::SUSTAIN;
-				m_volume = m_sustain;
-				return data * m_sustain;
-			}else{
-				if(trigger < m_thresh){
-					m_state = Envelope::RELEASE;
-					m_r_c = 0;
-				}
-				m_volume = ((1.0 - m_sustain) - ((1.0 - m_sustain) * ((double)m_d_c/(double)m_d_t)) + m_sustain);
-				return data * m_volume;
-			}
-			break;
-		case Envelope::SUSTAIN:
-			if(trigger >= m_thresh){
-				return data * m_sustain;
-			}else{
-				m_state = Envelope::RELEASE;
-				m_r_c = 0;
-				return data * m_sustain;
-			}
-			break;
-		case Envelope::RELEASE:
-			++m_r_c;
-			if(m_r_c > m_r_t){
-				m_volume = 0.0;
-				m_state = Envelope::OFF;
-				return 0.0;
-			}else{
-				if(trigger >= m_thresh){
-					m_state = Envelope::ATTACK;
-					m_a_c = 0;
-					return 0.0;
-				}
-				return data * ((1 - (double)m_r_c/(double)m_r_t) * m_volume);
-			}
-			break;
-	};
+void Envelope::skip(int nframes){
+	const sample_t *trigger = m_trig->getOutput();
+	for(int i = 0; i < nframes; ++i)
+		m_env.step(0.0, trigger[i], m_stride);
+}
+
+bool Envelope::staysOff(int nframes){
+	return m_env.staysOff(m_trig->getOutput(), m_trig->isConstant(), nframes);
+}
+
+bool Envelope::equivalent(Module *other){
+	return m_env == static_cast<Envelope *>(other)->m_env;
 }
 
 //Envelope retrigger
 void Envelope::retrigger(){
-	m_state = Envelope::ATTACK;
-	m_a_c = 0;
+	m_env.stage = kernels::EnvelopeState::ATTACK;
+	m_env.a_c = 0;
+}
+
+Module *Envelope::getInput(int n) {
+	if(n == m_children.size())
+		return m_trig;
+	else
+		return Filter::getInput(n);
 }
 
-void Envelope::gatherSubModules(std::set<Module *> &modules) {
-	Filter::gatherSubModules(modules);
-	modules.insert(m_trig);
-	m_trig->gatherSubModules(modules);
+void Envelope::setInput(int n, Module *m) {
+	if(n == m_children.size())
+		m_trig = m;
+	else
+		Filter::setInput(n, m);
 }
 
 //lowpass filter
@@ -209,24 +155,8 @@ LowPass::LowPass(Module *f, Module *m){
 	m_prev = 0.0;
 }
 
-void LowPass::reset() {
-	if(!m_dirtyCache) {
-		m_dirtyCache = true;
-		for(int i; i < m_children.size(); ++i) {
-			m_children[i]->reset();
-		}
-		m_freq->reset();
-	}
-}
-
-double LowPass::run(){
-	double rc = 1.0 / (m_freq->getValue() * TWO_PI);
-	double dt = 1.0 / Waffle::sampleRate;
-	double alpha = dt / (rc + dt);
-	double v = m_children[0]->getValue();
-	double out =  (alpha * v) + ((1-alpha) * m_prev);
-	m_prev = out;
-	return out;
+void LowPass::process(sample_t *out, int nframes){
+	m_prev = kernels::lowPass(out, m_children[0]->getOutput(), m_freq->getOutput(), m_prev, m_stride / Waffle::sampleRate, nframes);
 }
 
 bool LowPass::isValid(){
@@ -240,10 +170,18 @@ void LowPass::setFreq(Module *f){
 	m_freq = f;
 }
 
-void LowPass::gatherSubModules(std::set<Module *> &modules) {
-	Filter::gatherSubModules(modules);
-	modules.insert(m_freq);
-	m_freq->gatherSubModules(modules);
+Module *LowPass::getInput(int n) {
+	if(n == m_children.size())
+		return m_freq;
+	else
+		return Filter::getInput(n);
+}
+
+void LowPass::setInput(int n, Module *m) {
+	if(n == m_children.size())
+		m_freq = m;
+	else
+		Filter::setInput(n, m);
 }
 
 //highpass filter
@@ -253,24 +191,8 @@ HighPass::HighPass(Module *f, Module *m){
 	m_prev = 0.0;
 }
 
-void HighPass::reset() {
-	if(!m_dirtyCache) {
-		m_dirtyCache = true;
-		for(int i; i < m_children.size(); ++i) {
-			m_children[i]->reset();
-		}
-		m_freq->reset();
-	}
-}
-
-double HighPass::run(){
-	double rc = 1.0 / (m_freq->getValue() * TWO_PI);
-	double dt = 1.0 / Waffle::sampleRate;
-	double alpha = dt / (rc + dt);
-	double v = m_children[0]->getValue();
-	double out =  (alpha * m_prev) + ((1-alpha) * v);
-	m_prev = out;
-	return out;
+void HighPass::process(sample_t *out, int nframes){
+	m_prev = kernels::highPass(out, m_children[0]->getOutput(), m_freq->getOutput(), m_prev, m_stride / Waffle::sampleRate, nframes);
 }
 
 bool HighPass::isValid(){
@@ -284,38 +206,113 @@ void HighPass::setFreq(Module *f){
 	m_freq = f;
 }
 
-void HighPass::gatherSubModules(std::set<Module *> &modules) {
-	Filter::gatherSubModules(modules);
-	modules.insert(m_freq);
-	m_freq->gatherSubModules(modules);
+Module *HighPass::getInput(int n) {
+	if(n == m_children.size())
+		return m_freq;
+	else
+		return Filter::getInput(n);
+}
+
+void HighPass::setInput(int n, Module *m) {
+	if(n == m_children.size())
+		m_freq = m;
+	else
+		Filter::setInput(n, m);
 }
 
 //multiplication filter
-Mult::Mult(Module *m1, Module *m2){
+Mult::Mult(Module *m1, Module *m2) : m_hasFactor(false), m_factor(1.0) {
 	m_children.push_back(m1);
 	m_children.push_back(m2);
 }
 
-double Mult::run(){
-	double result = 1.0;
-	for(int i = 0, len = m_children.size(); i < len; ++i)
-		result *= m_children[i]->getValue();
+void Mult::process(sample_t *out, int nframes){
+	//children after a silent one may have been skipped
+	for(int c = 0, len = m_children.size(); c < len; ++c){
+		if(m_children[c]->isSilent()){
+			for(int i = 0; i < nframes; ++i)
+				out[i] = 0.0;
+			m_constant = true;
+			return;
+		}
+	}
 
-	return result;
+	//a zero factor stands for a silent child, same shortcut
+	if(m_children.empty() || (m_hasFactor && m_factor == 0.0)){
+		for(int i = 0; i < nframes; ++i)
+			out[i] = m_children.empty() ? m_factor : 0.0;
+		m_constant = true;
+		return;
+	}
+
+	const sample_t *first = m_children[0]->getOutput();
+	for(int i = 0; i < nframes; ++i)
+		out[i] = first[i];
+
+	for(int c = 1, len = m_children.size(); c < len; ++c){
+		const sample_t *in = m_children[c]->getOutput();
+		for(int i = 0; i < nframes; ++i)
+			out[i] *= in[i];
+	}
+
+	if(m_hasFactor){
+		sample_t f = m_factor;
+		for(int i = 0; i < nframes; ++i)
+			out[i] *= f;
+	}
+	m_constant = childrenConstant();
+}
+
+bool Mult::equivalent(Module *other){
+	Mult *m = static_cast<Mult *>(other);
+	return m_hasFactor == m->m_hasFactor && m_factor == m->m_factor;
+}
+
+bool Mult::needsInput(int n, int nframes){
+	if(m_hasFactor && m_factor == 0.0)
+		return false;
+	for(int c = 0; c < n; ++c){
+		if(m_children[c]->isSilent())
+			return false;
+	}
+	return true;
 }
 
 //addition filter
-Add::Add(Module *m1, Module *m2){
+Add::Add(Module *m1, Module *m2) : m_hasOffset(false), m_offset(0.0) {
 	m_children.push_back(m1);
 	m_children.push_back(m2);
 }
 
-double Add::run(){
-	double result = 0.0;
-	for(int i = 0, len = m_children.size(); i < len; ++i)
-		result += m_children[i]->getValue();
+void Add::process(sample_t *out, int nframes){
+	if(m_children.empty()){
+		for(int i = 0; i < nframes; ++i)
+			out[i] = m_offset;
+		m_constant = true;
+		return;
+	}
+
+	const sample_t *first = m_children[0]->getOutput();
+	for(int i = 0; i < nframes; ++i)
+		out[i] = first[i];
+
+	for(int c = 1, len = m_children.size(); c < len; ++c){
+		const sample_t *in = m_children[c]->getOutput();
+		for(int i = 0; i < nframes; ++i)
+			out[i] += in[i];
+	}
+
+	if(m_hasOffset){
+		sample_t o = m_offset;
+		for(int i = 0; i < nframes; ++i)
+			out[i] += o;
+	}
+	m_constant = childrenConstant();
+}
 
-	return result;
+bool Add::equivalent(Module *other){
+	Add *a = static_cast<Add *>(other);
+	return m_hasOffset == a->m_hasOffset && m_offset == a->m_offset;
 }
 
 //subtraction filter
@@ -324,8 +321,13 @@ Sub::Sub(Module *m1, Module *m2){
 	m_children.push_back(m2);
 }
 
-double Sub::run(){
-	return m_children[0]->getValue() - m_children[1]->getValue();
+void Sub::process(sample_t *out, int nframes){
+	const sample_t *a = m_children[0]->getOutput();
+	const sample_t *b = m_children[1]->getOutput();
+
+	for(int i = 0; i < nframes; ++i)
+		out[i] = a[i] - b[i];
+	m_constant = childrenConstant();
 }
 
 //absolute value filter
@@ -333,60 +335,164 @@ Abs::Abs(Module *m){
 	m_children.push_back(m);
 }
 
-double Abs::run(){
-	return fabs(m_children[0]->getValue());
+void Abs::process(sample_t *out, int nframes){
+	const sample_t *in = m_children[0]->getOutput();
+
+	for(int i = 0; i < nframes; ++i)
+		out[i] = fabs(in[i]);
+	m_constant = m_children[0]->isConstant();
 }
 
 //signal delay filter
-Delay::Delay(double len, double thresh, Module *m, Module *t){
-	m_length = (int)(len*Waffle::sampleRate);
-	m_queue = std::list<double>(m_length, 0.0);
+Delay::Delay(double len, double thresh, Module *m, Module *t) : m_time(NULL), m_mask(0), m_count(0), m_start(0), m_blockStart(0) {
+	setLength(len);
+	m_children.push_back(m);
+	m_trig = t;
+	m_thresh = thresh;
+	m_first = true;
+}
+
+Delay::Delay(double maxLen, double thresh, Module *m, Module *t, Module *time) : m_time(time), m_mask(0), m_count(0), m_start(0), m_blockStart(0) {
+	setLength(maxLen);
 	m_children.push_back(m);
 	m_trig = t;
 	m_thresh = thresh;
+	m_first = true;
 }
 
 void Delay::setLength(double len){
-	m_length = (int)(len*Waffle::sampleRate);
-	m_queue = std::list<double>(m_length, 0.0);
+	reserve(len);
+	//a fixed time is cut to whole samples as it always was, only a time input reads between them
+	m_length = floor(clampTime(len));
 }
 
-void Delay::reset() {
-	if(!m_dirtyCache) {
-		m_dirtyCache = true;
-		for(int i; i < m_children.size(); ++i) {
-			m_children[i]->reset();
-		}
-		m_trig->reset();
+double Delay::getMaxLength(){
+	if(m_buffer.empty())
+		return 0.0;
+	return (m_buffer.size() - MAX_BLOCK_SIZE - 2) / Waffle::sampleRate;
+}
+
+void Delay::reserve(double len){
+	//room for the longest delay, plus a block for taps that read after the whole block is written
+	long needed = (long)ceil(len * Waffle::sampleRate) + MAX_BLOCK_SIZE + 2;
+	long size = 1;
+	while(size < needed)
+		size <<= 1;
+
+	if(size > (long)m_buffer.size()) {
+		m_buffer.assign(size, 0.0);
+		m_mask = size - 1;
 	}
 }
 
-double Delay::run(){
-	if(m_trig->getValue() > m_thresh){
-		if(m_first == true){
-			m_queue = std::list<double>(m_length, 0.0);
-			m_first = false;
+inline double Delay::clampTime(double seconds){
+	double samples = seconds * Waffle::sampleRate;
+	double longest = (double)(m_mask + 1 - MAX_BLOCK_SIZE - 2);
+	samples = (samples < 0.0) ? 0.0 : samples;
+	return (samples > longest) ? longest : samples;
+}
+
+inline double Delay::read(long pos, double delay, long start){
+	long whole = (long)delay;
+	double frac = delay - whole;
+	long newer = pos - whole;
+	long older = newer - 1;
+	double a = (newer >= start) ? m_buffer[newer & m_mask] : 0.0;
+	double b = (older >= start) ? m_buffer[older & m_mask] : 0.0;
+	return a + frac * (b - a);
+}
+
+void Delay::process(sample_t *out, int nframes){
+	const sample_t *in = m_children[0]->getOutput();
+	const sample_t *trig = m_trig->getOutput();
+	const sample_t *time = (m_time != NULL) ? m_time->getOutput() : NULL;
+	long pos = m_count;
+
+	m_blockStart = pos;
+	for(int i = 0; i < nframes; ++i, ++pos){
+		//always record, a retrigger just moves the start of the history instead of clearing it
+		m_buffer[pos & m_mask] = in[i];
+
+		if(trig[i] > m_thresh){
+			if(m_first == true){
+				m_start = pos;
+				m_first = false;
+			}
+			m_starts[i] = m_start;
+			double delay = (time != NULL) ? clampTime(time[i]) : m_length;
+			out[i] = read(pos, delay, m_start);
+		}else{
+			m_first = true;
+			m_starts[i] = -1;
+			out[i] = in[i];
 		}
-		double data = m_queue.front();
-		m_queue.pop_front();
-		m_queue.push_back(m_children[0]->getValue());
-		return data;
-	}else{
-		m_first = true;
-		return m_children[0]->getValue();
 	}
+	m_count = pos;
 }
 
 bool Delay::isValid(){
-	if(Filter::isValid() && m_trig != NULL)
-		return m_trig->isValid();
+	if(Filter::isValid() && m_trig != NULL && !m_buffer.empty())
+		return m_trig->isValid() && (m_time == NULL || m_time->isValid());
+	else
+		return false;
+}
+
+Module *Delay::getInput(int n) {
+	if(n == m_children.size())
+		return m_trig;
+	else if(n == m_children.size() + 1)
+		return m_time;
+	else
+		return Filter::getInput(n);
+}
+
+void Delay::setInput(int n, Module *m) {
+	if(n == m_children.size())
+		m_trig = m;
+	else if(n == m_children.size() + 1)
+		m_time = m;
+	else
+		Filter::setInput(n, m);
+}
+
+//Delay tap
+DelayTap::DelayTap(Delay *d, Module *time) : m_delay(d), m_time(time) {
+}
+
+void DelayTap::process(sample_t *out, int nframes){
+	//runs after the delay, so the whole block is already in the buffer
+	const sample_t *in = m_delay->m_children[0]->getOutput();
+	const sample_t *time = m_time->getOutput();
+	long pos = m_delay->m_blockStart;
+
+	for(int i = 0; i < nframes; ++i, ++pos){
+		long start = m_delay->m_starts[i];
+		if(start >= 0)
+			out[i] = m_delay->read(pos, m_delay->clampTime(time[i]), start);
+		else
+			out[i] = in[i];
+	}
+}
+
+bool DelayTap::isValid(){
+	if(m_delay != NULL && m_time != NULL)
+		return m_delay->isValid() && m_time->isValid();
 	else
 		return false;
 }
 
-void Delay::gatherSubModules(std::set<Module *> &modules) {
-	Filter::gatherSubModules(modules);
-	modules.insert(m_trig);
-	m_trig->gatherSubModules(modules);
+Module *DelayTap::getInput(int n) {
+	switch(n) {
+		case 0: return m_delay;
+		case 1: return m_time;
+		default: return NULL;
+	}
+}
+
+void DelayTap::setInput(int n, Module *m) {
+	switch(n) {
+		case 0: m_delay = dynamic_cast<Delay*>(m); break;
+		case 1: m_time = m; break;
+	}
 }
 
@@ -26,8 +26,8 @@ THE SOFTWARE.
 #define _WAFFLE_FILTERS_H_
 
 #include "Module.h"
+#include "kernels.h"
 
-#include <list>
 #include <vector>
 
 namespace waffle {
@@ -35,100 +35,200 @@ namespace waffle {
 class Filter : public Module {
 public:
 	Filter(){}
-	virtual double run() = 0;
+	virtual void process(sample_t *out, int nframes) = 0;
 	virtual bool isValid();
-	virtual void reset();
-	
-	virtual void gatherSubModules(std::set<Module *> &modules);
+
+	virtual int getInputCount() { return m_children.size(); }
+	virtual Module *getInput(int n) { return getChild(n); }
+	virtual void setInput(int n, Module *m) { setChild(n, m); }
 
 	Module *getChild(int n);
 	void setChild(int n, Module *m);
 	void addChild(Module *m);
 	
 protected:
+	friend class Patch;
+
+	//every child's last block was constant
+	bool childrenConstant();
+
 	std::vector<Module *> m_children;
 };
 
 class LowPass : public Filter {
 public:
-	LowPass():m_freq(NULL){}
+	LowPass():m_freq(NULL), m_prev(0.0){}
 	LowPass(Module *f, Module *m);
-	virtual double run();
+	virtual void process(sample_t *out, int nframes);
 	virtual bool isValid();
-	virtual void gatherSubModules(std::set<Module *> &modules);
+	virtual bool equivalent(Module *other) { return m_prev == static_cast<LowPass *>(other)->m_prev; }
 	void setFreq(Module *f);
 
-	virtual void reset();
+	virtual int getInputCount() { return m_children.size() + 1; }
+	virtual Module *getInput(int n);
+	virtual void setInput(int n, Module *m);
+	virtual bool isControlInput(int n) { return n == (int)m_children.size(); }
 	
 private:
+	friend class Program;
+
 	Module *m_freq;
 	double m_prev;
 };
 
 class HighPass : public Filter {
 public:
-	HighPass():m_freq(NULL){}
+	HighPass():m_freq(NULL), m_prev(0.0){}
 	HighPass(Module *f, Module *m);
-	virtual double run();
+	virtual void process(sample_t *out, int nframes);
 	virtual bool isValid();
-	virtual void gatherSubModules(std::set<Module *> &modules);
+	virtual bool equivalent(Module *other) { return m_prev == static_cast<HighPass *>(other)->m_prev; }
 	void setFreq(Module *f);
 
-	virtual void reset();
+	virtual int getInputCount() { return m_children.size() + 1; }
+	virtual Module *getInput(int n);
+	virtual void setInput(int n, Module *m);
+	virtual bool isControlInput(int n) { return n == (int)m_children.size(); }
 	
 private:
+	friend class Program;
+
 	Module *m_freq;
 	double m_prev;
 };
 
+//delays its input while the trigger is above the threshold and passes it through otherwise,
+//each retrigger starts over from silence
 class Delay : public Filter {
 public:
-	Delay():m_trig(NULL){}
+	Delay():m_thresh(0.0), m_length(0.0), m_trig(NULL), m_time(NULL), m_first(true), m_mask(0), m_count(0), m_start(0), m_blockStart(0){}
 	Delay(double len, double thresh, Module *m, Module *t);
+	//delay time in seconds read from time, up to maxLen
+	Delay(double maxLen, double thresh, Module *m, Module *t, Module *time);
 	
-	virtual double run();
+	virtual void process(sample_t *out, int nframes);
 	virtual bool isValid();
-	virtual void gatherSubModules(std::set<Module *> &modules);
+	//fixed delay time, used when there is no time input, cut to whole samples. growing past the max length
+	//allocates, so only do that before the patch is added
 	void setLength(double len);
 	void setThreshold(double t){m_thresh = t;}
 	void setTrigger(Module *t){m_trig = t;}
+	void setTime(Module *time){m_time = time;}
+	double getMaxLength();
+
+	//the history has to keep up with the input
+	virtual bool canSkip() { return false; }
+	virtual bool canStride() { return false; }
 
-	virtual void reset();
+	virtual int getInputCount() { return m_children.size() + (m_time != NULL ? 2 : 1); }
+	virtual Module *getInput(int n);
+	virtual void setInput(int n, Module *m);
+	virtual bool isControlInput(int n) { return n == (int)m_children.size() + 1; }
 
 private:
+	friend class DelayTap;
+
+	void reserve(double len);
+	//the buffer at delay samples before absolute position pos, silence before the last retrigger
+	inline double read(long pos, double delay, long start);
+	//delay time in samples
+	inline double clampTime(double seconds);
+
 	double m_thresh;
-	int m_length;
+	double m_length;	//fixed delay time, whole samples
 	Module *m_trig;
+	Module *m_time;
 	bool m_first;
-	std::list<double> m_queue;
+
+	std::vector<sample_t> m_buffer;	//power of two long
+	long m_mask;
+	long m_count;		//absolute position of the next write
+	long m_start;		//absolute position of the last retrigger
+	long m_blockStart;	//m_count at the start of the last block
+	long m_starts[MAX_BLOCK_SIZE];	//m_start for each frame of the last block, -1 when passing through
+};
+
+//another read position on a Delay's buffer, follows the same trigger
+class DelayTap : public Module {
+public:
+	DelayTap():m_delay(NULL), m_time(NULL){}
+	DelayTap(Delay *d, Module *time);
+
+	virtual void process(sample_t *out, int nframes);
+	virtual bool isValid();
+
+	virtual int getInputCount() { return 2; }
+	virtual Module *getInput(int n);
+	virtual void setInput(int n, Module *m);
+	virtual bool isControlInput(int n) { return n == 1; }
+	virtual bool canStride() { return false; }
+
+private:
+	Delay *m_delay;
+	Module *m_time;
 };
 
 class Mult : public Filter {
 public:
-	Mult(){}
+	Mult():m_hasFactor(false), m_factor(1.0){}
 	Mult(Module *m1, Module *m2);
-	virtual double run();
+	//multiplied in after the children
+	void setFactor(sample_t f){m_factor = f; m_hasFactor = true;}
+	bool hasFactor(){return m_hasFactor;}
+	sample_t getFactor(){return m_factor;}
+
+	virtual void process(sample_t *out, int nframes);
+	virtual bool isPure() { return true; }
+	virtual bool equivalent(Module *other);
+	//cheap, and keeps control signals current for skipped oscillators
+	virtual void skip(int nframes) { process(m_output, nframes); }
+
+	//after a silent child the rest don't matter
+	virtual bool isLazyInput(int n) { return n > 0 && n < (int)m_children.size(); }
+	virtual bool needsInput(int n, int nframes);
+
+private:
+	bool m_hasFactor;
+	sample_t m_factor;
 };
 
 class Add : public Filter {
 public:
-	Add(){}
+	Add():m_hasOffset(false), m_offset(0.0){}
 	Add(Module *m1, Module *m2);
-	virtual double run();
+	//added in after the children
+	void setOffset(sample_t o){m_offset = o; m_hasOffset = true;}
+	bool hasOffset(){return m_hasOffset;}
+	sample_t getOffset(){return m_offset;}
+
+	virtual void process(sample_t *out, int nframes);
+	virtual bool isPure() { return true; }
+	virtual bool equivalent(Module *other);
+	virtual void skip(int nframes) { process(m_output, nframes); }
+
+private:
+	bool m_hasOffset;
+	sample_t m_offset;
 };
 
 class Sub : public Filter {
 public:
 	Sub(){}
 	Sub(Module *m1, Module *m2);
-	virtual double run();
+	virtual void process(sample_t *out, int nframes);
+	virtual bool isPure() { return true; }
+	virtual bool equivalent(Module *other) { return true; }
+	virtual void skip(int nframes) { process(m_output, nframes); }
 };
 
 class Abs : public Filter {
 public:
 	Abs(){}
 	Abs(Module *m);
-	virtual double run();
+	virtual void process(sample_t *out, int nframes);
+	virtual bool isPure() { return true; }
+	virtual bool equivalent(Module *other) { return true; }
+	virtual void skip(int nframes) { process(m_output, nframes); }
 };
 
 class Envelope : public Filter {
@@ -141,34 +241,29 @@ public:
 	void setSustain(double s);
 	void setRelease(double r);
 	void retrigger();
-	virtual void gatherSubModules(std::set<Module *> &modules);
-	virtual double run();
+	virtual void process(sample_t *out, int nframes);
+	virtual void skip(int nframes);
+	virtual bool equivalent(Module *other);
 	virtual bool isValid(){if(Filter::isValid() && m_trig != NULL) return m_trig->isValid(); else return false;}
 
-	virtual void reset();
+	virtual int getInputCount() { return m_children.size() + 1; }
+	virtual Module *getInput(int n);
+	virtual void setInput(int n, Module *m);
+
+	//the signal isn't needed while the envelope stays off
+	virtual bool isLazyInput(int n) { return n == 0; }
+	virtual bool needsInput(int n, int nframes) { return !staysOff(nframes); }
 
 private:
+	friend class Program;
 
-	enum EnvelopeState
-	{
-		OFF,
-		ATTACK,
-		DECAY,
-		SUSTAIN,
-		RELEASE
-	};
+	bool staysOff(int nframes);
 
 	Module *m_trig;
-	EnvelopeState m_state;
-	double m_thresh;
 	double m_attack;
 	double m_decay;
-	double m_sustain;
 	double m_release;
-	double m_volume;
-	int m_a_t; int m_a_c;
-	int m_d_t; int m_d_c;
-	int m_r_t; int m_r_c;
+	kernels::EnvelopeState m_env;
 };
 
 }
@@ -0,0 +1,425 @@
+/*
+Copyright (c) 2009-2010 Brett Lajzer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef _WAFFLE_FIXED_H_
+#define _WAFFLE_FIXED_H_
+
+#include "waffle.h"
+#include "kernels.h"
+
+#include <cmath>
+#include <type_traits>
+
+namespace waffle {
+
+//! Patches whose shape is known when the program is compiled, written with the same names as the modules:
+//!
+//!     namespace fx = waffle::fixed;
+//!     auto sig = fx::Envelope(0.5, 0.5, 0.5, 0.5, 0.5, gate,
+//!                    fx::GenSine(440.0, 0.0) + fx::GenSquare(fx::GenSine(0.5, 0.0) * 20.0 + 440.0, 0.0, 0.5));
+//!     w->addPatch("sig", new Patch(fx::module(sig)));
+//!
+//! The whole graph is one type, so the compiler sees every node at once: no virtual calls, no output slots
+//! between arithmetic nodes, and the per sample loops get inlined into each other and vectorized. Numbers
+//! become Constants and waffle::Value pointers are read once per block, so setValue() keeps working.
+//! Oscillators, filters and envelopes use the same block loops as the modules (kernels.h) and sound the same.
+//! Needs C++17 for the class template argument deduction.
+namespace fixed {
+
+//every node has:
+//	constant			true if every sample of a block is the same, known at compile time
+//	prepare(n, stride)	render the next block of nodes that keep state
+//	skip(n, stride)		nothing needs the next block, keep state moving like Module::skip()
+//	at(i)				sample i of the block
+//	data(tmp, n)		the block as an array, written to tmp unless the node keeps its own
+struct Node {};
+
+class Constant : public Node {
+public:
+	static constexpr bool constant = true;
+	Constant(double v) : m_value((sample_t)v) {}
+
+	void prepare(int nframes, int stride) {}
+	void skip(int nframes, int stride) {}
+	sample_t at(int i) const { return m_value; }
+	const sample_t *data(sample_t *tmp, int nframes) const {
+		for(int i = 0; i < nframes; ++i)
+			tmp[i] = m_value;
+		return tmp;
+	}
+
+private:
+	sample_t m_value;
+};
+
+//a live control, the waffle::Value stays owned by the caller
+class Value : public Node {
+public:
+	static constexpr bool constant = true;
+	Value(waffle::Value *v) : m_source(v), m_value(0.0) {}
+
+	void prepare(int nframes, int stride) { m_value = (sample_t)m_source->getValue(); }
+	void skip(int nframes, int stride) { prepare(nframes, stride); }
+	sample_t at(int i) const { return m_value; }
+	const sample_t *data(sample_t *tmp, int nframes) const {
+		for(int i = 0; i < nframes; ++i)
+			tmp[i] = m_value;
+		return tmp;
+	}
+
+private:
+	waffle::Value *m_source;
+	sample_t m_value;
+};
+
+//numbers and Value pointers passed where a node goes
+template<class T>
+using node_t = typename std::conditional<std::is_arithmetic<T>::value, Constant,
+	typename std::conditional<std::is_convertible<T, waffle::Value *>::value, Value, T>::type>::type;
+
+template<class T>
+using is_node = std::is_base_of<Node, T>;
+
+//nodes that keep their own block
+class Stored : public Node {
+public:
+	static constexpr bool constant = false;
+	sample_t at(int i) const { return m_out[i]; }
+	const sample_t *data(sample_t *tmp, int nframes) const { return m_out; }
+
+protected:
+	sample_t m_out[MAX_BLOCK_SIZE];
+};
+
+//constant inputs only need one sample, the kernels only read the first
+template<class E>
+inline const sample_t *block(const E &e, sample_t *tmp, int nframes) {
+	return e.data(tmp, E::constant ? 1 : nframes);
+}
+
+template<class A, class B>
+class Add : public Node {
+public:
+	static constexpr bool constant = A::constant && B::constant;
+	Add(const A &a, const B &b) : m_a(a), m_b(b) {}
+
+	void prepare(int nframes, int stride) { m_a.prepare(nframes, stride); m_b.prepare(nframes, stride); }
+	void skip(int nframes, int stride) { m_a.skip(nframes, stride); m_b.skip(nframes, stride); }
+	sample_t at(int i) const { return m_a.at(i) + m_b.at(i); }
+	const sample_t *data(sample_t *tmp, int nframes) const {
+		for(int i = 0; i < nframes; ++i)
+			tmp[i] = at(i);
+		return tmp;
+	}
+
+private:
+	A m_a;
+	B m_b;
+};
+
+template<class A, class B>
+class Sub : public Node {
+public:
+	static constexpr bool constant = A::constant && B::constant;
+	Sub(const A &a, const B &b) : m_a(a), m_b(b) {}
+
+	void prepare(int nframes, int stride) { m_a.prepare(nframes, stride); m_b.prepare(nframes, stride); }
+	void skip(int nframes, int stride) { m_a.skip(nframes, stride); m_b.skip(nframes, stride); }
+	sample_t at(int i) const { return m_a.at(i) - m_b.at(i); }
+	const sample_t *data(sample_t *tmp, int nframes) const {
+		for(int i = 0; i < nframes; ++i)
+			tmp[i] = at(i);
+		return tmp;
+	}
+
+private:
+	A m_a;
+	B m_b;
+};
+
+//like the module, a constant silent first input skips the second
+template<class A, class B>
+class Mult : public Node {
+public:
+	static constexpr bool constant = A::constant && B::constant;
+	Mult(const A &a, const B &b) : m_a(a), m_b(b), m_silent(false) {}
+
+	void prepare(int nframes, int stride) {
+		m_a.prepare(nframes, stride);
+		m_silent = A::constant && m_a.at(0) == 0.0;
+		if(m_silent)
+			m_b.skip(nframes, stride);
+		else
+			m_b.prepare(nframes, stride);
+	}
+	void skip(int nframes, int stride) { m_a.skip(nframes, stride); m_b.skip(nframes, stride); }
+	sample_t at(int i) const { return (A::constant && m_silent) ? (sample_t)0.0 : m_a.at(i) * m_b.at(i); }
+	const sample_t *data(sample_t *tmp, int nframes) const {
+		for(int i = 0; i < nframes; ++i)
+			tmp[i] = at(i);
+		return tmp;
+	}
+
+private:
+	A m_a;
+	B m_b;
+	bool m_silent;
+};
+
+template<class A>
+class Abs : public Node {
+public:
+	static constexpr bool constant = A::constant;
+	Abs(const A &a) : m_a(a) {}
+
+	void prepare(int nframes, int stride) { m_a.prepare(nframes, stride); }
+	void skip(int nframes, int stride) { m_a.skip(nframes, stride); }
+	sample_t at(int i) const { return std::fabs(m_a.at(i)); }
+	const sample_t *data(sample_t *tmp, int nframes) const {
+		for(int i = 0; i < nframes; ++i)
+			tmp[i] = at(i);
+		return tmp;
+	}
+
+private:
+	A m_a;
+};
+
+template<class A, class B> Add(A, B) -> Add<node_t<A>, node_t<B>>;
+template<class A, class B> Sub(A, B) -> Sub<node_t<A>, node_t<B>>;
+template<class A, class B> Mult(A, B) -> Mult<node_t<A>, node_t<B>>;
+template<class A> Abs(A) -> Abs<node_t<A>>;
+
+//phase accumulator shared by the oscillators
+template<class F, class P>
+class Waveform : public Stored {
+public:
+	Waveform(const F &f, const P &p) : m_freq(f), m_phase(p), m_pos(0.0) {}
+
+	//like the modules: Values and arithmetic stay current while skipped, oscillators and filters don't
+	void skip(int nframes, int stride) {
+		m_freq.skip(nframes, stride);
+		m_phase.skip(nframes, stride);
+		sample_t freq = m_freq.at(0);
+		m_pos = kernels::skipPhase(m_pos, &freq, stride / Waffle::sampleRate, nframes);
+	}
+
+protected:
+	void advance(double *pos, int nframes, int stride) {
+		m_freq.prepare(nframes, stride);
+		m_phase.prepare(nframes, stride);
+		sample_t f[MAX_BLOCK_SIZE], p[MAX_BLOCK_SIZE];
+		m_pos = kernels::advance(pos, block(m_freq, f, nframes), F::constant, block(m_phase, p, nframes), P::constant,
+			m_pos, stride / Waffle::sampleRate, nframes);
+	}
+
+	F m_freq;
+	P m_phase;
+	double m_pos;
+};
+
+#define WAFFLE_FIXED_WAVEFORM(NAME, KERNEL) \
+template<class F, class P> \
+class NAME : public Waveform<F, P> { \
+public: \
+	NAME(const F &f, const P &p) : Waveform<F, P>(f, p) {} \
+	void prepare(int nframes, int stride) { \
+		double pos[MAX_BLOCK_SIZE]; \
+		this->advance(pos, nframes, stride); \
+		kernels::KERNEL(this->m_out, pos, nframes); \
+	} \
+}; \
+template<class F, class P> NAME(F, P) -> NAME<node_t<F>, node_t<P>>;
+
+WAFFLE_FIXED_WAVEFORM(GenSine, sine)
+WAFFLE_FIXED_WAVEFORM(GenTriangle, triangle)
+WAFFLE_FIXED_WAVEFORM(GenSawtooth, sawtooth)
+WAFFLE_FIXED_WAVEFORM(GenRevSawtooth, revSawtooth)
+
+#undef WAFFLE_FIXED_WAVEFORM
+
+template<class F, class P, class T>
+class GenSquare : public Waveform<F, P> {
+public:
+	GenSquare(const F &f, const P &p, const T &t) : Waveform<F, P>(f, p), m_thresh(t) {}
+
+	void prepare(int nframes, int stride) {
+		double pos[MAX_BLOCK_SIZE];
+		this->advance(pos, nframes, stride);
+		m_thresh.prepare(nframes, stride);
+		for(int i = 0; i < nframes; ++i)
+			this->m_out[i] = ((sample_t)pos[i] < m_thresh.at(i)) ? -1 : 1;
+	}
+	void skip(int nframes, int stride) {
+		Waveform<F, P>::skip(nframes, stride);
+		m_thresh.skip(nframes, stride);
+	}
+
+private:
+	T m_thresh;
+};
+
+template<class F, class P, class T> GenSquare(F, P, T) -> GenSquare<node_t<F>, node_t<P>, node_t<T>>;
+
+//one pole filters, the cutoff comes first like the modules' constructors
+template<class F, class I>
+class LowPass : public Stored {
+public:
+	LowPass(const F &f, const I &in) : m_freq(f), m_in(in), m_prev(0.0) {}
+
+	void prepare(int nframes, int stride) {
+		m_in.prepare(nframes, stride);
+		m_freq.prepare(nframes, stride);
+		sample_t f[MAX_BLOCK_SIZE], in[MAX_BLOCK_SIZE];
+		//the kernel reads every frequency sample, constant or not
+		m_prev = kernels::lowPass(m_out, m_in.data(in, nframes), m_freq.data(f, nframes), m_prev,
+			stride / Waffle::sampleRate, nframes);
+	}
+	void skip(int nframes, int stride) { m_in.skip(nframes, stride); m_freq.skip(nframes, stride); }
+
+private:
+	F m_freq;
+	I m_in;
+	double m_prev;
+};
+
+template<class F, class I>
+class HighPass : public Stored {
+public:
+	HighPass(const F &f, const I &in) : m_freq(f), m_in(in), m_prev(0.0) {}
+
+	void prepare(int nframes, int stride) {
+		m_in.prepare(nframes, stride);
+		m_freq.prepare(nframes, stride);
+		sample_t f[MAX_BLOCK_SIZE], in[MAX_BLOCK_SIZE];
+		m_prev = kernels::highPass(m_out, m_in.data(in, nframes), m_freq.data(f, nframes), m_prev,
+			stride / Waffle::sampleRate, nframes);
+	}
+	void skip(int nframes, int stride) { m_in.skip(nframes, stride); m_freq.skip(nframes, stride); }
+
+private:
+	F m_freq;
+	I m_in;
+	double m_prev;
+};
+
+template<class F, class I> LowPass(F, I) -> LowPass<node_t<F>, node_t<I>>;
+template<class F, class I> HighPass(F, I) -> HighPass<node_t<F>, node_t<I>>;
+
+//ADSR envelope, the signal isn't rendered while the envelope stays off
+template<class T, class I>
+class Envelope : public Stored {
+public:
+	Envelope(double thresh, double a, double d, double s, double r, const T &t, const I &in) : m_trig(t), m_in(in) {
+		m_env.thresh = thresh;
+		m_env.sustain = s;
+		m_env.a_t = (int)(a * Waffle::sampleRate);
+		m_env.d_t = (int)(d * Waffle::sampleRate);
+		m_env.r_t = (int)(r * Waffle::sampleRate);
+	}
+
+	void prepare(int nframes, int stride) {
+		m_trig.prepare(nframes, stride);
+		sample_t t[MAX_BLOCK_SIZE];
+		if(m_env.staysOff(block(m_trig, t, nframes), T::constant, nframes)){
+			m_in.skip(nframes, stride);
+			for(int i = 0; i < nframes; ++i)
+				m_out[i] = 0.0;
+			return;
+		}
+
+		m_in.prepare(nframes, stride);
+		//held notes: step() would only scale by the sustain level, one vector loop does the same
+		if(T::constant && m_env.stage == kernels::EnvelopeState::SUSTAIN && m_trig.at(0) >= m_env.thresh){
+			double sustain = m_env.sustain;
+			for(int i = 0; i < nframes; ++i)
+				m_out[i] = m_in.at(i) * sustain;
+			return;
+		}
+
+		//a local copy stays in registers, the output can't alias it
+		kernels::EnvelopeState env = m_env;
+		for(int i = 0; i < nframes; ++i)
+			m_out[i] = env.step(m_in.at(i), m_trig.at(i), stride);
+		m_env = env;
+	}
+	void skip(int nframes, int stride) {
+		m_trig.skip(nframes, stride);
+		m_in.skip(nframes, stride);
+		//the trigger's last block, as stale as a skipped module's input
+		sample_t t[MAX_BLOCK_SIZE];
+		const sample_t *trigger = m_trig.data(t, nframes);
+		for(int i = 0; i < nframes; ++i)
+			m_env.step(0.0, trigger[i], stride);
+	}
+
+private:
+	T m_trig;
+	I m_in;
+	kernels::EnvelopeState m_env;
+};
+
+template<class T, class I> Envelope(double, double, double, double, double, T, I) -> Envelope<node_t<T>, node_t<I>>;
+
+//operators for the arithmetic nodes, at least one side has to be a node
+template<class A, class B>
+using enable_nodes = typename std::enable_if<is_node<A>::value || is_node<B>::value>::type;
+
+template<class A, class B, class = enable_nodes<A, B>>
+inline Add<node_t<A>, node_t<B>> operator+(const A &a, const B &b) { return Add<node_t<A>, node_t<B>>(a, b); }
+
+template<class A, class B, class = enable_nodes<A, B>>
+inline Sub<node_t<A>, node_t<B>> operator-(const A &a, const B &b) { return Sub<node_t<A>, node_t<B>>(a, b); }
+
+template<class A, class B, class = enable_nodes<A, B>>
+inline Mult<node_t<A>, node_t<B>> operator*(const A &a, const B &b) { return Mult<node_t<A>, node_t<B>>(a, b); }
+
+//the module that runs a graph, one process() call per block for the whole thing
+template<class E>
+class Graph : public waffle::Module {
+public:
+	Graph(const E &e) : m_expr(e) {}
+
+	virtual void process(sample_t *out, int nframes) {
+		m_expr.prepare(nframes, m_stride);
+		for(int i = 0; i < nframes; ++i)
+			out[i] = m_expr.at(i);
+		m_constant = E::constant;
+	}
+	virtual void skip(int nframes) { m_expr.skip(nframes, m_stride); }
+	virtual bool isValid() { return true; }
+
+private:
+	E m_expr;
+};
+
+//wrap a graph into a module for Patch and Waffle::addPatch()
+template<class E>
+inline waffle::Module *module(const E &e) {
+	static_assert(is_node<E>::value, "fixed::module() takes a fixed:: graph");
+	return new Graph<E>(e);
+}
+
+}
+
+}
+#endif
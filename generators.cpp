@@ -22,13 +22,13 @@ THE SOFTWARE.
 
 #include "generators.h"
 #include "waffle.h"
+#include "kernels.h"
 
 #include <cmath>
+#include <cstring>
 
 using namespace waffle;
-
-static const double PI = 3.141592653589732384626;
-static const double TWO_PI = 2.0 * PI;
+using namespace waffle::kernels;
 
 //Base WaveformGenerator
 void WaveformGenerator::setFreq(Module *f){
@@ -36,6 +36,10 @@ void WaveformGenerator::setFreq(Module *f){
 	m_pos = 0.0;
 }
 
+void WaveformGenerator::setPhase(Module *p){
+	m_phase = p;
+}
+
 bool WaveformGenerator::isValid() { 
 	if(m_freq != NULL && m_phase != NULL)
 		return m_freq->isValid() && m_phase->isValid();
@@ -43,67 +47,68 @@ bool WaveformGenerator::isValid() {
 		return false;
 }
 
-void WaveformGenerator::reset() {
-	if(!m_dirtyCache)
-	{
-		m_dirtyCache = true;
-		m_freq->reset();
-		m_phase->reset();
+Module *WaveformGenerator::getInput(int n) {
+	switch(n) {
+		case 0: return m_freq;
+		case 1: return m_phase;
+		default: return NULL;
+	}
+}
+
+void WaveformGenerator::setInput(int n, Module *m) {
+	switch(n) {
+		case 0: m_freq = m; break;
+		case 1: m_phase = m; break;
 	}
 }
 
-void WaveformGenerator::gatherSubModules(std::set<Module *> &modules) {
-	modules.insert(m_freq);
-	modules.insert(m_phase);
-		
-	m_freq->gatherSubModules(modules);
-	m_phase->gatherSubModules(modules);
+void WaveformGenerator::advance(double *pos, int nframes){
+	m_pos = kernels::advance(pos, m_freq->getOutput(), m_freq->isConstant(), m_phase->getOutput(), m_phase->isConstant(),
+		m_pos, m_stride / Waffle::sampleRate, nframes);
+}
+
+void WaveformGenerator::skip(int nframes){
+	m_pos = skipPhase(m_pos, m_freq->getOutput(), m_stride / Waffle::sampleRate, nframes);
 }
 
 //Sine Wave Generator
 GenSine::GenSine(Module *f, Module *p) : WaveformGenerator(f, p) {
 }
 
-double GenSine::run(){
-	double data = sin(m_pos + (m_phase->getValue() * PI));
-	m_pos += TWO_PI * ((m_freq->getValue())/Waffle::sampleRate);
-	m_pos = fmod(m_pos, TWO_PI);
-
-	return data;
+void GenSine::process(sample_t * __restrict out, int nframes){
+	alignas(32) double pos[MAX_BLOCK_SIZE];
+	advance(pos, nframes);
+	sine(out, pos, nframes);
 }
 
 //Triangle Wave Generator
 GenTriangle::GenTriangle(Module *f, Module *p) : WaveformGenerator(f, p) {
 }
 
-double GenTriangle::run(){
-	double cpos = fmod(m_pos + (m_phase->getValue() * PI), TWO_PI)/(TWO_PI);
-	double data = (cpos < 0.5) ? cpos : (1 - cpos);
-	m_pos += TWO_PI * (m_freq->getValue())/Waffle::sampleRate;
-	m_pos = fmod(m_pos, TWO_PI);
-	return (4*data)-1;
+void GenTriangle::process(sample_t * __restrict out, int nframes){
+	alignas(32) double pos[MAX_BLOCK_SIZE];
+	advance(pos, nframes);
+	triangle(out, pos, nframes);
 }
 
 //Sawtooth Wave Generator
 GenSawtooth::GenSawtooth(Module *f, Module *p) : WaveformGenerator(f, p) {
 }
 
-double GenSawtooth::run(){
-	double data = (2*fmod(m_pos + (m_phase->getValue() * PI), TWO_PI)/(TWO_PI))-1;
-	m_pos += TWO_PI * (m_freq->getValue())/Waffle::sampleRate;
-	m_pos = fmod(m_pos, TWO_PI);
-	return data;
+void GenSawtooth::process(sample_t * __restrict out, int nframes){
+	alignas(32) double pos[MAX_BLOCK_SIZE];
+	advance(pos, nframes);
+	sawtooth(out, pos, nframes);
 }
 
 //Sawtooth Wave Generator
 GenRevSawtooth::GenRevSawtooth(Module *f, Module *p) : WaveformGenerator(f, p) {
 }
 
-double GenRevSawtooth::run(){
-	double data = (2*(1 - fmod(m_pos + (m_phase->getValue() * PI), TWO_PI)/(TWO_PI))-1);
-	m_pos += TWO_PI * (m_freq->getValue())/Waffle::sampleRate;
-	m_pos = fmod(m_pos, TWO_PI);
-	return data;
+void GenRevSawtooth::process(sample_t * __restrict out, int nframes){
+	alignas(32) double pos[MAX_BLOCK_SIZE];
+	advance(pos, nframes);
+	revSawtooth(out, pos, nframes);
 }
 
 //Square Wave Generator
@@ -115,27 +120,58 @@ void GenSquare::setThreshold(Module *t){
 	m_thresh = t;
 }
 
-double GenSquare::run(){
-	double cpos = fmod(m_pos + (m_phase->getValue() * PI), TWO_PI)/(TWO_PI);
-	double data = (cpos < m_thresh->getValue()) ? -1 : 1;
-	m_pos += TWO_PI * (m_freq->getValue())/Waffle::sampleRate;
-	m_pos = fmod(m_pos, TWO_PI);
-	return data;
+void GenSquare::process(sample_t * __restrict out, int nframes){
+	alignas(32) double pos[MAX_BLOCK_SIZE];
+	advance(pos, nframes);
+	square(out, pos, m_thresh->getOutput(), nframes);
+}
+
+Module *GenSquare::getInput(int n) {
+	if(n == 2)
+		return m_thresh;
+	else
+		return WaveformGenerator::getInput(n);
 }
 
-void GenSquare::gatherSubModules(std::set<Module *> &modules) {
-	WaveformGenerator::gatherSubModules(modules);
-	
-	modules.insert(m_thresh);
-	m_thresh->gatherSubModules(modules);
+void GenSquare::setInput(int n, Module *m) {
+	if(n == 2)
+		m_thresh = m;
+	else
+		WaveformGenerator::setInput(n, m);
 }
 
 //Noise Generator
-double GenNoise::run(){
-	return ((double)rand() / (double)RAND_MAX) - 0.5; 
+GenNoise::GenNoise() : Module() {
+	//seeded from rand() while it's built, so runs still differ
+	m_state = (uint32_t)rand() * 2654435761u + 1;
+	if(m_state == 0)
+		m_state = 1;
+}
+
+void GenNoise::process(sample_t *out, int nframes){
+	uint32_t x = m_state;
+	for(int i = 0; i < nframes; ++i) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		out[i] = ((double)x / 4294967295.0) - 0.5;
+	}
+	m_state = x;
 }
 
 //value Generator
+void Value::process(sample_t *out, int nframes){
+	sample_t v = (sample_t)m_value;
+	m_constant = true;
+	if(out == m_filled && nframes <= m_filledFrames && out[0] == v)
+		return;
+
+	for(int i = 0; i < nframes; ++i)
+		out[i] = v;
+	m_filled = out;
+	m_filledFrames = nframes;
+}
+
 double Value::getValue(){
 	return m_value;
 }
@@ -144,3 +180,21 @@ void Value::setValue(double v){
 	m_value = v;
 }
 
+bool Value::setValue(double v, uint64_t frame){
+	if(!isAttached()) {
+		m_value = v;
+		return false;
+	}
+	return post(frame, v);
+}
+
+bool Value::trigger(uint64_t frame, double v){
+	return post(frame, v, true);
+}
+
+//Constant
+bool Constant::equivalent(Module *other){
+	//bitwise, so 0.0 and -0.0 stay apart
+	double v = static_cast<Constant *>(other)->m_value;
+	return memcmp(&m_value, &v, sizeof(double)) == 0;
+}
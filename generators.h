@@ -24,6 +24,7 @@ THE SOFTWARE.
 #define _WAFFLE_GENERATORS_H_
 
 #include "Module.h"
+#include "events.h"
 
 #include <cstdlib>
 
@@ -37,45 +38,56 @@ public:
 	void setPhase(Module *p);
 
 	virtual bool isValid();
-	virtual void reset();
-	
-	virtual void gatherSubModules(std::set<Module *> &modules);
+
+	virtual int getInputCount() { return 2; }
+	virtual Module *getInput(int n);
+	virtual void setInput(int n, Module *m);
+
+	//keeps the phase running at the last block's frequency
+	virtual void skip(int nframes);
+	virtual bool isControlInput(int n) { return true; }
+	virtual bool equivalent(Module *other) { return m_pos == static_cast<WaveformGenerator *>(other)->m_pos; }
 	
 protected:
 	WaveformGenerator() : Module(), m_freq(NULL), m_phase(NULL), m_pos(0.0) {} //should never be explicitly instantiated
 	WaveformGenerator(Module *f, Module *p) : Module(), m_freq(f), m_phase(p), m_pos(0.0) {} //should never be explicitly instantiated
 
+	//fill pos with each frame's position in the cycle, [0, 1) with the phase applied, and advance
+	void advance(double *pos, int nframes);
+
+	friend class Program;
+
 	Module *m_freq;
 	Module *m_phase;
-	double m_pos;
+	double m_pos;	//position in the cycle, [0, 1)
 };
 
 class GenSine : public WaveformGenerator {
 public:
 	GenSine(Module *f, Module *p);
 	
-	virtual double run();
+	virtual void process(sample_t *out, int nframes);
 };
 
 class GenTriangle : public WaveformGenerator {
 public:
 	GenTriangle(Module *f, Module *p);
 	
-	virtual double run();
+	virtual void process(sample_t *out, int nframes);
 };
 
 class GenSawtooth : public WaveformGenerator {
 public:
 	GenSawtooth(Module *f, Module *p);
 	
-	virtual double run();
+	virtual void process(sample_t *out, int nframes);
 };
 
 class GenRevSawtooth : public WaveformGenerator {
 public:
 	GenRevSawtooth(Module *f, Module *p);
 	
-	virtual double run();
+	virtual void process(sample_t *out, int nframes);
 };
 
 class GenSquare : public WaveformGenerator {
@@ -84,7 +96,7 @@ public:
 	GenSquare(Module *f, Module *p, Module *t);
 	void setThreshold(Module *t);
 	
-	virtual double run();
+	virtual void process(sample_t *out, int nframes);
 	virtual bool isValid() {
 		if(WaveformGenerator::isValid() && m_thresh != NULL)
 			return m_thresh->isValid();
@@ -92,7 +104,9 @@ public:
 			return false;
 	}
 	
-	virtual void gatherSubModules(std::set<Module *> &modules);
+	virtual int getInputCount() { return 3; }
+	virtual Module *getInput(int n);
+	virtual void setInput(int n, Module *m);
 
 protected:
 	Module *m_thresh;
@@ -100,24 +114,54 @@ protected:
 
 class GenNoise : public Module {
 public:	
-	virtual double run();
+	GenNoise();
+	virtual void process(sample_t *out, int nframes);
 	virtual bool isValid(){ return true; }
-	
-	virtual void gatherSubModules(std::set<Module *> &modules) { }
+
+private:
+	//xorshift state of its own, rand() takes a lock that worker threads would queue on
+	uint32_t m_state;
 };
 
-class Value : public Module {
+class Value : public Module, public EventTarget {
 public:
-	Value() : Module(), m_value(0.0) {}
-	Value(double v) : Module(), m_value(v) {}
-	virtual double run(){}
-	virtual double getValue();
+	Value() : Module(), m_value(0.0), m_filled(NULL), m_filledFrames(0) {}
+	Value(double v) : Module(), m_value(v), m_filled(NULL), m_filledFrames(0) {}
+	virtual void process(sample_t *out, int nframes);
+	//cheap enough to keep current for skipped consumers
+	virtual void skip(int nframes) { process(m_output, nframes); }
+	double getValue();
 	virtual bool isValid(){ return true; }
-	virtual void gatherSubModules(std::set<Module *> &modules) { }
 	void setValue(double v);
+	//v from an absolute frame on (see Waffle::getFrame()), landing on that sample once the patch is added
+	//to a Waffle. Before that v applies right away. False if it wasn't queued: not added yet, or the queue is full
+	bool setValue(double v, uint64_t frame);
+	//v for the one frame, then 0. False and nothing happens if it can't be queued
+	bool trigger(uint64_t frame, double v = 1.0);
+	virtual void receive(double v) { m_value = v; }
 	
 protected:
+	friend class Program;
+
 	double m_value;
+
+	//the slot already holds this many frames of m_value, no need to write it again
+	const sample_t *m_filled;
+	int m_filledFrames;
+};
+
+//! A Value that never changes after it's made, so Patch::optimize() can fold it into its consumers.
+//! Use Value for anything you want to change while the patch plays.
+class Constant : public Value {
+public:
+	Constant(double v) : Value(v) {}
+	virtual bool isPure() { return true; }
+	virtual bool equivalent(Module *other);
+
+private:
+	void setValue(double v);
+	bool trigger(uint64_t frame, double v);
+	void receive(double v) {}
 };
 
 }
@@ -0,0 +1,110 @@
+/*
+Copyright (c) 2009-2010 Brett Lajzer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include "jackbackend.h"
+#include "waffle.h"
+
+#include <cstdlib>
+#include <iostream>
+
+using namespace waffle;
+
+JackBackend::JackBackend(const std::string &name) : m_process(NULL), m_processArg(NULL), m_xruns(0) {
+	//connect to jack
+	jack_status_t jack_status;
+	if(!(m_jackClient = jack_client_open(name.c_str(),JackNoStartServer,&jack_status))){
+		std::cerr << "Jack Error: Failed to connect client" << std::endl;
+		exit(1);
+	}
+
+	//register callbacks
+	jack_set_sample_rate_callback(m_jackClient, JackBackend::samplerate_callback, NULL);
+	jack_set_buffer_size_callback(m_jackClient, JackBackend::buffersize_callback, NULL);
+	jack_set_process_callback(m_jackClient, JackBackend::process_callback, this);
+	jack_set_xrun_callback(m_jackClient, JackBackend::xrun_callback, this);
+}
+
+JackBackend::~JackBackend() {
+	jack_client_close(m_jackClient);
+}
+
+bool JackBackend::activate(ProcessCallback process, void *arg) {
+	m_process = process;
+	m_processArg = arg;
+	return jack_activate(m_jackClient) == 0;
+}
+
+void JackBackend::deactivate() {
+	jack_deactivate(m_jackClient);
+}
+
+AudioBackend::Port JackBackend::registerPort(const std::string &name) {
+	jack_port_t *port;
+	if(!(port = jack_port_register(m_jackClient,name.c_str(),JACK_DEFAULT_AUDIO_TYPE,JackPortIsOutput,0))){
+		std::cerr << "Jack Error: Failed to register port: " << name << std::endl;
+		exit(1);
+	}
+	return port;
+}
+
+void JackBackend::unregisterPort(Port port) {
+	jack_port_unregister(m_jackClient, static_cast<jack_port_t *>(port));
+}
+
+float *JackBackend::getPortBuffer(Port port, int nframes) {
+	return (jack_default_audio_sample_t *)jack_port_get_buffer(static_cast<jack_port_t *>(port), nframes);
+}
+
+float JackBackend::getSampleRate() {
+	return (float)jack_get_sample_rate(m_jackClient);
+}
+
+int JackBackend::getBufferSize() {
+	return jack_get_buffer_size(m_jackClient);
+}
+
+int JackBackend::getRealtimePriority() {
+	return jack_client_real_time_priority(m_jackClient);
+}
+
+//callbacks
+int JackBackend::samplerate_callback(jack_nframes_t nframes, void *arg){
+	Waffle::sampleRate = (double)nframes;
+	return 0;
+}
+
+int JackBackend::buffersize_callback(jack_nframes_t nframes, void *arg){
+	Waffle::bufferSize = nframes;
+	return 0;
+}
+
+int JackBackend::process_callback(jack_nframes_t nframes, void *arg){
+	JackBackend *backend = static_cast<JackBackend *>(arg);
+	backend->m_process(nframes, backend->m_processArg);
+	return 0;
+}
+
+int JackBackend::xrun_callback(void *arg){
+	static_cast<JackBackend *>(arg)->m_xruns.fetch_add(1);
+	return 0;
+}
@@ -0,0 +1,67 @@
+/*
+Copyright (c) 2009-2010 Brett Lajzer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef _WAFFLE_JACKBACKEND_H_
+#define _WAFFLE_JACKBACKEND_H_
+
+#include "backend.h"
+
+#include <atomic>
+#include <jack/jack.h>
+#include <jack/types.h>
+
+namespace waffle {
+
+//! Realtime output through a JACK client
+class JackBackend : public AudioBackend {
+public:
+	JackBackend(const std::string &name = "waffle");
+	virtual ~JackBackend();
+
+	virtual bool activate(ProcessCallback process, void *arg);
+	virtual void deactivate();
+
+	virtual Port registerPort(const std::string &name);
+	virtual void unregisterPort(Port port);
+	virtual float *getPortBuffer(Port port, int nframes);
+
+	virtual float getSampleRate();
+	virtual int getBufferSize();
+	virtual int getRealtimePriority();
+	virtual unsigned long getXrunCount() { return m_xruns.load(); }
+
+private:
+	//jack callbacks
+	static int samplerate_callback(jack_nframes_t nframes, void *arg);
+	static int buffersize_callback(jack_nframes_t nframes, void *arg);
+	static int process_callback(jack_nframes_t nframes, void *arg);
+	static int xrun_callback(void *arg);
+
+	jack_client_t *m_jackClient;
+	ProcessCallback m_process;
+	void *m_processArg;
+	std::atomic<unsigned long> m_xruns;
+};
+
+}
+#endif
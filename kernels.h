@@ -0,0 +1,275 @@
+/*
+Copyright (c) 2009-2010 Brett Lajzer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef _WAFFLE_KERNELS_H_
+#define _WAFFLE_KERNELS_H_
+
+#include "Module.h"
+
+#include <cmath>
+
+namespace waffle {
+
+//block loops shared by the modules and the bytecode interpreter (see bytecode.h), so both render the
+//same samples. Plain loops over blocks so the compiler can vectorize them.
+namespace kernels {
+
+static const double PI = 3.14159265358979323846264;
+static const double TWO_PI = 2.0 * PI;
+//what the one pole filters have always used, kept so their output doesn't move
+static const double FILTER_TWO_PI = 2.0 * 3.141592653589732384626;
+
+inline bool allEqual(const sample_t *in, int nframes) {
+	sample_t first = in[0];
+	int same = 0;
+	for(int i = 0; i < nframes; ++i)
+		same += (in[i] == first);
+	return same == nframes;
+}
+
+//x - floor(x), but in plain arithmetic so it vectorizes without -fno-trapping-math
+inline double wrap(double x) {
+	const double ROUND = 6755399441055744.0; //1.5 * 2^52, rounds to nearest for |x| < 2^51
+	double r = (x + ROUND) - ROUND;
+	r = (r > x) ? r - 1.0 : r;
+	return x - r;
+}
+
+//sin(2 pi x) for x in [0, 1), in the sample type so float builds get the wider vectors
+inline sample_t sinCycle(sample_t x) {
+	//fold onto [-0.25, 0.25] where the odd series converges quickly
+	sample_t y = (sample_t)0.5 - x;
+	y = (y > (sample_t)0.25) ? (sample_t)0.5 - y : y;
+	y = (y < (sample_t)-0.25) ? (sample_t)-0.5 - y : y;
+
+	const sample_t C1 = -1.0/6, C2 = 1.0/120, C3 = -1.0/5040, C4 = 1.0/362880,
+		C5 = -1.0/39916800, C6 = 1.0/6227020800.0, C7 = -1.0/1307674368000.0;
+	sample_t t = (sample_t)TWO_PI * y;
+	sample_t t2 = t * t;
+	return t * (1 + t2 * (C1 + t2 * (C2 + t2 * (C3 + t2 * (C4 + t2 * (C5 + t2 * (C6 + t2 * C7)))))));
+}
+
+//fill pos with each frame's position in the cycle, [0, 1) with the phase (in half cycles) applied.
+//scale turns a frequency into cycles per frame. returns the position after the block
+inline double advance(double * __restrict pos, const sample_t * __restrict freq, bool freqConstant,
+	const sample_t * __restrict phase, bool phaseConstant, double start, double scale, int nframes) {
+	double next;
+
+	//phase accumulator, wrapped once per block instead of every sample
+	if(freqConstant || allEqual(freq, nframes)) {
+		double inc = freq[0] * scale;
+		for(int i = 0; i < nframes; ++i)
+			pos[i] = start + i * inc;
+		next = wrap(start + nframes * inc);
+	} else {
+		double acc = start;
+		for(int i = 0; i < nframes; ++i) {
+			pos[i] = acc;
+			acc += freq[i] * scale;
+		}
+		next = wrap(acc);
+	}
+
+	if(phaseConstant || allEqual(phase, nframes)) {
+		double offset = phase[0] * 0.5;
+		for(int i = 0; i < nframes; ++i)
+			pos[i] = wrap(pos[i] + offset);
+	} else {
+		for(int i = 0; i < nframes; ++i)
+			pos[i] = wrap(pos[i] + phase[i] * 0.5);
+	}
+	return next;
+}
+
+//the position after a skipped block, at the last block's frequency
+inline double skipPhase(double pos, const sample_t *freq, double scale, int nframes) {
+	double inc = freq[0] * scale;
+	return wrap(pos + nframes * inc);
+}
+
+inline void sine(sample_t * __restrict out, const double * __restrict pos, int nframes) {
+	for(int i = 0; i < nframes; ++i)
+		out[i] = sinCycle((sample_t)pos[i]);
+}
+
+inline void triangle(sample_t * __restrict out, const double * __restrict pos, int nframes) {
+	for(int i = 0; i < nframes; ++i) {
+		sample_t p = (sample_t)pos[i];
+		sample_t data = (p < (sample_t)0.5) ? p : (1 - p);
+		out[i] = (4*data)-1;
+	}
+}
+
+inline void sawtooth(sample_t * __restrict out, const double * __restrict pos, int nframes) {
+	for(int i = 0; i < nframes; ++i)
+		out[i] = (2*(sample_t)pos[i])-1;
+}
+
+inline void revSawtooth(sample_t * __restrict out, const double * __restrict pos, int nframes) {
+	for(int i = 0; i < nframes; ++i)
+		out[i] = (2*(1 - (sample_t)pos[i]))-1;
+}
+
+inline void square(sample_t * __restrict out, const double * __restrict pos, const sample_t * __restrict thresh, int nframes) {
+	for(int i = 0; i < nframes; ++i)
+		out[i] = ((sample_t)pos[i] < thresh[i]) ? -1 : 1;
+}
+
+//one pole filters, dt is the time between frames. return the filter memory after the block
+inline double lowPass(sample_t *out, const sample_t *in, const sample_t *freq, double prev, double dt, int nframes) {
+	for(int i = 0; i < nframes; ++i){
+		double rc = 1.0 / (freq[i] * FILTER_TWO_PI);
+		double alpha = dt / (rc + dt);
+		prev = (alpha * in[i]) + ((1-alpha) * prev);
+		out[i] = prev;
+	}
+	return prev;
+}
+
+inline double highPass(sample_t *out, const sample_t *in, const sample_t *freq, double prev, double dt, int nframes) {
+	for(int i = 0; i < nframes; ++i){
+		double rc = 1.0 / (freq[i] * FILTER_TWO_PI);
+		double alpha = dt / (rc + dt);
+		prev = (alpha * prev) + ((1-alpha) * in[i]);
+		out[i] = prev;
+	}
+	return prev;
+}
+
+//ADSR envelope state, stage lengths and counters in samples
+struct EnvelopeState {
+	enum Stage
+	{
+		OFF,
+		ATTACK,
+		DECAY,
+		SUSTAIN,
+		RELEASE
+	};
+
+	EnvelopeState() : stage(OFF), thresh(0.0), sustain(0.0), volume(0.0),
+		a_t(0), a_c(0), d_t(0), d_c(0), r_t(0), r_c(0) {}
+
+	bool operator==(const EnvelopeState &e) const {
+		return stage == e.stage && thresh == e.thresh && sustain == e.sustain && volume == e.volume
+			&& a_t == e.a_t && a_c == e.a_c && d_t == e.d_t && d_c == e.d_c && r_t == e.r_t && r_c == e.r_c;
+	}
+
+	//off for the whole block, so the signal isn't needed
+	bool staysOff(const sample_t *trigger, bool triggerConstant, int nframes) const {
+		if(stage != OFF)
+			return false;
+
+		if(triggerConstant)
+			return trigger[0] < thresh;
+
+		int low = 0;
+		for(int i = 0; i < nframes; ++i)
+			low += (trigger[i] < thresh);
+		return low == nframes;
+	}
+
+	//one frame, stride samples long
+	inline double step(double data, double trigger, int stride);
+
+	Stage stage;
+	double thresh;
+	double sustain;
+	double volume;
+	int a_t; int a_c;
+	int d_t; int d_c;
+	int r_t; int r_c;
+};
+
+inline double EnvelopeState::step(double data, double trigger, int stride){
+	switch(stage){
+		case OFF:
+			if(trigger < thresh){
+				return 0.0;
+			}else{
+				stage = ATTACK;
+				a_c = 0;
+				return 0.0;
+			}	
+			break;
+		case ATTACK:		
+			a_c += stride;
+			if(a_c > a_t){
+				stage = DECAY;
+				d_c = 0;
+				return data;
+			}else{
+				if(trigger < thresh){
+					stage = RELEASE;
+					r_c = 0;
+				}
+				volume = ((double)a_c/(double)a_t);				
+				return data * volume;
+			}
+			break;
+		case DECAY:
+			d_c += stride;
+			if(d_c > d_t){
+				stage = SUSTAIN;
+				volume = sustain;
+				return data * sustain;
+			}else{
+				if(trigger < thresh){
+					stage = RELEASE;
+					r_c = 0;
+				}
+				volume = ((1.0 - sustain) - ((1.0 - sustain) * ((double)d_c/(double)d_t)) + sustain);
+				return data * volume;
+			}
+			break;
+		case SUSTAIN:
+			if(trigger >= thresh){
+				return data * sustain;
+			}else{
+				stage = RELEASE;
+				r_c = 0;
+				return data * sustain;
+			}
+			break;
+		case RELEASE:
+			r_c += stride;
+			if(r_c > r_t){
+				volume = 0.0;
+				stage = OFF;
+				return 0.0;
+			}else{
+				if(trigger >= thresh){
+					stage = ATTACK;
+					a_c = 0;
+					return 0.0;
+				}
+				return data * ((1 - (double)r_c/(double)r_t) * volume);
+			}
+			break;
+	};
+	return 0.0;
+}
+
+}
+
+}
+#endif
@@ -28,12 +28,19 @@ using namespace waffle;
 
 int main(int argc, char *argv[]){
 	Waffle *w = new Waffle();
-	
-	Module *g = new Add(new GenSine(new Value(440.0), new Value(0.0)),
-						new GenSquare(new Add(new Mult(new GenSine(new Value(0.5), new Value(0.0)),
-												new Value(20.0)),new Value(440.0)),
-										new Value(0.0),
-										new Value(0.5)));
+
+	//build the patch in an arena so its modules sit together in memory
+	Arena *arena = new Arena();
+	Arena::Scope scope(arena);
+
+	//the 0.5 Hz vibrato only needs computing every 64 samples
+	Module *vibrato = new ControlRate(new Add(new Mult(new GenSine(new Constant(0.5), new Constant(0.0)),
+												new Constant(20.0)),new Constant(440.0)));
+	Module *g = new Add(new GenSine(new Constant(440.0), new Constant(0.0)),
+						new GenSquare(vibrato,
+										new Constant(0.0),
+										new Constant(0.5)));
+	//the gate changes while the patch plays, so it's a Value
 	Value *v = new Value(0.0);
 	Module *m = new Envelope(0.5, 0.5, 0.5, 0.5, 0.5, v, g);
 
@@ -44,7 +51,7 @@ int main(int argc, char *argv[]){
 		std::cout << "looks good!" << std::endl;
 	}
 	
-	Patch *p = new Patch(m);
+	Patch *p = new Patch(m, arena);
 
 	w->addPatch("testPatch", p);
 	w->start("testPatch");
@@ -0,0 +1,202 @@
+/*
+Copyright (c) 2009-2010 Brett Lajzer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include "offline.h"
+
+#include <algorithm>
+#include <iostream>
+#include <stdint.h>
+
+using namespace waffle;
+
+//little-endian helpers for the WAV header
+static void writeLE32(FILE *f, uint32_t v) {
+	unsigned char b[4] = { (unsigned char)v, (unsigned char)(v >> 8), (unsigned char)(v >> 16), (unsigned char)(v >> 24) };
+	fwrite(b, 1, 4, f);
+}
+
+static void writeLE16(FILE *f, uint16_t v) {
+	unsigned char b[2] = { (unsigned char)v, (unsigned char)(v >> 8) };
+	fwrite(b, 1, 2, f);
+}
+
+OfflineBackend::OfflineBackend(float sampleRate, int bufferSize) :
+	m_sampleRate(sampleRate), m_bufferSize(bufferSize), m_process(NULL), m_processArg(NULL) {
+	pthread_mutex_init(&m_lock, NULL);
+}
+
+OfflineBackend::~OfflineBackend() {
+	for(int i = 0, len = m_ports.size(); i < len; ++i) {
+		closeFile(m_ports[i]);
+		delete m_ports[i];
+	}
+	pthread_mutex_destroy(&m_lock);
+}
+
+bool OfflineBackend::activate(ProcessCallback process, void *arg) {
+	m_process = process;
+	m_processArg = arg;
+	return true;
+}
+
+void OfflineBackend::deactivate() {
+	m_process = NULL;
+	m_processArg = NULL;
+}
+
+bool OfflineBackend::setOutputFile(const std::string &port, const std::string &path, FileFormat format) {
+	bool result = true;
+
+	pthread_mutex_lock(&m_lock);
+	OutputFile &file = m_files[port];
+	file.path = path;
+	file.format = format;
+
+	for(int i = 0, len = m_ports.size(); i < len; ++i) {
+		if(m_ports[i]->name == port) {
+			closeFile(m_ports[i]);
+			result = openFile(m_ports[i], file);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&m_lock);
+
+	return result;
+}
+
+AudioBackend::Port OfflineBackend::registerPort(const std::string &name) {
+	OutputPort *port = new OutputPort();
+	port->name = name;
+	port->buffer.resize(m_bufferSize, 0.0f);
+	port->file = NULL;
+	port->format = WAV;
+	port->framesWritten = 0;
+
+	pthread_mutex_lock(&m_lock);
+	std::map<std::string, OutputFile>::iterator it = m_files.find(name);
+	if(it != m_files.end())
+		openFile(port, it->second);
+
+	m_ports.push_back(port);
+	pthread_mutex_unlock(&m_lock);
+	return port;
+}
+
+void OfflineBackend::unregisterPort(Port port) {
+	pthread_mutex_lock(&m_lock);
+	std::vector<OutputPort *>::iterator it = std::find(m_ports.begin(), m_ports.end(), static_cast<OutputPort *>(port));
+	if(it != m_ports.end()) {
+		closeFile(*it);
+		delete *it;
+		m_ports.erase(it);
+	}
+	pthread_mutex_unlock(&m_lock);
+}
+
+float *OfflineBackend::getPortBuffer(Port port, int nframes) {
+	return &static_cast<OutputPort *>(port)->buffer[0];
+}
+
+void OfflineBackend::render(double seconds) {
+	renderFrames((long)(seconds * m_sampleRate));
+}
+
+void OfflineBackend::renderFrames(long frames) {
+	if(!m_process) {
+		std::cerr << "Offline Error: backend is not active" << std::endl;
+		return;
+	}
+
+	while(frames > 0) {
+		int nframes = (int)std::min(frames, (long)m_bufferSize);
+
+		pthread_mutex_lock(&m_lock);
+		m_process(nframes, m_processArg);
+
+		for(int i = 0, len = m_ports.size(); i < len; ++i) {
+			OutputPort *port = m_ports[i];
+			//samples go out in host byte order, which is little-endian on
+			//everything we run on, matching what WAV expects
+			if(port->file) {
+				fwrite(&port->buffer[0], sizeof(float), nframes, port->file);
+				port->framesWritten += nframes;
+			}
+		}
+		pthread_mutex_unlock(&m_lock);
+		frames -= nframes;
+	}
+}
+
+bool OfflineBackend::openFile(OutputPort *port, const OutputFile &file) {
+	if(!(port->file = fopen(file.path.c_str(), "wb"))) {
+		std::cerr << "Offline Error: Failed to open output file: " << file.path << std::endl;
+		return false;
+	}
+	port->format = file.format;
+	port->framesWritten = 0;
+
+	//placeholder header, sizes are filled in when the file is closed
+	if(port->format == WAV)
+		writeWavHeader(port);
+	return true;
+}
+
+void OfflineBackend::closeFile(OutputPort *port) {
+	if(!port->file)
+		return;
+
+	if(port->format == WAV) {
+		fseek(port->file, 0, SEEK_SET);
+		writeWavHeader(port);
+	}
+	fclose(port->file);
+	port->file = NULL;
+}
+
+void OfflineBackend::writeWavHeader(OutputPort *port) {
+	FILE *f = port->file;
+	uint32_t dataSize = port->framesWritten * sizeof(float);
+
+	//"WAVE", then the fmt, fact and data chunks with their 8 byte headers
+	fwrite("RIFF", 1, 4, f);
+	writeLE32(f, 4 + (8 + 18) + (8 + 4) + 8 + dataSize);
+	fwrite("WAVE", 1, 4, f);
+
+	//mono IEEE float. Formats other than PCM carry a cbSize (0, no extension) and a fact chunk
+	fwrite("fmt ", 1, 4, f);
+	writeLE32(f, 18);
+	writeLE16(f, 3);
+	writeLE16(f, 1);
+	writeLE32(f, (uint32_t)m_sampleRate);
+	writeLE32(f, (uint32_t)m_sampleRate * sizeof(float));
+	writeLE16(f, sizeof(float));
+	writeLE16(f, 32);
+	writeLE16(f, 0);
+
+	fwrite("fact", 1, 4, f);
+	writeLE32(f, 4);
+	writeLE32(f, (uint32_t)port->framesWritten);
+
+	fwrite("data", 1, 4, f);
+	writeLE32(f, dataSize);
+}
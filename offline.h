@@ -0,0 +1,94 @@
+/*
+Copyright (c) 2009-2010 Brett Lajzer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef _WAFFLE_OFFLINE_H_
+#define _WAFFLE_OFFLINE_H_
+
+#include "backend.h"
+
+#include <cstdio>
+#include <map>
+#include <vector>
+#include <pthread.h>
+
+namespace waffle {
+
+//! Renders faster than realtime to files, no audio server needed
+class OfflineBackend : public AudioBackend {
+public:
+	enum FileFormat {
+		WAV,		//32-bit float WAV
+		RAW_FLOAT	//headerless 32-bit floats in host byte order
+	};
+
+	OfflineBackend(float sampleRate = 48000.0f, int bufferSize = 256);
+	virtual ~OfflineBackend();
+
+	//! write the port with this name (the patch name) to a file, can be called before or after the patch is added
+	bool setOutputFile(const std::string &port, const std::string &path, FileFormat format = WAV);
+
+	//! run the engine for the given amount of audio, as fast as possible
+	void render(double seconds);
+	void renderFrames(long frames);
+
+	virtual bool activate(ProcessCallback process, void *arg);
+	virtual void deactivate();
+
+	virtual Port registerPort(const std::string &name);
+	virtual void unregisterPort(Port port);
+	virtual float *getPortBuffer(Port port, int nframes);
+
+	virtual float getSampleRate() { return m_sampleRate; }
+	virtual int getBufferSize() { return m_bufferSize; }
+
+private:
+	struct OutputFile {
+		std::string path;
+		FileFormat format;
+	};
+
+	struct OutputPort {
+		std::string name;
+		std::vector<float> buffer;
+		FILE *file;
+		FileFormat format;
+		long framesWritten;
+	};
+
+	bool openFile(OutputPort *port, const OutputFile &file);
+	void closeFile(OutputPort *port);
+	void writeWavHeader(OutputPort *port);
+
+	float m_sampleRate;
+	int m_bufferSize;
+	ProcessCallback m_process;
+	void *m_processArg;
+
+	//ports can come and go from control threads while rendering
+	pthread_mutex_t m_lock;
+	std::vector<OutputPort *> m_ports;
+	std::map<std::string, OutputFile> m_files;
+};
+
+}
+#endif
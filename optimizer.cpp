@@ -0,0 +1,374 @@
+/*
+Copyright (c) 2009-2010 Brett Lajzer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "patch.h"
+#include "generators.h"
+#include "filters.h"
+#include "osc.h"
+#include "controlrate.h"
+
+#include <cmath>
+#include <iostream>
+#include <set>
+#include <string>
+#include <typeinfo>
+
+using namespace waffle;
+
+//every rewrite here keeps each sample's arithmetic in the same order, so the output doesn't change
+
+//constant terms, so Add and Mult can share the chain collapsing
+static bool hasTerm(Add *a) { return a->hasOffset(); }
+static bool hasTerm(Mult *m) { return m->hasFactor(); }
+static void setTerm(Add *a, sample_t v) { a->setOffset(v); }
+static void setTerm(Mult *m, sample_t v) { m->setFactor(v); }
+static const sample_t IDENTITY_ADD = 0.0;
+static const sample_t IDENTITY_MULT = 1.0;
+
+//Add and Mult chains into n-ary nodes with a constant term
+template<class T>
+static Module *collapse(T *m, std::vector<Module *> &children, std::map<Module *, int> &uses, sample_t identity, bool &changed) {
+	//((a + b) + c) is a + b + c, when nothing else reads the inner one
+	while(!children.empty()) {
+		T *inner = dynamic_cast<T *>(children[0]);
+		if(inner == NULL || typeid(*inner) != typeid(*m) || uses[inner] != 1 || hasTerm(inner)
+			|| inner->getInputCount() == 0)
+			break;
+
+		std::vector<Module *> spliced;
+		for(int n = 0, len = inner->getInputCount(); n < len; ++n)
+			spliced.push_back(inner->getInput(n));
+		children.erase(children.begin());
+		children.insert(children.begin(), spliced.begin(), spliced.end());
+		changed = true;
+	}
+
+	//a constant at the end, or either side of a pair, becomes the term
+	if(!hasTerm(m) && children.size() >= 2) {
+		int at = -1;
+		if(dynamic_cast<Constant *>(children.back()) != NULL)
+			at = children.size() - 1;
+		else if(children.size() == 2 && dynamic_cast<Constant *>(children[0]) != NULL)
+			at = 0;
+
+		if(at >= 0) {
+			//what the Constant would have output
+			sample_t v = (sample_t)static_cast<Constant *>(children[at])->getValue();
+			if(v != identity)
+				setTerm(m, v);
+			children.erase(children.begin() + at);
+			changed = true;
+		}
+	}
+
+	//a single input with nothing to apply is the input itself
+	if(children.size() == 1 && !hasTerm(m))
+		return children[0];
+	return m;
+}
+
+//post-order walk from the output module, false on a cycle or an unconnected input
+bool Patch::order(std::vector<Module *> &modules) {
+	modules.clear();
+
+	std::map<Module *, int> state;
+	std::vector< std::pair<Module *, int> > stack;
+	stack.push_back(std::make_pair(m_module, 0));
+	state[m_module] = 1;
+
+	while(!stack.empty()) {
+		Module *m = stack.back().first;
+		int next = stack.back().second;
+
+		if(next < m->getInputCount()) {
+			++stack.back().second;
+			Module *in = m->getInput(next);
+			if(in == NULL)
+				return false;
+
+			int &inState = state[in];
+			if(inState == 1)
+				return false;
+			if(inState == 0) {
+				inState = 1;
+				stack.push_back(std::make_pair(in, 0));
+			}
+		} else {
+			state[m] = 2;
+			modules.push_back(m);
+			stack.pop_back();
+		}
+	}
+	return true;
+}
+
+int Patch::optimize() {
+	std::vector<Module *> before;
+	if(!order(before))
+		return 0;	//compile() says what's wrong
+
+	//new modules go in with the rest
+	Arena::Scope scope(m_arena);
+	std::vector<Module *> created;
+	bool changed = true;
+	while(changed) {
+		changed = simplify(created);
+		changed = mergeCommon() || changed;
+	}
+
+	//free whatever fell out of the graph
+	std::vector<Module *> after;
+	order(after);
+	std::set<Module *> kept(after.begin(), after.end());
+	std::set<Module *> all(before.begin(), before.end());
+	all.insert(created.begin(), created.end());
+	for(std::set<Module *>::iterator it = all.begin(); it != all.end(); ++it) {
+		if(kept.find(*it) == kept.end())
+			release(*it);
+	}
+
+	int removed = before.size() - after.size();
+	m_removed += removed;
+	return removed;
+}
+
+bool Patch::simplify(std::vector<Module *> &created) {
+	std::vector<Module *> modules;
+	order(modules);
+
+	std::map<Module *, int> uses;
+	for(int i = 0, len = modules.size(); i < len; ++i) {
+		for(int n = 0, inputs = modules[i]->getInputCount(); n < inputs; ++n)
+			++uses[modules[i]->getInput(n)];
+	}
+	++uses[m_module];
+
+	std::map<Module *, Module *> replaced;
+	bool changed = false;
+	for(int i = 0, len = modules.size(); i < len; ++i) {
+		Module *m = modules[i];
+		for(int n = 0, inputs = m->getInputCount(); n < inputs; ++n) {
+			std::map<Module *, Module *>::iterator it = replaced.find(m->getInput(n));
+			if(it != replaced.end())
+				m->setInput(n, it->second);
+		}
+
+		Module *r = simplify(m, uses, created, changed);
+		if(r != m) {
+			//r takes over m's consumers
+			for(int n = 0, inputs = m->getInputCount(); n < inputs; ++n) {
+				if(m->getInput(n) == r)
+					--uses[r];
+			}
+			uses[r] += uses[m];
+			replaced[m] = r;
+			changed = true;
+		}
+	}
+
+	std::map<Module *, Module *>::iterator it = replaced.find(m_module);
+	if(it != replaced.end())
+		m_module = it->second;
+	return changed;
+}
+
+Module *Patch::simplify(Module *m, std::map<Module *, int> &uses, std::vector<Module *> &created, bool &changed) {
+	int count = m->getInputCount();
+
+	//a pure module of constants is a constant. the module works it out itself, so it rounds the same
+	if(m->isPure() && count > 0) {
+		std::vector<sample_t> values(count);
+		std::vector<Constant *> constants;
+		bool constant = true;
+		for(int n = 0; n < count && constant; ++n) {
+			Constant *c = dynamic_cast<Constant *>(m->getInput(n));
+			if(c != NULL)
+				values[n] = (sample_t)c->getValue();
+			else
+				constant = false;
+			constants.push_back(c);
+		}
+
+		if(constant) {
+			//the inputs read from values for one sample, then get their own outputs back: the patch may
+			//already be compiled, and values goes away with this call
+			std::vector<sample_t *> outputs(count);
+			for(int n = 0; n < count; ++n) {
+				outputs[n] = constants[n]->m_output;
+				constants[n]->m_output = &values[n];
+			}
+			sample_t result;
+			m->process(&result, 1);
+			for(int n = count - 1; n >= 0; --n)	//backwards, a Constant can be more than one input
+				constants[n]->m_output = outputs[n];
+
+			Constant *folded = new Constant(result);
+			created.push_back(folded);
+			return folded;
+		}
+	}
+
+	//x - c is x + -c exactly
+	if(Sub *sub = dynamic_cast<Sub *>(m)) {
+		if(Constant *c = dynamic_cast<Constant *>(sub->getInput(1))) {
+			Add *add = new Add();
+			add->addChild(sub->getInput(0));
+			add->setOffset(-(sample_t)c->getValue());
+			created.push_back(add);
+			return add;
+		}
+	}
+
+	if(Add *add = dynamic_cast<Add *>(m))
+		return collapse(add, add->m_children, uses, IDENTITY_ADD, changed);
+	if(Mult *mult = dynamic_cast<Mult *>(m))
+		return collapse(mult, mult->m_children, uses, IDENTITY_MULT, changed);
+	return m;
+}
+
+bool Patch::mergeCommon() {
+	std::vector<Module *> modules;
+	order(modules);
+
+	//modules of the same class reading the same inputs, candidates for merging
+	typedef std::pair< std::string, std::vector<Module *> > Key;
+	std::map< Key, std::vector<Module *> > seen;
+	std::map<Module *, Module *> replaced;
+	bool changed = false;
+
+	for(int i = 0, len = modules.size(); i < len; ++i) {
+		Module *m = modules[i];
+		Key key;
+		key.first = typeid(*m).name();
+		for(int n = 0, inputs = m->getInputCount(); n < inputs; ++n) {
+			std::map<Module *, Module *>::iterator it = replaced.find(m->getInput(n));
+			if(it != replaced.end())
+				m->setInput(n, it->second);
+			key.second.push_back(m->getInput(n));
+		}
+
+		std::vector<Module *> &same = seen[key];
+		Module *merged = NULL;
+		for(int k = 0, candidates = same.size(); k < candidates && merged == NULL; ++k) {
+			if(same[k]->equivalent(m))
+				merged = same[k];
+		}
+
+		if(merged != NULL) {
+			replaced[m] = merged;
+			changed = true;
+		} else {
+			same.push_back(m);
+		}
+	}
+
+	std::map<Module *, Module *>::iterator it = replaced.find(m_module);
+	if(it != replaced.end())
+		m_module = it->second;
+	return changed;
+}
+
+//changes slowly enough to run at control rate: constants, arithmetic, and oscillators with a fixed low
+//frequency. Values and OSC modules stay out, timed events and bundles have to reach them on their frame
+static bool isSlow(Module *m) {
+	if(dynamic_cast<EventTarget *>(m) != NULL && dynamic_cast<Constant *>(m) == NULL)
+		return false;
+	if(m->isPure())
+		return true;
+
+	WaveformGenerator *g = dynamic_cast<WaveformGenerator *>(m);
+	Constant *freq = (g != NULL) ? dynamic_cast<Constant *>(g->getInput(0)) : NULL;
+	return freq != NULL && fabs(freq->getValue()) <= CONTROL_MAX_FREQ;
+}
+
+int Patch::inferControlRate(int period) {
+	std::vector<Module *> modules;
+	if(!order(modules))
+		return 0;
+
+	std::map<Module *, int> uses;
+	for(int i = 0, len = modules.size(); i < len; ++i) {
+		for(int n = 0, inputs = modules[i]->getInputCount(); n < inputs; ++n)
+			++uses[modules[i]->getInput(n)];
+	}
+	++uses[m_module];
+
+	Arena::Scope scope(m_arena);
+	std::set<Module *> moved;
+	int count = 0;
+
+	//consumers before their inputs, so the largest subgraph is the one taken
+	for(int i = modules.size() - 1; i >= 0; --i) {
+		Module *m = modules[i];
+		if(moved.count(m) != 0)
+			continue;
+
+		for(int n = 0, inputs = m->getInputCount(); n < inputs; ++n) {
+			Module *root = m->getInput(n);
+			if(!m->isControlInput(n) || uses[root] != 1 || dynamic_cast<Value *>(root) != NULL)
+				continue;
+
+			std::set<Module *> subgraph;
+			subgraph.insert(root);
+			root->gatherSubModules(subgraph);
+
+			std::map<Module *, int> inside;
+			bool slow = true, oscillator = false;
+			for(std::set<Module *>::iterator it = subgraph.begin(); it != subgraph.end() && slow; ++it) {
+				slow = isSlow(*it);
+				oscillator = oscillator || dynamic_cast<WaveformGenerator *>(*it) != NULL;
+				for(int k = 0, len = (*it)->getInputCount(); k < len; ++k)
+					++inside[(*it)->getInput(k)];
+			}
+			if(!slow || !oscillator)
+				continue;
+
+			//nothing outside may read the subgraph, except Constants, which can be copied
+			bool alone = true;
+			for(std::set<Module *>::iterator it = subgraph.begin(); it != subgraph.end() && alone; ++it)
+				alone = *it == root || uses[*it] == inside[*it] || dynamic_cast<Constant *>(*it) != NULL;
+			if(!alone)
+				continue;
+
+			std::map<Module *, Module *> copies;
+			for(std::set<Module *>::iterator it = subgraph.begin(); it != subgraph.end(); ++it) {
+				Constant *c = dynamic_cast<Constant *>(*it);
+				if(c != NULL && uses[c] != inside[c])
+					copies[c] = new Constant(c->getValue());
+			}
+			for(std::set<Module *>::iterator it = subgraph.begin(); it != subgraph.end(); ++it) {
+				for(int k = 0, len = (*it)->getInputCount(); k < len; ++k) {
+					std::map<Module *, Module *>::iterator copy = copies.find((*it)->getInput(k));
+					if(copy != copies.end()) {
+						--uses[copy->first];
+						(*it)->setInput(k, copy->second);
+					}
+				}
+			}
+
+			m->setInput(n, new ControlRate(root, period));
+			moved.insert(subgraph.begin(), subgraph.end());
+			++count;
+		}
+	}
+	return count;
+}
@@ -23,108 +23,339 @@ THE SOFTWARE.
 #include "osc.h"
 #include "waffle.h"
 
+#include <cstring>
 #include <iostream>
 #include <sstream>
+#include <vector>
+#include <pthread.h>
+#include <sched.h>
 
 using namespace waffle;
 
 lo_server_thread OSCModule::ms_pServerThread = NULL;
 unsigned int OSCModule::ms_portNum = 7770;
+std::string OSCModule::ms_socketPath;
 
-OSCModule::OSCModule() {
-	pthread_mutex_init(&m_lock, NULL);
+namespace {
+
+//where messages on a path go
+struct Method {
+	uint32_t hash;
+	std::string path;
+	std::string types;
+	lo_method_handler handler;
+	OSCModule *module;
+};
+
+//open addressed by path hash, modules on the same path follow each other. Never changed once published,
+//adding or removing a method builds a new one
+struct MethodTable {
+	std::vector<Method> methods;
+	std::vector<int> slots;	//index into methods plus one, 0 for empty
+	unsigned mask;
+};
+
+std::atomic<MethodTable *> s_methods(NULL);
+//odd while dispatch() looks at a table, so a replaced one is freed once it is done
+std::atomic<unsigned> s_dispatching(0);
+std::atomic<unsigned long> s_messages(0);
+//serializes changes to the table
+pthread_mutex_t s_methodLock = PTHREAD_MUTEX_INITIALIZER;
+
+//server thread only: nesting of the bundle being dispatched and its batch, see EventQueue::openBatch()
+int s_bundleDepth = 0;
+unsigned s_batch = 0;
+
+//FNV-1a
+uint32_t hashPath(const char *path) {
+	uint32_t hash = 2166136261u;
+	for(; *path; ++path)
+		hash = (hash ^ (unsigned char)*path) * 16777619u;
+	return hash;
+}
+
+//numeric arguments converted to the types a method takes, as liblo does for a method's typespec. False if
+//they don't convert
+static const int MAX_COERCED_ARGS = 8;
+bool coerce(const std::string &want, const char *types, lo_arg **argv, lo_arg *args, lo_arg **coerced) {
+	int count = want.size();
+	if(count > MAX_COERCED_ARGS || (int)strlen(types) != count)
+		return false;
+	for(int i = 0; i < count; ++i) {
+		if(!lo_is_numerical_type((lo_type)want[i]) || !lo_is_numerical_type((lo_type)types[i])
+			|| !lo_coerce((lo_type)want[i], &args[i], (lo_type)types[i], argv[i]))
+			return false;
+		coerced[i] = &args[i];
+	}
+	return true;
+}
+
+//publish a table for methods and free the one it replaces, with s_methodLock held
+void publish(const std::vector<Method> &methods) {
+	MethodTable *table = new MethodTable();
+	table->methods = methods;
+	unsigned size = 16;
+	while(size < methods.size() * 2)
+		size *= 2;
+	table->slots.assign(size, 0);
+	table->mask = size - 1;
+	for(int i = 0, len = methods.size(); i < len; ++i) {
+		unsigned slot = methods[i].hash & table->mask;
+		while(table->slots[slot])
+			slot = (slot + 1) & table->mask;
+		table->slots[slot] = i + 1;
+	}
+
+	MethodTable *old = s_methods.exchange(table);
+	//dispatch() may still be reading the old table or calling a module that is going away, wait it out
+	unsigned dispatching = s_dispatching.load();
+	if(dispatching % 2)
+		while(s_dispatching.load() == dispatching)
+			sched_yield();
+	delete old;
+}
+
+}
+
+OSCModule::OSCModule() : m_tracePath("osc") {
+}
+
+//interned names live for good, so only while there's a trace to name them in, like patch names
+OSCModule::OSCModule(const std::string &path) : m_tracePath(Trace::isEnabled() ? Trace::intern(path) : "osc") {
 }
 
 OSCModule::~OSCModule() {
-	pthread_mutex_destroy(&m_lock);
+	pthread_mutex_lock(&s_methodLock);
+	MethodTable *table = s_methods.load();
+	if(table) {
+		std::vector<Method> methods;
+		for(int i = 0, len = table->methods.size(); i < len; ++i)
+			if(table->methods[i].module != this)
+				methods.push_back(table->methods[i]);
+		if(methods.size() != table->methods.size())
+			publish(methods);
+	}
+	pthread_mutex_unlock(&s_methodLock);
 }
 
 lo_server_thread OSCModule::getServerThread() {
 	if(!ms_pServerThread) {
-		std::stringstream s;
-		s << ms_portNum;
-		ms_pServerThread = lo_server_thread_new_with_proto(s.str().c_str(), LO_UDP, OSCModule::errorHandler);
+		if(ms_socketPath.empty()) {
+			std::stringstream s;
+			s << ms_portNum;
+			ms_pServerThread = lo_server_thread_new_with_proto(s.str().c_str(), LO_UDP, OSCModule::errorHandler);
+		} else {
+			ms_pServerThread = lo_server_thread_new_with_proto(ms_socketPath.c_str(), LO_UNIX, OSCModule::errorHandler);
+		}
+		if(!ms_pServerThread)
+			return NULL;
+
+		//one method for every path, dispatch() finds the modules
+		lo_server_thread_add_method(ms_pServerThread, NULL, NULL, OSCModule::dispatch, NULL);
+		lo_server_add_bundle_handlers(lo_server_thread_get_server(ms_pServerThread), OSCModule::bundleStart, OSCModule::bundleEnd, NULL);
 		lo_server_thread_start(ms_pServerThread);
 	}
 	return ms_pServerThread;
 }
 
+void OSCModule::addMethod(const std::string &path, const char *types, lo_method_handler handler) {
+	if(!getServerThread())
+		std::cerr << "OSC Warning: no server, " << path << " won't get messages." << std::endl;
+
+	Method m;
+	m.hash = hashPath(path.c_str());
+	m.path = path;
+	m.types = types;
+	m.handler = handler;
+	m.module = this;
+
+	pthread_mutex_lock(&s_methodLock);
+	MethodTable *table = s_methods.load();
+	std::vector<Method> methods;
+	if(table)
+		methods = table->methods;
+	methods.push_back(m);
+	publish(methods);
+	pthread_mutex_unlock(&s_methodLock);
+}
+
+int OSCModule::dispatch(const char *path, const char *types, lo_arg **argv, int argc, lo_message msg, void *user_data) {
+	s_dispatching.fetch_add(1);
+	MethodTable *table = s_methods.load();
+	int result = 1;
+
+	if(table) {
+		uint32_t hash = hashPath(path);
+		for(unsigned slot = hash & table->mask; table->slots[slot]; slot = (slot + 1) & table->mask) {
+			Method &m = table->methods[table->slots[slot] - 1];
+			if(m.hash != hash || m.path != path)
+				continue;
+			if(m.types == types) {
+				m.handler(path, types, argv, argc, msg, m.module);
+				result = 0;
+			} else {
+				//an int or a double for a float
+				lo_arg args[MAX_COERCED_ARGS];
+				lo_arg *coerced[MAX_COERCED_ARGS];
+				if(coerce(m.types, types, argv, args, coerced)) {
+					m.handler(path, m.types.c_str(), coerced, argc, msg, m.module);
+					result = 0;
+				}
+			}
+		}
+	}
+
+	s_dispatching.fetch_add(1);
+	if(result == 0)
+		s_messages.fetch_add(1, std::memory_order_relaxed);
+	return result;
+}
+
+unsigned long OSCModule::getMessageCount() {
+	return s_messages.load(std::memory_order_relaxed);
+}
+
+int OSCModule::bundleStart(lo_timetag time, void *user_data) {
+	if(s_bundleDepth++ == 0)
+		s_batch = EventQueue::openBatch();
+	return 0;
+}
+
+int OSCModule::bundleEnd(void *user_data) {
+	if(--s_bundleDepth == 0) {
+		EventQueue::closeBatch(s_batch);
+		s_batch = 0;
+	}
+	return 0;
+}
+
+void OSCModule::traceMessage(double value) {
+	if(Trace::isEnabled()) {
+		Trace::nameThread("osc");
+		Trace::instant(Trace::OSC, m_tracePath, value);
+	}
+}
+
+uint64_t OSCModule::messageFrame(lo_message msg) {
+	lo_timetag time = lo_message_get_timestamp(msg);
+	if(time.sec == 0 && time.frac <= 1)
+		return 0;	//LO_TT_IMMEDIATE
+
+	//NTP time, from 1900
+	return Waffle::frameAt((double)time.sec - 2208988800.0 + time.frac / 4294967296.0);
+}
+
+bool OSCModule::postMessage(lo_message msg, double value) {
+	uint64_t frame = messageFrame(msg);
+	if(frame == 0 && s_bundleDepth == 0)
+		return false;
+	return post(frame, value, false, s_batch);
+}
+
 void OSCModule::errorHandler(int num, const char *msg, const char *path) {
 	std::cerr << "OSC error " << num << " in path " << path << ": " << msg << std::endl;
 }
-
-OSCTrigger::OSCTrigger(const std::string &path) : OSCModule(), m_trigger(false) {
-	lo_server_thread_add_method(getServerThread(), path.c_str(), "", OSCTrigger::oscCallback, this);
+OSCTrigger::OSCTrigger(const std::string &path) : OSCModule(path), m_posted(0), m_queued(0), m_high(false) {
+	addMethod(path, "", OSCTrigger::oscCallback);
 }
 	
-double OSCTrigger::run() {
-	double result = 0.0;
-	pthread_mutex_lock(&m_lock);
-	if(m_trigger) {
-		m_trigger = false;
-		result = 1.0;
+void OSCTrigger::process(sample_t *out, int nframes) {
+	m_queued += m_posted.exchange(0, std::memory_order_acquire);
+	m_constant = (m_queued == 0);
+
+	//pulses are separated by a low sample so a burst isn't merged into one long trigger
+	for(int i = 0; i < nframes; ++i) {
+		if(m_queued && !m_high) {
+			--m_queued;
+			m_high = true;
+			out[i] = 1.0;
+		} else {
+			m_high = false;
+			out[i] = 0.0;
+		}
 	}
-	pthread_mutex_unlock(&m_lock);
-	return result;
 }
 
 int OSCTrigger::oscCallback(const char *path, const char *types, lo_arg **argv, int argc, lo_message  msg, void *user_data) {
-	static_cast<OSCTrigger *>(user_data)->trigger();
+	OSCTrigger *self = static_cast<OSCTrigger *>(user_data);
+	self->traceMessage(1.0);
+	if(!self->postMessage(msg, 1.0))
+		self->trigger();
 	return 0;
 }
 
+void OSCTrigger::receive(double value) {
+	++m_queued;
+}
+
 void OSCTrigger::trigger() {
-	pthread_mutex_lock(&m_lock);
-	m_trigger = true;
-	pthread_mutex_unlock(&m_lock);
+	m_posted.fetch_add(1, std::memory_order_release);
 }
 
 
-OSCTimedTrigger::OSCTimedTrigger(const std::string &path) : OSCModule(), m_timer(0) {
-	lo_server_thread_add_method(getServerThread(), path.c_str(), "f", OSCTimedTrigger::oscCallback, this);
+OSCTimedTrigger::OSCTimedTrigger(const std::string &path) : OSCModule(path), m_request(-1), m_timer(0) {
+	addMethod(path, "f", OSCTimedTrigger::oscCallback);
 }
 	
-double OSCTimedTrigger::run() {
-	double result = 0.0;
-	pthread_mutex_lock(&m_lock);
-	if(m_timer) {
-		--m_timer;
-		result = 1.0;
+void OSCTimedTrigger::process(sample_t *out, int nframes) {
+	//a new trigger restarts the timer
+	int request = m_request.exchange(-1, std::memory_order_acquire);
+	if(request >= 0)
+		m_timer = request;
+	m_constant = (m_timer == 0 || m_timer >= nframes);
+
+	for(int i = 0; i < nframes; ++i) {
+		if(m_timer) {
+			--m_timer;
+			out[i] = 1.0;
+		} else {
+			out[i] = 0.0;
+		}
 	}
-	pthread_mutex_unlock(&m_lock);
-	return result;
 }
 
 void OSCTimedTrigger::trigger(float time) {
-	pthread_mutex_lock(&m_lock);
-	m_timer = (int)(time * Waffle::sampleRate);
-	pthread_mutex_unlock(&m_lock);
+	m_request.store((int)(time * Waffle::sampleRate), std::memory_order_release);
 }
 	
 int OSCTimedTrigger::oscCallback(const char *path, const char *types, lo_arg **argv, int argc, lo_message  msg, void *user_data) {
-	static_cast<OSCTimedTrigger *>(user_data)->trigger(argv[0]->f);
+	OSCTimedTrigger *self = static_cast<OSCTimedTrigger *>(user_data);
+	self->traceMessage(argv[0]->f);
+	if(!self->postMessage(msg, argv[0]->f))
+		self->trigger(argv[0]->f);
 	return 0;
 }
 
-OSCValue::OSCValue(const std::string &path) : OSCModule(), m_value(0.0) {
-	lo_server_thread_add_method(getServerThread(), path.c_str(), "f", OSCValue::oscCallback, this);
+void OSCTimedTrigger::receive(double value) {
+	//the audio thread owns the timer, no need to go through m_request
+	m_timer = (int)(value * Waffle::sampleRate);
+}
+
+OSCValue::OSCValue(const std::string &path) : OSCModule(path), m_value(0.0) {
+	addMethod(path, "f", OSCValue::oscCallback);
 }
 	
 int OSCValue::oscCallback(const char *path, const char *types, lo_arg **argv, int argc, lo_message  msg, void *user_data) {
-	static_cast<OSCValue *>(user_data)->setValue(argv[0]->f);
+	OSCValue *self = static_cast<OSCValue *>(user_data);
+	self->traceMessage(argv[0]->f);
+	if(!self->postMessage(msg, argv[0]->f))
+		self->setValue(argv[0]->f);
 	return 0;
 }
 
 void OSCValue::setValue(double v) {
-	pthread_mutex_lock(&m_lock);
-	m_value = v;
-	pthread_mutex_unlock(&m_lock);
+	m_value.store(v, std::memory_order_relaxed);
 }
 
 double OSCValue::getValue() {
-	pthread_mutex_lock(&m_lock);
-	double val = m_value;
-	pthread_mutex_unlock(&m_lock);
-	return val;
+	return m_value.load(std::memory_order_relaxed);
+}
+
+void OSCValue::process(sample_t *out, int nframes) {
+	//read once per block, messages in between only leave the latest
+	double val = getValue();
+	for(int i = 0; i < nframes; ++i)
+		out[i] = val;
+	m_constant = true;
 }
 
@@ -24,44 +24,85 @@ THE SOFTWARE.
 #define _WAFFLE_OSC_H_
 
 #include "Module.h"
+#include "events.h"
 
+#include <atomic>
+#include <string>
 #include <lo/lo.h>
-#include <pthread.h>
 
 namespace waffle {
 
-//! Base for all OSC modules
-class OSCModule : public Module {
+//! Base for all OSC modules. One server thread takes every message and finds its modules by a hash of
+//! the path. A message on its own is applied at the start of the next block, and repeats to the same
+//! module before then only leave the latest. A bundle is applied as a unit: all of it in the same callback,
+//! on the frame its timetag names if it has one (see Waffle::frameAt())
+class OSCModule : public Module, public EventTarget {
 public:
 	OSCModule();
 	virtual ~OSCModule();
 	
-	virtual void gatherSubModules(std::set<Module *> &modules) {}
-	
+	//where the server listens, call before making the first OSC module. UDP on port 7770 unless set.
+	//A UNIX domain socket has lower latency for senders on the same machine
 	static void setPort(unsigned int portNum) { ms_portNum = portNum; }
+	static void setUnixSocket(const std::string &path) { ms_socketPath = path; }
 	static lo_server_thread getServerThread();
+
+	//hand a message to the modules on its path, as the server thread does. Returns 0 if some module took it.
+	//Only call it from one thread at a time, which is the server thread once a sender is connected
+	static int dispatch(const char *path, const char *types, lo_arg **argv, int argc, lo_message msg, void *user_data);
+	//the server's bundle handlers: messages dispatched between them are one bundle
+	static int bundleStart(lo_timetag time, void *user_data);
+	static int bundleEnd(void *user_data);
+	//messages handed to a module since the start
+	static unsigned long getMessageCount();
+
 protected:
-	pthread_mutex_t m_lock;
+	OSCModule(const std::string &path);
+
+	//route messages on path with exactly these argument types to handler, with this module as its user_data.
+	//The module's routes go away with it
+	void addMethod(const std::string &path, const char *types, lo_method_handler handler);
+	//queue value for the frame the message asks for, as part of its bundle. False if the message is on its
+	//own without a timetag, or the queue is full: the module applies it directly then
+	bool postMessage(lo_message msg, double value);
+
+	//a message for this module on the trace, if one is running. Called from the OSC thread
+	void traceMessage(double value);
+	//the frame a message's bundle timetag asks for, 0 (as soon as possible) without one
+	static uint64_t messageFrame(lo_message msg);
+
+	//the path for Trace if it was made while tracing, else "osc"
+	const char *m_tracePath;
 
 private:
 	static void errorHandler(int num, const char *msg, const char *path);
 
 	static lo_server_thread ms_pServerThread;
 	static unsigned int ms_portNum;
+	static std::string ms_socketPath;
 };
 
-//! Basic OSC trigger
+//! Basic OSC trigger, every message becomes its own one sample pulse
 class OSCTrigger : public OSCModule {
 public:
 	OSCTrigger(const std::string &path);
 	
-	double run();
+	void process(sample_t *out, int nframes);
 	bool isValid() { return true; }
+	//triggers play out on time even when nobody listens
+	void skip(int nframes) { process(m_output, nframes); }
+	void receive(double value);
 private:
 	void trigger();
 	
 	static int oscCallback(const char *path, const char *types, lo_arg **argv, int argc, lo_message  msg, void *user_data);
-	bool m_trigger;
+
+	//triggers posted by the OSC thread and not yet picked up by the audio thread
+	std::atomic<int> m_posted;
+
+	//audio thread only: triggers still to be played and whether the last sample was high
+	int m_queued;
+	bool m_high;
 };
 
 //! OSC trigger that stays high for an amount of time
@@ -69,12 +110,19 @@ class OSCTimedTrigger : public OSCModule {
 public:
 	OSCTimedTrigger(const std::string &path);
 	
-	double run();
+	void process(sample_t *out, int nframes);
 	bool isValid() { return true; }
+	void skip(int nframes) { process(m_output, nframes); }
+	//the delay is counted in frames
+	bool canStride() { return false; }
+	void receive(double value);
 private:
 	void trigger(float time);
 	
 	static int oscCallback(const char *path, const char *types, lo_arg **argv, int argc, lo_message  msg, void *user_data);
+
+	//length in samples of the latest trigger, -1 when there is none
+	std::atomic<int> m_request;
 	int m_timer;
 };
 
@@ -83,14 +131,16 @@ class OSCValue : public OSCModule {
 public:
 	OSCValue(const std::string &path);
 	
-	double run(){};
+	void process(sample_t *out, int nframes);
+	void skip(int nframes) { process(m_output, nframes); }
 	double getValue();
 	bool isValid() { return true; }
+	void receive(double value) { setValue(value); }
 private:
 	void setValue(double v);
 	
 	static int oscCallback(const char *path, const char *types, lo_arg **argv, int argc, lo_message  msg, void *user_data);
-	double m_value;
+	std::atomic<double> m_value;
 };
 
 }
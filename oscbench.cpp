@@ -0,0 +1,254 @@
+/*
+Copyright (c) 2009-2010 Brett Lajzer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+// Waffle - oscbench.cpp
+// OSC ingestion benchmarks: path dispatch, bundles, and a local load generator sending to the server.
+// Run with "make oscbench", optionally passing seconds per case and "unix" to send over a UNIX domain
+// socket instead of UDP: ./lw-oscbench 5 unix
+
+#include "waffle.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace waffle;
+
+static const float SAMPLE_RATE = 48000.0f;
+static const int BUFFER_SIZE = 256;
+static const char *SOCKET_PATH = "/tmp/lw-oscbench.sock";
+static const unsigned PORT = 7771;
+
+static double g_seconds = 2.0;
+static bool g_unix = false;
+
+static double now() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const std::string &name, double elapsed, double messages) {
+	printf("%-40s %10.1f ns/message %10.2f Mmessages/s\n", name.c_str(), elapsed * 1e9 / messages, messages / elapsed * 1e-6);
+}
+
+static std::string pathFor(int i) {
+	char path[32];
+	snprintf(path, 32, "/bench/param/%d", i);
+	return path;
+}
+
+//dispatch to one of count modules, against a scan of every path in turn as one liblo method per path does
+//(a lower bound: liblo also pattern matches each one)
+static void benchDispatch(int count) {
+	std::vector<OSCValue *> values;
+	std::vector<std::string> paths;
+	for(int i = 0; i < count; ++i) {
+		paths.push_back(pathFor(i));
+		values.push_back(new OSCValue(paths.back()));
+	}
+
+	lo_arg arg;
+	lo_arg *argv[1] = { &arg };
+	long messages = 0;
+	double start = now();
+	while(now() - start < g_seconds) {
+		for(int i = 0; i < 1000; ++i) {
+			arg.f = (float)i;
+			OSCModule::dispatch(paths[(messages + i * 7919) % count].c_str(), "f", argv, 1, NULL, NULL);
+		}
+		messages += 1000;
+	}
+	char name[64];
+	snprintf(name, 64, "hashed dispatch, %d paths", count);
+	report(name, now() - start, messages);
+
+	long scanned = 0, missed = 0;
+	start = now();
+	while(now() - start < g_seconds) {
+		for(int i = 0; i < 1000; ++i) {
+			const char *path = paths[(scanned + i * 7919) % count].c_str();
+			int k = 0;
+			while(k < count && strcmp(paths[k].c_str(), path) != 0)
+				++k;
+			if(k == count)
+				++missed;
+		}
+		scanned += 1000;
+	}
+	snprintf(name, 64, "linear scan, %d paths", count);
+	report(name, now() - start, scanned);
+	if(missed)
+		printf("linear scan missed %ld paths\n", missed);
+
+	for(int i = 0; i < count; ++i)
+		delete values[i];
+}
+
+//bundles of size messages to modules in a playing patch, each bundle applied in one callback
+static void benchBundles(int size) {
+	OfflineBackend *backend = new OfflineBackend(SAMPLE_RATE, BUFFER_SIZE);
+	Waffle *w = new Waffle(backend);
+	std::vector<std::string> paths;
+	Add *sum = new Add();
+	for(int i = 0; i < size; ++i) {
+		paths.push_back(pathFor(i));
+		sum->addChild(new OSCValue(paths.back()));
+	}
+	w->addPatch("bundles", new Patch(sum));
+	w->start("bundles");
+
+	lo_timetag immediate = { 0, 1 };
+	lo_arg arg;
+	lo_arg *argv[1] = { &arg };
+	long messages = 0;
+	double start = now();
+	while(now() - start < g_seconds) {
+		//a callback's worth of bundles, as many as fit the queue
+		for(int b = 0; b < 256 / size; ++b) {
+			OSCModule::bundleStart(immediate, NULL);
+			for(int i = 0; i < size; ++i) {
+				arg.f = (float)b;
+				OSCModule::dispatch(paths[i].c_str(), "f", argv, 1, NULL, NULL);
+			}
+			OSCModule::bundleEnd(NULL);
+			messages += size;
+		}
+		backend->render(BUFFER_SIZE / SAMPLE_RATE);
+	}
+	char name[64];
+	snprintf(name, 64, "bundles of %d, rendered", size);
+	report(name, now() - start, messages);
+	delete w;
+}
+
+//senders blast messages at the server for a while, then single messages measure delivery latency
+static void benchLoad(int senders) {
+	char port[32];
+	snprintf(port, 32, "%u", PORT);
+
+	OfflineBackend *backend = new OfflineBackend(SAMPLE_RATE, BUFFER_SIZE);
+	Waffle *w = new Waffle(backend);
+	Add *sum = new Add();
+	for(int i = 0; i < 64; ++i)
+		sum->addChild(new OSCValue(pathFor(i)));
+	w->addPatch("load", new Patch(sum));
+	w->start("load");
+
+	std::vector<std::thread> threads;
+	std::vector<long> sent(senders, 0);
+	std::atomic<bool> done(false);
+	unsigned long received = OSCModule::getMessageCount();
+	double start = now();
+	for(int s = 0; s < senders; ++s) {
+		threads.push_back(std::thread([s, port, &sent, &done]() {
+			lo_address target = g_unix ? lo_address_new_from_url((std::string("osc.unix:///") + SOCKET_PATH).c_str()) :
+				lo_address_new("127.0.0.1", port);
+			for(long i = 0; !done; ++i)
+				if(lo_send(target, pathFor((s * 16 + i) % 64).c_str(), "f", (float)i) >= 0)
+					++sent[s];
+			lo_address_free(target);
+		}));
+	}
+
+	//render in real time meanwhile, so the patch's controls are being read
+	double next = start;
+	while(now() - start < g_seconds) {
+		backend->render(BUFFER_SIZE / SAMPLE_RATE);
+		next += BUFFER_SIZE / SAMPLE_RATE;
+		double wait = next - now();
+		if(wait > 0)
+			usleep((useconds_t)(wait * 1e6));
+	}
+	done = true;
+	for(int s = 0; s < senders; ++s)
+		threads[s].join();
+	double elapsed = now() - start;
+	usleep(100000);
+	received = OSCModule::getMessageCount() - received;
+
+	long total = 0;
+	for(int s = 0; s < senders; ++s)
+		total += sent[s];
+	printf("%-40s %10.0f sent/s %10.0f received/s %6.2f%% lost\n", g_unix ? "load, unix socket" : "load, udp",
+		total / elapsed, received / elapsed, total ? 100.0 * (total - (long)received) / total : 0.0);
+
+	//latency: one message at a time, until the server has dispatched it. Give up if ten in a row get lost
+	lo_address target = g_unix ? lo_address_new_from_url((std::string("osc.unix:///") + SOCKET_PATH).c_str()) :
+		lo_address_new("127.0.0.1", port);
+	std::vector<double> latencies;
+	for(int i = 0; i < 1000 && latencies.size() + 10 > (size_t)i; ++i) {
+		unsigned long before = OSCModule::getMessageCount();
+		double sentAt = now();
+		lo_send(target, pathFor(0).c_str(), "f", (float)i);
+		while(OSCModule::getMessageCount() == before && now() - sentAt < 0.1)
+			;
+		if(OSCModule::getMessageCount() != before)
+			latencies.push_back(now() - sentAt);
+	}
+	lo_address_free(target);
+	if(latencies.empty()) {
+		printf("%-40s nothing arrived\n", "latency");
+	} else {
+		std::sort(latencies.begin(), latencies.end());
+		printf("%-40s %10.1f us median %10.1f us p99 %10.1f us worst\n", "latency", latencies[latencies.size() / 2] * 1e6,
+			latencies[latencies.size() * 99 / 100] * 1e6, latencies.back() * 1e6);
+	}
+	delete w;
+}
+
+int main(int argc, char *argv[]) {
+	if(argc > 1)
+		g_seconds = atof(argv[1]);
+	if(argc > 2 && strcmp(argv[2], "unix") == 0)
+		g_unix = true;
+
+	if(g_unix) {
+		unlink(SOCKET_PATH);
+		OSCModule::setUnixSocket(SOCKET_PATH);
+	} else {
+		OSCModule::setPort(PORT);
+	}
+
+	printf("waffle osc bench: %.1fs per case, %s\n", g_seconds, g_unix ? "unix socket" : "udp");
+	benchDispatch(16);
+	benchDispatch(256);
+	benchDispatch(4096);
+	benchBundles(8);
+	benchBundles(64);
+
+	int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	benchLoad(1);
+	if(cpus > 2)
+		benchLoad(cpus - 2);
+
+	if(g_unix)
+		unlink(SOCKET_PATH);
+	return 0;
+}
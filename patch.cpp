@@ -21,23 +21,466 @@ THE SOFTWARE.
 */
 
 #include "patch.h"
+#include "bytecode.h"
+#include "controlrate.h"
+#include "voicepool.h"
+
+#include <algorithm>
+#include <map>
+#include <typeinfo>
 
 using namespace waffle;
 
 Patch::~Patch() {
-	std::set<Module *> modules;
-	modules.insert(m_module);
-	m_module->gatherSubModules(modules);
-	
-	std::set<Module *>::iterator it = modules.begin();
-	std::set<Module *>::iterator endCached = modules.end();
-	for( ; it != endCached; ++it) {
-		std::cout << *it << std::endl;
-		delete (*it);
+	unlower();
+
+	//a compiled patch already has every module listed once
+	if(m_schedule.empty()) {
+		std::set<Module *> modules;
+		modules.insert(m_module);
+		m_module->gatherSubModules(modules);
+		m_schedule.assign(modules.begin(), modules.end());
 	}
+
+	for(int i = 0, len = m_schedule.size(); i < len; ++i)
+		release(m_schedule[i]);
+	if(m_ownsArena)
+		delete m_arena;
+	delete m_events;
+}
+
+void Patch::release(Module *m) {
+	if(m_arena == NULL || !m_arena->owns(m))
+		delete m;
 }
 
 void Patch::setPlaying(bool playing) {
 	m_silent = !playing;
 }
 
+
+bool Patch::compile() {
+	unlower();
+	m_schedule.clear();
+
+	//iterative post-order walk of the graph: 1 = being visited, 2 = scheduled
+	std::map<Module *, int> state;
+	std::vector< std::pair<Module *, int> > stack;
+	stack.push_back(std::make_pair(m_module, 0));
+	state[m_module] = 1;
+
+	while(!stack.empty()) {
+		Module *m = stack.back().first;
+		int next = stack.back().second;
+
+		//eager inputs first, so lazy inputs can be decided on before they're rendered
+		int count = m->getInputCount();
+		if(next < 2 * count) {
+			++stack.back().second;
+			int n = (next < count) ? next : next - count;
+			if(m->isLazyInput(n) != (next >= count))
+				continue;
+
+			Module *in = m->getInput(n);
+			if(in == NULL) {
+				std::cerr << "Patch Error: module has an unconnected input" << std::endl;
+				m_schedule.clear();
+				return false;
+			}
+
+			int &inState = state[in];
+			if(inState == 1) {
+				std::cerr << "Patch Error: module graph contains a cycle" << std::endl;
+				m_schedule.clear();
+				return false;
+			} else if(inState == 0) {
+				inState = 1;
+				stack.push_back(std::make_pair(in, 0));
+			}
+		} else {
+			//a voice pool or control rate subgraph that failed to build would crash when run. Other modules'
+			//isValid() walks their inputs, which is exponential on shared subgraphs, and those were checked above
+			if((dynamic_cast<VoicePool *>(m) != NULL || dynamic_cast<ControlRate *>(m) != NULL) && !m->isValid()) {
+				std::cerr << "Patch Error: module is invalid" << std::endl;
+				m_schedule.clear();
+				return false;
+			}
+			state[m] = 2;
+			m_schedule.push_back(m);
+			stack.pop_back();
+		}
+	}
+
+	//one contiguous slab holds every module's output slot
+	m_slots.assign(m_schedule.size() * MAX_BLOCK_SIZE, 0.0);
+	for(int i = 0, len = m_schedule.size(); i < len; ++i)
+		m_schedule[i]->m_output = &m_slots[i * MAX_BLOCK_SIZE];
+
+	findGuards();
+	partition();
+	return true;
+}
+
+void Patch::findGuards() {
+	m_guards.clear();
+
+	int count = m_schedule.size();
+	std::map<Module *, int> index;
+	for(int i = 0; i < count; ++i)
+		index[m_schedule[i]] = i;
+
+	std::vector<int> uses(count, 0);
+	for(int i = 0; i < count; ++i) {
+		for(int n = 0, len = m_schedule[i]->getInputCount(); n < len; ++n)
+			++uses[index[m_schedule[i]->getInput(n)]];
+	}
+
+	for(int i = 0; i < count; ++i) {
+		Module *consumer = m_schedule[i];
+		for(int n = 0, len = consumer->getInputCount(); n < len; ++n) {
+			if(!consumer->isLazyInput(n))
+				continue;
+
+			Module *root = consumer->getInput(n);
+			std::set<Module *> subtree;
+			subtree.insert(root);
+			root->gatherSubModules(subtree);
+
+			//the subtree has to be a contiguous run of the schedule that nothing else reads
+			Guard guard = { index[root] + 1 - (int)subtree.size(), index[root] + 1, consumer, n };
+			int edges = 0, internal = 0;
+			bool skippable = true;
+			for(std::set<Module *>::iterator it = subtree.begin(); it != subtree.end() && skippable; ++it) {
+				int at = index[*it];
+				skippable = at >= guard.begin && at < guard.end && (*it)->canSkip();
+				edges += uses[at];
+				internal += (*it)->getInputCount();
+			}
+			if(!skippable || edges != internal + 1)
+				continue;
+
+			//and come after everything needsInput() can look at
+			for(int k = 0; k < len && skippable; ++k) {
+				if(k != n && (!consumer->isLazyInput(k) || k < n))
+					skippable = index[consumer->getInput(k)] < guard.begin;
+			}
+			if(skippable)
+				m_guards.push_back(guard);
+		}
+	}
+
+	std::sort(m_guards.begin(), m_guards.end(), outermostFirst);
+}
+
+bool Patch::outermostFirst(const Guard &a, const Guard &b) {
+	if(a.begin != b.begin)
+		return a.begin < b.begin;
+	return a.end > b.end;
+}
+
+void Patch::mapGuards(const std::vector<Module *> &modules, std::vector<Guard> &guards) {
+	guards.clear();
+
+	std::map<Module *, int> index;
+	for(int i = 0, len = modules.size(); i < len; ++i)
+		index[modules[i]] = i;
+
+	//a guard carries over if its whole run and its consumer ended up in the same list
+	for(int g = 0, len = m_guards.size(); g < len; ++g) {
+		const Guard &guard = m_guards[g];
+		if(index.find(guard.consumer) == index.end())
+			continue;
+
+		bool inside = true;
+		for(int i = guard.begin; i < guard.end && inside; ++i)
+			inside = index.find(m_schedule[i]) != index.end();
+		if(inside) {
+			int begin = index[m_schedule[guard.begin]];
+			Guard mapped = { begin, begin + guard.end - guard.begin, guard.consumer, guard.input };
+			guards.push_back(mapped);
+		}
+	}
+}
+
+void Patch::run(const std::vector<Module *> &modules, const std::vector<Guard> &guards, int nframes, Profiler *profiler) {
+	const Guard *guard = guards.empty() ? NULL : &guards[0];
+	const Guard *lastGuard = guard + guards.size();
+
+	for(int i = 0, len = modules.size(); i < len; ) {
+		//outermost first, so a skipped guard also passes over the ones inside it
+		while(guard != lastGuard && guard->begin < i)
+			++guard;
+
+		bool skipped = false;
+		for( ; guard != lastGuard && guard->begin == i; ++guard) {
+			if(!guard->consumer->needsInput(guard->input, nframes)) {
+				for(int k = i; k < guard->end; ++k)
+					modules[k]->skip(nframes);
+				i = guard->end;
+				skipped = true;
+				break;
+			}
+		}
+		if(skipped)
+			continue;
+
+		Module *m = modules[i++];
+		m->m_constant = false;
+		if(profiler != NULL) {
+			uint64_t start = ticks();
+			m->process(m->m_output, nframes);
+			profiler->addModule(typeid(*m), ticks() - start);
+		} else {
+			m->process(m->m_output, nframes);
+		}
+	}
+}
+
+//union-find root with path halving
+static int findSet(std::vector<int> &sets, int i) {
+	while(sets[i] != i) {
+		sets[i] = sets[sets[i]];
+		i = sets[i];
+	}
+	return i;
+}
+
+void Patch::partition() {
+	m_parts.clear();
+	m_partGuards.clear();
+	m_tail.clear();
+	m_tailGuards.clear();
+
+	int count = m_schedule.size();
+	if(count < 2 * PARALLEL_MIN_MODULES)
+		return;
+
+	std::map<Module *, int> index;
+	for(int i = 0; i < count; ++i)
+		index[m_schedule[i]] = i;
+
+	std::vector< std::vector<int> > inputs(count), consumers(count);
+	for(int i = 0; i < count; ++i) {
+		Module *m = m_schedule[i];
+		for(int n = 0, len = m->getInputCount(); n < len; ++n) {
+			int in = index[m->getInput(n)];
+			inputs[i].push_back(in);
+			consumers[in].push_back(i);
+		}
+	}
+
+	//the tail starts as the output module and grows downwards until the rest
+	//of the graph falls apart into pieces none of which dominates
+	std::vector<bool> inTail(count, false);
+	inTail[count - 1] = true;
+	int tailSize = 1;
+
+	std::vector<int> sets(count), sizes(count);
+	int largest = 0;
+	while(true) {
+		//connected components of everything below the tail
+		for(int i = 0; i < count; ++i) {
+			sets[i] = i;
+			sizes[i] = 0;
+		}
+		for(int i = 0; i < count; ++i) {
+			if(inTail[i])
+				continue;
+			for(int n = 0, len = inputs[i].size(); n < len; ++n)
+				sets[findSet(sets, inputs[i][n])] = findSet(sets, i);
+		}
+
+		largest = -1;
+		for(int i = 0; i < count; ++i) {
+			if(inTail[i])
+				continue;
+			int set = findSet(sets, i);
+			if(++sizes[set] > (largest < 0 ? 0 : sizes[largest]))
+				largest = set;
+		}
+
+		//a tail as big as a part would eat the gain
+		if(largest < 0 || sizes[largest] <= (count - tailSize) / 2 || tailSize >= PARALLEL_MIN_MODULES)
+			break;
+
+		//pull the top of the dominating piece into the tail
+		std::vector<int> top;
+		for(int i = 0; i < count; ++i) {
+			if(inTail[i] || findSet(sets, i) != largest)
+				continue;
+			bool fed = true;
+			for(int n = 0, len = consumers[i].size(); n < len && fed; ++n)
+				fed = inTail[consumers[i][n]];
+			if(fed)
+				top.push_back(i);
+		}
+		for(int n = 0, len = top.size(); n < len; ++n)
+			inTail[top[n]] = true;
+		tailSize += top.size();
+	}
+
+	//spread the pieces over as many parts as are worth having, biggest first onto the lightest part
+	int parts = std::min(PARALLEL_MAX_PARTS, (count - tailSize) / PARALLEL_MIN_MODULES);
+	if(parts < 2 || sizes[largest] > (count - tailSize) / 2)
+		return;
+
+	std::vector< std::pair<int, int> > pieces;
+	for(int i = 0; i < count; ++i) {
+		if(!inTail[i] && findSet(sets, i) == i)
+			pieces.push_back(std::make_pair(sizes[i], i));
+	}
+	std::sort(pieces.rbegin(), pieces.rend());
+
+	std::vector<int> load(parts, 0), partOf(count, -1);
+	for(int n = 0, len = pieces.size(); n < len; ++n) {
+		int lightest = std::min_element(load.begin(), load.end()) - load.begin();
+		load[lightest] += pieces[n].first;
+		partOf[pieces[n].second] = lightest;
+	}
+
+	//every part keeps the schedule's order, so inputs still come first
+	m_parts.resize(parts);
+	for(int i = 0; i < count; ++i) {
+		if(inTail[i])
+			m_tail.push_back(m_schedule[i]);
+		else
+			m_parts[partOf[findSet(sets, i)]].push_back(m_schedule[i]);
+	}
+
+	m_partGuards.resize(parts);
+	for(int p = 0; p < parts; ++p)
+		mapGuards(m_parts[p], m_partGuards[p]);
+	mapGuards(m_tail, m_tailGuards);
+}
+
+int Patch::lower() {
+	unlower();
+	if(m_schedule.empty())
+		return 0;
+
+	m_program = new Program(this);
+	return m_schedule.size() - m_program->getFallbackCount();
+}
+
+void Patch::unlower() {
+	delete m_program;
+	m_program = NULL;
+}
+
+void Patch::process(int nframes) {
+	if(m_program != NULL)
+		m_program->run(nframes, moduleProfiler());
+	else
+		run(m_schedule, m_guards, nframes, moduleProfiler());
+}
+
+void Patch::attachEvents() {
+	if(m_events == NULL)
+		m_events = new EventQueue();
+	attachEvents(m_events);
+}
+
+void Patch::attachEvents(EventQueue *events) {
+	for(int i = 0, len = m_schedule.size(); i < len; ++i) {
+		EventTarget *target = dynamic_cast<EventTarget *>(m_schedule[i]);
+		if(target)
+			target->m_events.store(events, std::memory_order_release);
+		//a ControlRate's subgraph is a patch of its own, its targets take this one's events
+		ControlRate *control = dynamic_cast<ControlRate *>(m_schedule[i]);
+		if(control)
+			control->m_patch->attachEvents(events);
+		//and so are a VoicePool's voices
+		VoicePool *pool = dynamic_cast<VoicePool *>(m_schedule[i]);
+		if(pool) {
+			for(int v = 0, voices = pool->m_voices.size(); v < voices; ++v) {
+				if(pool->m_voices[v].patch)
+					pool->m_voices[v].patch->attachEvents(events);
+			}
+		}
+	}
+}
+
+int Patch::applyEvents(uint64_t frame, int nframes) {
+	if(m_events == NULL)
+		return nframes;
+
+	m_events->apply(frame);
+	uint64_t next = m_events->next();
+	if(next < frame + nframes)
+		return (int)(next - frame);
+	return nframes;
+}
+
+void Patch::render(float *out, int nframes, uint64_t frame, bool clip) {
+	if(isSilent()) {
+		//controls still change, so the patch starts where they were left
+		if(m_events != NULL && nframes > 0)
+			m_events->apply(frame + nframes - 1);
+		for(int b=0; b < nframes; ++b)
+			out[b] = 0.0f;
+		return;
+	}
+
+	//render a block at a time, ending one early where an event is due
+	for(int offset=0; offset < nframes; ) {
+		int len = applyEvents(frame + offset, std::min(nframes - offset, MAX_BLOCK_SIZE));
+		process(len);
+		writeOutput(out + offset, len, clip);
+		offset += len;
+	}
+}
+
+void Patch::renderPart(int part, int nframes, bool silent) {
+	if(silent)
+		return;
+
+	if(m_program != NULL)
+		m_program->runPart(part, nframes, moduleProfiler());
+	else
+		run(m_parts[part], m_partGuards[part], nframes, moduleProfiler());
+}
+
+void Patch::renderTail(float *out, int nframes, bool silent, bool clip) {
+	if(silent) {
+		for(int b=0; b < nframes; ++b)
+			out[b] = 0.0f;
+		return;
+	}
+
+	if(m_program != NULL)
+		m_program->runTail(nframes, moduleProfiler());
+	else
+		run(m_tail, m_tailGuards, nframes, moduleProfiler());
+	writeOutput(out, nframes, clip);
+}
+
+void Patch::writeOutput(float *out, int nframes, bool clip) {
+	const sample_t *block = getOutput();
+
+	if(m_module->isConstant()) {
+		sample_t value = block[0];
+		if(clip)
+			value = std::max((sample_t)-1.0, std::min((sample_t)1.0, value));
+		for(int b=0; b < nframes; ++b)
+			out[b] = (float)value;
+		return;
+	}
+
+	//a bus clips its sum instead
+	if(!clip) {
+		for(int b=0; b < nframes; ++b)
+			out[b] = (float)block[b];
+		return;
+	}
+
+	for(int b=0; b < nframes; ++b) {
+		sample_t result = block[b];
+
+		//Clip the audio
+		if(result < -1.0f) result = -1.0f;
+		if(result > 1.0f) result = 1.0f;
+
+		//put into the stream
+		out[b] = (float)result;
+	}
+}
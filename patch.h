@@ -24,27 +24,146 @@ THE SOFTWARE.
 #define _PATCH_H_
 
 #include "Module.h"
+#include "backend.h"
+#include "events.h"
+#include "profiler.h"
 
-#include <jack/jack.h>
-#include <jack/types.h>
+#include <atomic>
+#include <map>
+#include <string>
+#include <vector>
 
 namespace waffle
 {
 
+class Program;
+class AuxInput;
+
+//smallest number of modules worth handing to another thread
+static const int PARALLEL_MIN_MODULES = 24;
+//most pieces a patch is split into
+static const int PARALLEL_MAX_PARTS = 16;
+
 class Patch
 {
 public:
-	Patch(Module *m) : m_module(m), m_jackPort(NULL), m_silent(true){}
+	//the patch owns its modules, and the arena they were made in if there is one (unless ownsArena is
+	//false, for an arena that outlives the patch)
+	Patch(Module *m, Arena *arena = NULL, bool ownsArena = true) : m_module(m), m_arena(arena), m_ownsArena(ownsArena),
+		m_port(NULL), m_silent(true), m_gain(1.0f), m_pan(0.0f), m_auxInput(NULL), m_program(NULL), m_events(NULL), m_profiler(NULL), m_traceName("patch"), m_removed(0){}
 	~Patch();
 
 	void setPlaying(bool playing);
+	bool isSilent() const { return m_silent.load(std::memory_order_relaxed); }
+
+	//simplify the module graph without changing what it renders: fold constant subtrees, merge
+	//identical subtrees, collapse Add and Mult chains. removed modules are deleted, so afterwards only
+	//Values (which are never touched) and the patch itself are safe to hold on to.
+	//returns the number of modules removed, also kept in getRemovedCount()
+	int optimize();
+	int getRemovedCount() const { return m_removed; }
+
+	//move slow modulation subgraphs (low frequency oscillators with constant frequencies, and arithmetic on
+	//them) feeding modulation inputs into ControlRate modules evaluated every period samples. Unlike
+	//optimize() this changes the output slightly. Returns the number of subgraphs moved.
+	int inferControlRate(int period);
+
+	//flatten the module graph into a schedule, inputs before consumers
+	bool compile();
+
+	//lower the compiled schedule to bytecode (see bytecode.h), which process() and the render calls run from
+	//then on. The modules' state moves into the program, so as after optimize() only Values are safe to
+	//change. Returns the number of modules that got an opcode of their own
+	int lower();
+	bool isLowered() const { return m_program != NULL; }
+
+	//run the compiled schedule for one block
+	void process(int nframes);
+	const sample_t *getOutput() const { return m_module->getOutput(); }
+
+	//render nframes of clipped output, any length, silence if not playing. frame is the absolute frame the
+	//output starts at: blocks are split at timed events so each lands on its sample, see events.h
+	void render(float *out, int nframes, uint64_t frame = 0, bool clip = true);
+
+	//independent pieces of the graph that can run concurrently, followed
+	//by the tail that merges them. No parts if the patch is too small to split.
+	//silent is isSilent() read once for the block, the same for the parts and the tail
+	int getPartCount() const { return m_parts.size(); }
+	void renderPart(int part, int nframes, bool silent);
+	void renderTail(float *out, int nframes, bool silent, bool clip = true);
 
 private:
+	//a run of a module list that only feeds one lazy input, skipped when the consumer doesn't need it
+	struct Guard {
+		int begin;
+		int end;
+		Module *consumer;
+		int input;
+	};
+
+	bool order(std::vector<Module *> &modules);
+	bool simplify(std::vector<Module *> &created);
+	Module *simplify(Module *m, std::map<Module *, int> &uses, std::vector<Module *> &created, bool &changed);
+	bool mergeCommon();
+
+	//delete a module the patch no longer uses, ones in the arena go when it does
+	void release(Module *m);
+
+	void findGuards();
+	void mapGuards(const std::vector<Module *> &modules, std::vector<Guard> &guards);
+	static bool outermostFirst(const Guard &a, const Guard &b);
+	static void run(const std::vector<Module *> &modules, const std::vector<Guard> &guards, int nframes, Profiler *profiler);
+	//the profiler when it's timing module classes
+	Profiler *moduleProfiler() const { return m_profiler && m_profiler->isProfilingModules() ? m_profiler : NULL; }
+
+	void partition();
+	void writeOutput(float *out, int nframes, bool clip);
+	void unlower();
+
+	//give the patch an event queue and point its targets at it, when it is added to a Waffle
+	void attachEvents();
+	void attachEvents(EventQueue *events);
+	//apply the events due at frame, and shorten a block starting there to end at the next one
+	int applyEvents(uint64_t frame, int nframes);
+
 	friend class Waffle;
+	friend class Program;
 	
 	Module *m_module;
-	jack_port_t *m_jackPort;
-	bool m_silent;
+	Arena *m_arena;
+	bool m_ownsArena;
+	AudioBackend::Port m_port;
+	std::atomic<bool> m_silent;
+	//where Waffle mixes the patch, see Waffle::setRoute(), and the bus gains it published last
+	std::string m_bus;
+	float m_gain;
+	float m_pan;
+	std::vector<float> m_busGains;
+	//the input of an aux bus's effect if the patch is one, and the levels the patch sends to aux buses by name,
+	//as set and as published last
+	AuxInput *m_auxInput;
+	std::map<std::string, float> m_sends;
+	std::map<std::string, float> m_sentLevels;
+
+	std::vector<Module *> m_schedule;
+	std::vector<Guard> m_guards;
+	std::vector<sample_t> m_slots;
+
+	std::vector< std::vector<Module *> > m_parts;
+	std::vector< std::vector<Guard> > m_partGuards;
+	std::vector<Module *> m_tail;
+	std::vector<Guard> m_tailGuards;
+
+	Program *m_program;
+	EventQueue *m_events;
+
+	//set by Waffle, see Waffle::getLoad()
+	Profiler *m_profiler;
+	PatchCounters m_load;
+	//the patch's name on a Trace
+	const char *m_traceName;
+
+	int m_removed;
 };
 
 }
@@ -0,0 +1,227 @@
+/*
+Copyright (c) 2009-2010 Brett Lajzer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "profiler.h"
+#include "waffle.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cxxabi.h>
+#include <map>
+
+using namespace waffle;
+
+//only the audio thread writes these, no read-modify-write needed
+template<class T>
+static inline void bump(std::atomic<T> &counter, T by) {
+	counter.store(counter.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+}
+
+Profiler::Profiler() : m_reset(false), m_modules(false), m_calibrationTicks(0), m_calibrationNanos(0) {
+	for(int i = 0; i < MAX_CLASSES; ++i)
+		m_classes[i].type = NULL;
+	clear();
+}
+
+uint64_t Profiler::nanos() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+bool Profiler::begin() {
+	if(!m_reset.load(std::memory_order_relaxed))
+		return false;
+
+	//the worker threads are idle between callbacks, nobody else is writing
+	clear();
+	m_reset.store(false);
+	return true;
+}
+
+void Profiler::clear() {
+	m_callbacks.store(0, std::memory_order_relaxed);
+	m_overruns.store(0, std::memory_order_relaxed);
+	m_busy.store(0, std::memory_order_relaxed);
+	m_period.store(0, std::memory_order_relaxed);
+	m_worst.store(0, std::memory_order_relaxed);
+	m_worstLoad.store(0.0, std::memory_order_relaxed);
+	for(int i = 0; i < BINS; ++i)
+		m_bins[i].store(0, std::memory_order_relaxed);
+	for(int i = 0; i < MAX_CLASSES; ++i) {
+		m_classes[i].ticks.store(0, std::memory_order_relaxed);
+		m_classes[i].calls.store(0, std::memory_order_relaxed);
+	}
+}
+
+void Profiler::end(uint64_t startTicks, uint64_t startNanos, int nframes) {
+	uint64_t elapsed = nanos() - startNanos;
+	uint64_t period = (uint64_t)(nframes * 1e9 / Waffle::sampleRate);
+
+	bump(m_callbacks, 1ul);
+	bump(m_busy, elapsed);
+	bump(m_period, period);
+	if(elapsed > period)
+		bump(m_overruns, 1ul);
+	if(elapsed > m_worst.load(std::memory_order_relaxed))
+		m_worst.store(elapsed, std::memory_order_relaxed);
+	double load = period > 0 ? (double)elapsed / period : 0.0;
+	if(load > m_worstLoad.load(std::memory_order_relaxed))
+		m_worstLoad.store(load, std::memory_order_relaxed);
+	bump(m_bins[bin(elapsed)], 1ul);
+
+	bump(m_calibrationTicks, ticks() - startTicks);
+	bump(m_calibrationNanos, elapsed);
+}
+
+void Profiler::fold(PatchCounters &patch) {
+	uint64_t t = patch.pending.load(std::memory_order_relaxed);
+	patch.pending.store(0, std::memory_order_relaxed);
+	bump(patch.ticks, t);
+	bump(patch.callbacks, (uint64_t)1);
+	if(t > patch.worst.load(std::memory_order_relaxed))
+		patch.worst.store(t, std::memory_order_relaxed);
+}
+
+void Profiler::reset(PatchCounters &patch) {
+	patch.pending.store(0, std::memory_order_relaxed);
+	patch.ticks.store(0, std::memory_order_relaxed);
+	patch.worst.store(0, std::memory_order_relaxed);
+	patch.callbacks.store(0, std::memory_order_relaxed);
+}
+
+void Profiler::addModule(const std::type_info &type, uint64_t t) {
+	//open addressing on the type_info's address, a class claims its slot once and keeps it
+	size_t h = (reinterpret_cast<uintptr_t>(&type) >> 4) % MAX_CLASSES;
+	for(int n = 0; n < MAX_CLASSES; ++n, h = (h + 1) % MAX_CLASSES) {
+		ClassCounters &c = m_classes[h];
+		const std::type_info *slot = c.type.load(std::memory_order_acquire);
+		if(slot == NULL) {
+			if(c.type.compare_exchange_strong(slot, &type) || slot == &type) {
+				c.ticks.fetch_add(t, std::memory_order_relaxed);
+				c.calls.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+		} else if(slot == &type) {
+			c.ticks.fetch_add(t, std::memory_order_relaxed);
+			c.calls.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+	}
+	//more classes than slots, the rest go uncounted
+}
+
+int Profiler::bin(uint64_t nanos) {
+	if(nanos < 8)
+		return (int)nanos;
+	int e = 63 - __builtin_clzll(nanos);
+	return (e - 2) * 8 + (int)((nanos >> (e - 3)) & 7);
+}
+
+double Profiler::binMiddle(int bin) {
+	if(bin < 8)
+		return bin;
+	int e = bin / 8 + 2;
+	double low = (double)(8 + bin % 8) * (double)(1ull << (e - 3));
+	return low + (double)(1ull << (e - 3)) * 0.5;
+}
+
+double Profiler::percentile(const unsigned long *bins, unsigned long count, double p) {
+	unsigned long want = (unsigned long)(p * count), seen = 0;
+	for(int i = 0; i < BINS; ++i) {
+		seen += bins[i];
+		if(seen > want)
+			return binMiddle(i) * 1e-9;
+	}
+	return 0.0;
+}
+
+double Profiler::tickSeconds() {
+	uint64_t t = m_calibrationTicks.load(std::memory_order_relaxed);
+	uint64_t n = m_calibrationNanos.load(std::memory_order_relaxed);
+	//before the first callback nothing has been counted in ticks anyway
+	return t > 0 ? (double)n / t * 1e-9 : 1e-9;
+}
+
+static std::string className(const std::type_info &type) {
+	int status = 0;
+	char *name = abi::__cxa_demangle(type.name(), NULL, NULL, &status);
+	std::string result = status == 0 && name ? name : type.name();
+	free(name);
+	if(result.compare(0, 8, "waffle::") == 0)
+		result.erase(0, 8);
+	return result;
+}
+
+void Profiler::report(LoadReport &report) {
+	report.callbacks = m_callbacks.load(std::memory_order_relaxed);
+	report.overruns = m_overruns.load(std::memory_order_relaxed);
+	uint64_t busy = m_busy.load(std::memory_order_relaxed);
+	uint64_t period = m_period.load(std::memory_order_relaxed);
+	report.load = period > 0 ? (double)busy / period : 0.0;
+	report.worstLoad = m_worstLoad.load(std::memory_order_relaxed);
+	report.average = report.callbacks > 0 ? busy * 1e-9 / report.callbacks : 0.0;
+	report.worst = m_worst.load(std::memory_order_relaxed) * 1e-9;
+
+	std::vector<unsigned long> bins(BINS);
+	unsigned long count = 0;
+	for(int i = 0; i < BINS; ++i)
+		count += bins[i] = m_bins[i].load(std::memory_order_relaxed);
+	report.p50 = percentile(&bins[0], count, 0.5);
+	report.p90 = percentile(&bins[0], count, 0.9);
+	report.p99 = percentile(&bins[0], count, 0.99);
+	report.p999 = percentile(&bins[0], count, 0.999);
+	//a bin's middle can be past the slowest callback in it
+	report.p50 = std::min(report.p50, report.worst);
+	report.p90 = std::min(report.p90, report.worst);
+	report.p99 = std::min(report.p99, report.worst);
+	report.p999 = std::min(report.p999, report.worst);
+
+	//the same class can have a type_info in more than one library, merge them by name
+	double tick = tickSeconds();
+	std::map<std::string, LoadReport::ModuleClass> classes;
+	for(int i = 0; i < MAX_CLASSES; ++i) {
+		const std::type_info *type = m_classes[i].type.load(std::memory_order_acquire);
+		unsigned long calls = m_classes[i].calls.load(std::memory_order_relaxed);
+		if(type == NULL || calls == 0)
+			continue;
+		LoadReport::ModuleClass &c = classes[className(*type)];
+		c.seconds += m_classes[i].ticks.load(std::memory_order_relaxed) * tick;
+		c.calls += calls;
+	}
+	report.classes.clear();
+	std::map<std::string, LoadReport::ModuleClass>::iterator it = classes.begin();
+	for( ; it != classes.end(); ++it) {
+		it->second.name = it->first;
+		report.classes.push_back(it->second);
+	}
+}
+
+void Profiler::report(LoadReport::Patch &patch, const PatchCounters &counters) {
+	double tick = tickSeconds();
+	uint64_t callbacks = counters.callbacks.load(std::memory_order_relaxed);
+	patch.seconds = counters.ticks.load(std::memory_order_relaxed) * tick;
+	patch.average = callbacks > 0 ? patch.seconds / callbacks : 0.0;
+	patch.worst = counters.worst.load(std::memory_order_relaxed) * tick;
+	uint64_t period = m_period.load(std::memory_order_relaxed);
+	patch.load = period > 0 ? patch.seconds / (period * 1e-9) : 0.0;
+}
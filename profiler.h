@@ -0,0 +1,167 @@
+/*
+Copyright (c) 2009-2010 Brett Lajzer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef _WAFFLE_PROFILER_H_
+#define _WAFFLE_PROFILER_H_
+
+#include <atomic>
+#include <ctime>
+#include <stdint.h>
+#include <string>
+#include <typeinfo>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace waffle {
+
+//cycle counter for timing pieces of a block: the time stamp counter on x86, the monotonic clock in
+//nanoseconds elsewhere. Only differences mean anything, the profiler converts them to seconds
+inline uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+//what a patch cost, filled in by the threads rendering it and summed up once per callback
+struct PatchCounters {
+	PatchCounters() : pending(0), ticks(0), worst(0), callbacks(0) {}
+
+	void add(uint64_t t) { pending.fetch_add(t, std::memory_order_relaxed); }
+
+	//this callback so far, from every thread working on the patch
+	std::atomic<uint64_t> pending;
+	//written by the audio thread only
+	std::atomic<uint64_t> ticks;
+	std::atomic<uint64_t> worst;
+	std::atomic<uint64_t> callbacks;
+};
+
+//! What the audio thread has been doing since the last Waffle::resetLoad(), see Waffle::getLoad().
+//! Loads are shares of the time the rendered audio lasts: 1.0 means the callback took as long as its buffer
+struct LoadReport {
+	struct Patch {
+		std::string name;
+		//CPU time spent on the patch (summed over worker threads), average and worst per callback
+		double seconds;
+		double average;
+		double worst;
+		double load;
+	};
+	struct ModuleClass {
+		std::string name;
+		double seconds;
+		unsigned long calls;
+	};
+
+	unsigned long callbacks;
+	//reported by the backend, and callbacks that took longer than their buffer lasts
+	unsigned long xruns;
+	unsigned long overruns;
+	double load;
+	double worstLoad;
+	//callback durations in seconds: average, worst and percentiles (to about 10%)
+	double average;
+	double worst;
+	double p50;
+	double p90;
+	double p99;
+	double p999;
+
+	std::vector<Patch> patches;
+	//only filled while module profiling is on, see Waffle::setModuleProfiling()
+	std::vector<ModuleClass> classes;
+};
+
+//! Callback statistics for Waffle. Everything is written by the audio thread (and the worker threads, for
+//! patches and module classes) with plain stores and fetch_adds, never a lock or a retry, and read by
+//! control threads. A reset is only requested from the control side, the audio thread carries it out
+//! at the start of its next callback.
+class Profiler {
+public:
+	Profiler();
+
+	//audio thread, around Waffle::run(). begin() returns true when the counters were just reset and
+	//the patches' ones have to be too
+	bool begin();
+	void end(uint64_t startTicks, uint64_t startNanos, int nframes);
+	//fold what the patch's renders added up this callback into its totals
+	void fold(PatchCounters &patch);
+	static void reset(PatchCounters &patch);
+
+	//any thread rendering modules
+	bool isProfilingModules() const { return m_modules.load(std::memory_order_relaxed); }
+	void addModule(const std::type_info &type, uint64_t t);
+
+	//control side
+	void requestReset() { m_reset.store(true); }
+	void setProfilingModules(bool on) { m_modules.store(on); }
+	//fills everything but the patches' names and xruns
+	void report(LoadReport &report);
+	void report(LoadReport::Patch &patch, const PatchCounters &counters);
+
+	static uint64_t nanos();
+
+private:
+	//durations to about 1/8 octave: 8 bins per power of two
+	static const int BINS = 8 * 64;
+	static int bin(uint64_t nanos);
+	static double binMiddle(int bin);
+	static double percentile(const unsigned long *bins, unsigned long count, double p);
+	void clear();
+
+	//seconds per tick, from the callbacks' durations measured both ways
+	double tickSeconds();
+
+	static const int MAX_CLASSES = 128;
+	struct ClassCounters {
+		std::atomic<const std::type_info *> type;
+		std::atomic<uint64_t> ticks;
+		std::atomic<unsigned long> calls;
+	};
+
+	std::atomic<bool> m_reset;
+	std::atomic<bool> m_modules;
+
+	std::atomic<unsigned long> m_callbacks;
+	std::atomic<unsigned long> m_overruns;
+	std::atomic<uint64_t> m_busy;
+	std::atomic<uint64_t> m_period;
+	std::atomic<uint64_t> m_worst;
+	std::atomic<double> m_worstLoad;
+	std::atomic<unsigned long> m_bins[BINS];
+
+	//never reset, for tickSeconds()
+	std::atomic<uint64_t> m_calibrationTicks;
+	std::atomic<uint64_t> m_calibrationNanos;
+
+	ClassCounters m_classes[MAX_CLASSES];
+};
+
+}
+#endif
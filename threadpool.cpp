@@ -0,0 +1,171 @@
+/*
+Copyright (c) 2009-2010 Brett Lajzer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include "threadpool.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <sched.h>
+
+using namespace waffle;
+
+ThreadPool::ThreadPool(int threads, int priority, const std::vector<int> &cpus) :
+	m_func(NULL), m_context(NULL), m_batch(0), m_remaining(0), m_quit(false) {
+	m_ranges = new Range[threads + 1];
+	for(int i = 0; i <= threads; ++i)
+		m_ranges[i].tasks = pack(0, 0, 0);
+
+	bool warned = false;
+	for(int i = 0; i < threads; ++i) {
+		Worker *w = new Worker();
+		w->pool = this;
+		w->index = i + 1;
+		sem_init(&w->wake, 0, 0);
+
+		if(pthread_create(&w->thread, NULL, ThreadPool::workerMain, w) != 0) {
+			std::cerr << "ThreadPool Error: Failed to start worker " << i << std::endl;
+			sem_destroy(&w->wake);
+			delete w;
+			break;
+		}
+		m_workers.push_back(w);
+
+		if(priority >= 0) {
+			sched_param param;
+			param.sched_priority = priority;
+			if(pthread_setschedparam(w->thread, SCHED_FIFO, &param) != 0 && !warned) {
+				std::cerr << "ThreadPool Warning: Can't make workers realtime (priority " << priority << ")" << std::endl;
+				warned = true;
+			}
+		}
+
+		if(!cpus.empty()) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpus[i % cpus.size()], &set);
+			if(pthread_setaffinity_np(w->thread, sizeof(set), &set) != 0)
+				std::cerr << "ThreadPool Warning: Can't pin worker " << i << " to cpu " << cpus[i % cpus.size()] << std::endl;
+		}
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	m_quit = true;
+	for(int i = 0, len = m_workers.size(); i < len; ++i)
+		sem_post(&m_workers[i]->wake);
+
+	for(int i = 0, len = m_workers.size(); i < len; ++i) {
+		pthread_join(m_workers[i]->thread, NULL);
+		sem_destroy(&m_workers[i]->wake);
+		delete m_workers[i];
+	}
+	delete [] m_ranges;
+}
+
+uint64_t ThreadPool::pack(unsigned batch, int next, int end) {
+	uint64_t mask = (1 << TASK_BITS) - 1;
+	return ((uint64_t)batch << (2 * TASK_BITS)) | ((uint64_t)next << TASK_BITS) | ((uint64_t)end & mask);
+}
+
+int ThreadPool::claim(Range &r, unsigned batch) {
+	uint64_t mask = (1 << TASK_BITS) - 1;
+	uint64_t tasks = r.tasks.load();
+	while(true) {
+		int next = (int)((tasks >> TASK_BITS) & mask);
+		int end = (int)(tasks & mask);
+		if((unsigned)(tasks >> (2 * TASK_BITS)) != (batch & ((1u << (64 - 2 * TASK_BITS)) - 1)) || next >= end)
+			return -1;
+		if(r.tasks.compare_exchange_weak(tasks, tasks + ((uint64_t)1 << TASK_BITS)))
+			return next;
+	}
+}
+
+void ThreadPool::run(TaskFunc func, void *context, int count) {
+	//not worth a wakeup
+	if(count < MIN_WAKE_TASKS || m_workers.empty()) {
+		for(int task = 0; task < count; ++task)
+			func(context, task);
+		return;
+	}
+
+	//only as many workers as there are tasks to share
+	int wake = std::min((int)m_workers.size(), count - 1);
+	int threads = m_workers.size() + 1;
+	unsigned batch = m_batch.load(std::memory_order_relaxed) + 1;
+
+	m_func.store(func, std::memory_order_relaxed);
+	m_context.store(context, std::memory_order_relaxed);
+	m_remaining.store(count, std::memory_order_relaxed);
+
+	//hand out contiguous ranges to the caller and the woken workers, extra tasks go to the first few
+	int begin = 0;
+	for(int i = 0; i < threads; ++i) {
+		int len = (i <= wake) ? count / (wake + 1) + (i < count % (wake + 1) ? 1 : 0) : 0;
+		m_ranges[i].tasks.store(pack(batch, begin, begin + len), std::memory_order_relaxed);
+		begin += len;
+	}
+	m_batch.store(batch, std::memory_order_release);
+
+	for(int i = 0; i < wake; ++i)
+		sem_post(&m_workers[i]->wake);
+
+	work(0, batch, func, context);
+
+	//every task is claimed by now, spin rather than sleep until the ones running elsewhere finish
+	while(m_remaining.load() > 0)
+		sched_yield();
+}
+
+void ThreadPool::work(int self, unsigned batch, TaskFunc func, void *context) {
+	int threads = m_workers.size() + 1;
+
+	//own range first, then steal from the others
+	for(int i = 0; i < threads; ++i) {
+		Range &r = m_ranges[(self + i) % threads];
+		int task;
+		while((task = claim(r, batch)) >= 0) {
+			func(context, task);
+			m_remaining.fetch_sub(1);
+		}
+	}
+}
+
+void *ThreadPool::workerMain(void *arg) {
+	Worker *w = static_cast<Worker *>(arg);
+	ThreadPool *pool = w->pool;
+	Trace::nameThread("worker");
+
+	while(true) {
+		while(sem_wait(&w->wake) != 0)
+			;
+		if(pool->m_quit.load())
+			break;
+
+		//if this batch is already over, the claims fail and it's back to sleep
+		unsigned batch = pool->m_batch.load(std::memory_order_acquire);
+		pool->work(w->index, batch, pool->m_func.load(std::memory_order_relaxed), pool->m_context.load(std::memory_order_relaxed));
+	}
+	return NULL;
+}
@@ -0,0 +1,86 @@
+/*
+Copyright (c) 2009-2010 Brett Lajzer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef _WAFFLE_THREADPOOL_H_
+#define _WAFFLE_THREADPOOL_H_
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include <pthread.h>
+#include <semaphore.h>
+
+namespace waffle {
+
+//! Worker threads that split a batch of independent tasks with the calling thread
+class ThreadPool {
+public:
+	typedef void (*TaskFunc)(void *context, int task);
+
+	//! threads extra workers, SCHED_FIFO at priority when it is >= 0, pinned round-robin to cpus when given
+	ThreadPool(int threads, int priority = -1, const std::vector<int> &cpus = std::vector<int>());
+	~ThreadPool();
+
+	//! run func(context, 0..count-1), returns once every task is done. Never blocks the caller on a lock, and
+	//! only waits for tasks a worker has actually started: the caller takes whatever the others haven't.
+	//! Fewer than MIN_WAKE_TASKS tasks run on the caller alone. count is below 2^20.
+	void run(TaskFunc func, void *context, int count);
+
+	static const int MIN_WAKE_TASKS = 2;
+
+	int getThreadCount() const { return m_workers.size(); }
+
+private:
+	//tasks [next, end) of a batch belonging to one thread, others steal from it once theirs run out. Packed with
+	//the batch into one word, so a worker that wakes after its batch is over can't claim from the next one
+	struct alignas(64) Range {
+		std::atomic<uint64_t> tasks;
+	};
+	static const int TASK_BITS = 20;
+	static uint64_t pack(unsigned batch, int next, int end);
+	//claim the next task of batch from r, -1 once there is none
+	static int claim(Range &r, unsigned batch);
+
+	struct Worker {
+		ThreadPool *pool;
+		int index;
+		pthread_t thread;
+		sem_t wake;
+	};
+
+	static void *workerMain(void *arg);
+	void work(int self, unsigned batch, TaskFunc func, void *context);
+
+	std::vector<Worker *> m_workers;
+	Range *m_ranges;	//one per worker, plus the caller's at 0
+
+	//the current batch, its number published last
+	std::atomic<TaskFunc> m_func;
+	std::atomic<void *> m_context;
+	std::atomic<unsigned> m_batch;
+	std::atomic<int> m_remaining;	//tasks not yet finished
+	std::atomic<bool> m_quit;
+};
+
+}
+#endif
@@ -0,0 +1,306 @@
+/*
+Copyright (c) 2009-2010 Brett Lajzer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "trace.h"
+#include "profiler.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <pthread.h>
+
+using namespace waffle;
+
+//events one ring holds, and how many threads running at once get one
+static const int RING_SIZE = 8192;
+static const int MAX_THREADS = 32;
+//how often the background thread empties the rings
+static const long DRAIN_INTERVAL_NS = 20000000;
+
+namespace {
+
+struct Event {
+	uint64_t time;
+	const char *name;
+	double value;
+	int thread;
+	char phase;
+	char category;
+};
+
+//single producer (the owning thread), single consumer (the drain thread). head and tail only grow. A thread
+//gives its ring back when it exits, and the next new thread takes it over
+struct Ring {
+	Event events[RING_SIZE];
+	alignas(64) std::atomic<uint64_t> head;
+	alignas(64) std::atomic<uint64_t> tail;
+	std::atomic<unsigned long> dropped;
+	std::atomic<const char *> name;
+	std::atomic<int> thread;	//id of the thread in the trace
+	std::atomic<bool> owned;
+};
+
+//gives the thread's ring back when the thread exits
+struct RingOwner {
+	Ring *ring;
+	~RingOwner();
+};
+
+}
+
+std::atomic<bool> Trace::ms_enabled(false);
+
+//allocated with the first trace and kept, threads hold on to their ring until they exit
+static Ring *s_rings = NULL;
+static std::atomic<int> s_threads(0);
+//events from threads that found every ring taken
+static std::atomic<unsigned long> s_ringless(0);
+
+static thread_local RingOwner t_owner = { NULL };
+static thread_local const char *t_name = NULL;
+
+//control side: the file, the drain thread and the interned names, guarded by s_lock
+static std::mutex s_lock;
+static FILE *s_file = NULL;
+static bool s_first = true;
+static uint64_t s_origin = 0;
+static pthread_t s_drainThread;
+static std::atomic<bool> s_draining(false);
+static std::set<std::string> *s_names = NULL;
+
+static void writeString(FILE *file, const char *s) {
+	fputc('"', file);
+	for( ; *s; ++s) {
+		if(*s == '"' || *s == '\\')
+			fputc('\\', file);
+		if((unsigned char)*s >= 0x20)
+			fputc(*s, file);
+	}
+	fputc('"', file);
+}
+
+//a thread_name metadata event, with s_file open
+static void writeName(int thread, const char *name) {
+	fprintf(s_file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", s_first ? "" : ",",
+		thread);
+	writeString(s_file, name);
+	fputs("}}", s_file);
+	s_first = false;
+}
+
+bool Trace::start(const std::string &path) {
+	stop();
+
+	std::lock_guard<std::mutex> lock(s_lock);
+	s_file = fopen(path.c_str(), "w");
+	if(!s_file) {
+		std::cerr << "Trace Error: Can't write " << path << std::endl;
+		return false;
+	}
+	fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", s_file);
+	s_first = true;
+	s_origin = Profiler::nanos();
+
+	if(!s_rings) {
+		s_rings = new Ring[MAX_THREADS];
+		for(int i = 0; i < MAX_THREADS; ++i) {
+			s_rings[i].head = 0;
+			s_rings[i].tail = 0;
+			s_rings[i].dropped = 0;
+			s_rings[i].name = NULL;
+			s_rings[i].thread = 0;
+			s_rings[i].owned = false;
+		}
+	}
+	//whatever was recorded since the last trace stopped isn't part of this one
+	for(int i = 0; i < MAX_THREADS; ++i) {
+		s_rings[i].tail.store(s_rings[i].head.load());
+		s_rings[i].dropped.store(0);
+	}
+	s_ringless.store(0);
+
+	s_draining.store(true);
+	if(pthread_create(&s_drainThread, NULL, Trace::drainMain, NULL) != 0) {
+		std::cerr << "Trace Error: Failed to start the drain thread" << std::endl;
+		s_draining.store(false);
+		fclose(s_file);
+		s_file = NULL;
+		return false;
+	}
+	ms_enabled.store(true, std::memory_order_release);
+	return true;
+}
+
+void Trace::stop() {
+	std::lock_guard<std::mutex> lock(s_lock);
+	if(!s_file)
+		return;
+
+	ms_enabled.store(false);
+	s_draining.store(false);
+	pthread_join(s_drainThread, NULL);
+	drain();
+
+	//names of the threads still running as metadata (the others named themselves on the way out), then close
+	//the array
+	unsigned long dropped = 0;
+	for(int i = 0; i < MAX_THREADS; ++i) {
+		const char *name = s_rings[i].name.load();
+		if(s_rings[i].owned.load() && name)
+			writeName(s_rings[i].thread.load(), name);
+		dropped += s_rings[i].dropped.load();
+	}
+	fputs("\n]}\n", s_file);
+	fclose(s_file);
+	s_file = NULL;
+
+	if(dropped > 0)
+		std::cerr << "Trace Warning: Dropped " << dropped << " events, the rings were full" << std::endl;
+	if(s_ringless.load() > 0)
+		std::cerr << "Trace Warning: Dropped " << s_ringless.load() << " events from threads beyond the first "
+			<< MAX_THREADS << " running at once" << std::endl;
+}
+
+const char *Trace::intern(const std::string &name) {
+	std::lock_guard<std::mutex> lock(s_lock);
+	if(!s_names)
+		s_names = new std::set<std::string>();
+	return s_names->insert(name).first->c_str();
+}
+
+void Trace::nameThread(const char *name) {
+	t_name = name;
+	if(t_owner.ring)
+		t_owner.ring->name.store(name, std::memory_order_relaxed);
+}
+
+void Trace::begin(Category category, const char *name, double value) {
+	record('B', category, name, value);
+}
+
+void Trace::end(Category category, const char *name) {
+	record('E', category, name, 0.0);
+}
+
+void Trace::instant(Category category, const char *name, double value) {
+	record('i', category, name, value);
+}
+
+static Ring *ring() {
+	if(!t_owner.ring) {
+		//the rings exist once tracing was enabled, claiming a free one is a compare and swap or a few
+		for(int i = 0; i < MAX_THREADS && !t_owner.ring; ++i) {
+			bool owned = false;
+			if(s_rings[i].owned.compare_exchange_strong(owned, true))
+				t_owner.ring = &s_rings[i];
+		}
+		if(!t_owner.ring)
+			return NULL;
+		t_owner.ring->thread.store(s_threads.fetch_add(1) + 1, std::memory_order_relaxed);
+		t_owner.ring->name.store(t_name, std::memory_order_relaxed);
+	}
+	return t_owner.ring;
+}
+
+static void push(Ring *r, char phase, char category, const char *name, double value) {
+	uint64_t head = r->head.load(std::memory_order_relaxed);
+	if(head - r->tail.load(std::memory_order_acquire) >= (uint64_t)RING_SIZE) {
+		r->dropped.store(r->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		return;
+	}
+
+	Event &e = r->events[head % RING_SIZE];
+	e.time = Profiler::nanos();
+	e.name = name;
+	e.value = value;
+	e.thread = r->thread.load(std::memory_order_relaxed);
+	e.phase = phase;
+	e.category = category;
+	r->head.store(head + 1, std::memory_order_release);
+}
+
+void Trace::record(char phase, Category category, const char *name, double value) {
+	if(!ms_enabled.load(std::memory_order_acquire))
+		return;
+	Ring *r = ring();
+	if(!r) {
+		s_ringless.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	push(r, phase, (char)category, name, value);
+}
+
+RingOwner::~RingOwner() {
+	if(!ring)
+		return;
+	//the thread's name goes in with its events, the ring may have another owner by the time the trace stops
+	const char *name = ring->name.load(std::memory_order_relaxed);
+	if(name && Trace::isEnabled())
+		push(ring, 'M', 0, name, 0.0);
+	ring->name.store(NULL, std::memory_order_relaxed);
+	ring->owned.store(false, std::memory_order_release);
+}
+
+void *Trace::drainMain(void *arg) {
+	nameThread("trace");
+	while(s_draining.load()) {
+		timespec ts = { 0, DRAIN_INTERVAL_NS };
+		nanosleep(&ts, NULL);
+		drain();
+	}
+	return NULL;
+}
+
+//called by the drain thread, and by stop() once it has finished
+void Trace::drain() {
+	static const char *categories[] = { "callback", "patch", "osc", "edit" };
+
+	for(int i = 0; i < MAX_THREADS; ++i) {
+		Ring &r = s_rings[i];
+		uint64_t tail = r.tail.load(std::memory_order_relaxed);
+		uint64_t head = r.head.load(std::memory_order_acquire);
+		for( ; tail < head; ++tail) {
+			const Event &e = r.events[tail % RING_SIZE];
+			//from before this trace started
+			if(e.time < s_origin)
+				continue;
+			if(e.phase == 'M') {
+				writeName(e.thread, e.name);
+				continue;
+			}
+			fprintf(s_file, "%s\n{\"name\":", s_first ? "" : ",");
+			writeString(s_file, e.name);
+			fprintf(s_file, ",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%d",
+				categories[(int)e.category], e.phase, (e.time - s_origin) * 1e-3, e.thread);
+			if(e.phase == 'i')
+				fputs(",\"s\":\"t\"", s_file);
+			if(e.phase != 'E')
+				fprintf(s_file, ",\"args\":{\"value\":%g}", e.value);
+			fputc('}', s_file);
+			s_first = false;
+		}
+		r.tail.store(tail, std::memory_order_release);
+	}
+	fflush(s_file);
+}
@@ -0,0 +1,87 @@
+/*
+Copyright (c) 2009-2010 Brett Lajzer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef _WAFFLE_TRACE_H_
+#define _WAFFLE_TRACE_H_
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+
+namespace waffle {
+
+//! Opt-in timeline of what the engine's threads do, written as a Chrome trace (open it in
+//! ui.perfetto.dev or chrome://tracing). Waffle records each callback and patch render, the OSC modules
+//! every message, and control threads patch edits, so audio thread stalls line up against their causes.
+//!
+//! Each thread writes into a ring of its own, preallocated when the first trace starts: recording an
+//! event is a few stores, never a lock or an allocation. A thread gives its ring back when it exits. A
+//! background thread drains the rings to the file. A ring that fills up (when the drain falls behind) drops
+//! events and counts them, as do threads beyond the number of rings.
+class Trace {
+public:
+	enum Category {
+		CALLBACK,	//Waffle::run
+		PATCH,		//a patch render, or part of one
+		OSC,		//an OSC message
+		EDIT		//adding, deleting, starting or stopping a patch
+	};
+
+	//start tracing into a new file, replacing any trace in progress. false if the file can't be written
+	static bool start(const std::string &path);
+	//stop, drain the rings and finish the file
+	static void stop();
+	static bool isEnabled() { return ms_enabled.load(std::memory_order_relaxed); }
+
+	//names must stay valid until the trace is stopped: string literals or intern()ed strings
+	static void begin(Category category, const char *name, double value = 0.0);
+	static void end(Category category, const char *name);
+	static void instant(Category category, const char *name, double value = 0.0);
+
+	//a copy of name that lives as long as the program, for names of things that may be deleted mid-trace.
+	//Allocates, so call it from a control thread, not the audio thread
+	static const char *intern(const std::string &name);
+	//label the calling thread in the trace, name must be a literal or intern()ed
+	static void nameThread(const char *name);
+
+	//records begin and end around a scope, if tracing is on when it starts
+	class Scope {
+	public:
+		Scope(Category category, const char *name, double value = 0.0) : m_category(category), m_name(name),
+			m_on(isEnabled()) { if(m_on) begin(category, name, value); }
+		~Scope() { if(m_on) end(m_category, m_name); }
+	private:
+		Category m_category;
+		const char *m_name;
+		bool m_on;
+	};
+
+private:
+	static void record(char phase, Category category, const char *name, double value);
+	static void *drainMain(void *arg);
+	static void drain();
+
+	static std::atomic<bool> ms_enabled;
+};
+
+}
+#endif
@@ -0,0 +1,244 @@
+/*
+Copyright (c) 2009-2010 Brett Lajzer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "voicepool.h"
+#include "waffle.h"
+
+#include <cmath>
+#include <set>
+
+using namespace waffle;
+
+const double VoicePool::SILENCE_LEVEL = 1e-5;
+const double VoicePool::SILENCE_HOLD = 0.1;
+
+//Voice control
+void VoiceControl::process(sample_t *out, int nframes){
+	double v = m_value;
+	for(int i = 0; i < nframes; ++i)
+		out[i] = v;
+
+	m_constant = !m_restart;
+	if(m_restart) {
+		out[0] = 0.0;
+		m_restart = false;
+	}
+}
+
+//Voice pool
+VoicePool::VoicePool(int voices, VoiceBuilder build, void *arg, StealPolicy policy, bool optimize) : Module(), m_policy(policy), m_valid(true), m_clock(0), m_active(0), m_hold(SILENCE_HOLD), m_head(0), m_tail(0) {
+	for(unsigned i = 0; i < QUEUE_SIZE; ++i)
+		m_queue[i].sequence.store(i, std::memory_order_relaxed);
+
+	m_voices.resize(voices);
+	for(int i = 0; i < voices; ++i) {
+		Voice &v = m_voices[i];
+
+		//each voice's modules go in an arena of their own, owned by its patch
+		Arena *arena = new Arena();
+		Arena::Scope scope(arena);
+		v.freq = new VoiceControl();
+		v.gate = new VoiceControl();
+		v.velocity = new VoiceControl();
+		v.patch = NULL;
+		v.state = IDLE;
+		v.note = -1;
+		v.started = 0;
+		v.level = 0.0;
+		v.silent = 0;
+
+		Module *root = build(v.freq, v.gate, v.velocity, arg);
+		std::set<Module *> used;
+		if(root != NULL) {
+			used.insert(root);
+			root->gatherSubModules(used);
+			v.patch = new Patch(root, arena);
+			//the controls are never merged or removed, so the pointers above stay good
+			if(optimize)
+				v.patch->optimize();
+		}
+
+		if(v.patch == NULL || !v.patch->compile()) {
+			std::cerr << "VoicePool: voice " << i << " failed to build" << std::endl;
+			m_valid = false;
+		}
+
+		//the voice's patch owns the controls it uses, the rest are ours
+		if(used.count(v.freq) == 0) { delete v.freq; v.freq = NULL; }
+		if(used.count(v.gate) == 0) { delete v.gate; v.gate = NULL; }
+		if(used.count(v.velocity) == 0) { delete v.velocity; v.velocity = NULL; }
+		if(v.patch == NULL)
+			delete arena;
+	}
+}
+
+VoicePool::~VoicePool(){
+	for(int i = 0, len = m_voices.size(); i < len; ++i)
+		delete m_voices[i].patch;
+}
+
+bool VoicePool::noteOn(int note, double freq, double velocity){
+	Event e = { NOTE_ON, note, freq, velocity };
+	return push(e);
+}
+
+bool VoicePool::noteOff(int note){
+	Event e = { NOTE_OFF, note, 0.0, 0.0 };
+	return push(e);
+}
+
+bool VoicePool::allNotesOff(){
+	Event e = { ALL_NOTES_OFF, -1, 0.0, 0.0 };
+	return push(e);
+}
+
+bool VoicePool::push(const Event &e){
+	unsigned pos = m_head.load(std::memory_order_relaxed);
+	for(;;) {
+		Slot &slot = m_queue[pos % QUEUE_SIZE];
+		unsigned sequence = slot.sequence.load(std::memory_order_acquire);
+		int diff = (int)(sequence - pos);
+		if(diff == 0) {
+			if(m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+				slot.event = e;
+				slot.sequence.store(pos + 1, std::memory_order_release);
+				return true;
+			}
+		} else if(diff < 0) {
+			return false;	//full
+		} else {
+			pos = m_head.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+bool VoicePool::pop(Event &e){
+	Slot &slot = m_queue[m_tail % QUEUE_SIZE];
+	if((int)(slot.sequence.load(std::memory_order_acquire) - (m_tail + 1)) < 0)
+		return false;
+
+	e = slot.event;
+	slot.sequence.store(m_tail + QUEUE_SIZE, std::memory_order_release);
+	++m_tail;
+	return true;
+}
+
+VoicePool::Voice *VoicePool::allocate(int note){
+	Voice *best = NULL;
+	for(int i = 0, len = m_voices.size(); i < len; ++i) {
+		Voice *v = &m_voices[i];
+
+		//the same note again restarts its voice, then any idle voice will do
+		if(v->note == note && v->state != IDLE)
+			return v;
+		if(v->state == IDLE) {
+			if(best == NULL || best->state != IDLE)
+				best = v;
+			continue;
+		}
+		if(best != NULL && best->state == IDLE)
+			continue;
+
+		//otherwise steal, released voices before held ones
+		if(best == NULL || (v->state == RELEASED && best->state == HELD)) {
+			best = v;
+		} else if(v->state == best->state) {
+			if(m_policy == STEAL_OLDEST ? v->started < best->started : v->level < best->level)
+				best = v;
+		}
+	}
+	return best;
+}
+
+void VoicePool::start(const Event &e){
+	//a pool with a voice that didn't build never plays, see isValid()
+	Voice *v = m_valid ? allocate(e.note) : NULL;
+	if(v == NULL)
+		return;
+
+	//a voice that is still sounding needs its gate to drop before the new note
+	if(v->gate != NULL) {
+		v->gate->m_restart = (v->state != IDLE);
+		v->gate->m_value = 1.0;
+	}
+	if(v->freq != NULL)
+		v->freq->m_value = e.freq;
+	if(v->velocity != NULL)
+		v->velocity->m_value = e.velocity;
+
+	v->state = HELD;
+	v->silent = 0;
+	v->note = e.note;
+	v->started = ++m_clock;
+}
+
+void VoicePool::release(int note){
+	for(int i = 0, len = m_voices.size(); i < len; ++i) {
+		Voice &v = m_voices[i];
+		if(v.state == HELD && (note < 0 || v.note == note)) {
+			if(v.gate != NULL)
+				v.gate->m_value = 0.0;
+			v.state = RELEASED;
+		}
+	}
+}
+
+void VoicePool::process(sample_t *out, int nframes){
+	Event e;
+	while(pop(e)) {
+		switch(e.type) {
+			case NOTE_ON: start(e); break;
+			case NOTE_OFF: release(e.note); break;
+			case ALL_NOTES_OFF: release(-1); break;
+		}
+	}
+
+	for(int i = 0; i < nframes; ++i)
+		out[i] = 0.0;
+
+	int active = 0;
+	double hold = m_hold.load(std::memory_order_relaxed) * Waffle::sampleRate;
+	for(int n = 0, len = m_voices.size(); n < len; ++n) {
+		Voice &v = m_voices[n];
+		if(v.state == IDLE)
+			continue;
+
+		v.patch->process(nframes);
+		const sample_t *voice = v.patch->getOutput();
+		sample_t level = 0.0;
+		for(int i = 0; i < nframes; ++i) {
+			out[i] += voice[i];
+			sample_t a = std::fabs(voice[i]);
+			level = (a > level) ? a : level;
+		}
+		v.level = level;
+		++active;
+
+		//a quiet block may just be a gap in the tail
+		if(v.state == RELEASED) {
+			v.silent = (level < SILENCE_LEVEL) ? v.silent + nframes : 0;
+			if(v.silent >= hold)
+				v.state = IDLE;
+		}
+	}
+	m_active.store(active, std::memory_order_relaxed);
+}
@@ -0,0 +1,154 @@
+/*
+Copyright (c) 2009-2010 Brett Lajzer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef _WAFFLE_VOICEPOOL_H_
+#define _WAFFLE_VOICEPOOL_H_
+
+#include "Module.h"
+#include "patch.h"
+
+#include <atomic>
+#include <vector>
+
+namespace waffle {
+
+//! A per-voice control signal (frequency, gate, velocity) written by the VoicePool
+class VoiceControl : public Module {
+public:
+	VoiceControl() : Module(), m_value(0.0), m_restart(false) {}
+
+	virtual void process(sample_t *out, int nframes);
+	virtual void skip(int nframes) { process(m_output, nframes); }
+	virtual bool isValid() { return true; }
+
+private:
+	friend class VoicePool;
+
+	double m_value;
+	bool m_restart;		//output one low sample first, so an envelope sees a new note
+};
+
+//! N copies of a voice patch, played by notes and mixed into one output.
+//! Voices are only rendered while they sound: from note on until they fall silent after note off.
+class VoicePool : public Module {
+public:
+	//! builds one voice from its controls, called once per voice by the constructor
+	typedef Module *(*VoiceBuilder)(Module *freq, Module *gate, Module *velocity, void *arg);
+
+	enum StealPolicy {
+		STEAL_OLDEST,	//the voice that started first
+		STEAL_QUIETEST	//the voice with the lowest level over its last block
+	};
+
+	//! level a released voice has to stay below before it stops being rendered
+	static const double SILENCE_LEVEL;
+	//! how long a released voice has to stay below SILENCE_LEVEL by default, seconds
+	static const double SILENCE_HOLD;
+
+	//! optimize runs Patch::optimize() on each voice. Off by default, like Waffle::setOptimize(): it deletes
+	//! modules the builder may have kept through arg
+	VoicePool(int voices, VoiceBuilder build, void *arg = NULL, StealPolicy policy = STEAL_QUIETEST,
+		bool optimize = false);
+	virtual ~VoicePool();
+
+	//! start or stop a note, from any thread. Notes are picked up at the start of the next block.
+	//! false if too many notes are waiting.
+	bool noteOn(int note, double freq, double velocity = 1.0);
+	bool noteOff(int note);
+	bool allNotesOff();
+
+	void setStealPolicy(StealPolicy policy) { m_policy = policy; }
+	//! how long a released voice has to stay silent before it stops being rendered. Make it longer than the
+	//! gaps in the voice's tail, between the repeats of an echo or before a slow release swells
+	void setSilenceHold(double seconds) { m_hold.store(seconds, std::memory_order_relaxed); }
+	int getVoiceCount() const { return m_voices.size(); }
+	//! voices rendered in the last block
+	int getActiveVoiceCount() const { return m_active.load(std::memory_order_relaxed); }
+
+	virtual void process(sample_t *out, int nframes);
+	virtual bool isValid() { return m_valid; }
+	//notes have to be picked up every block
+	virtual bool canSkip() { return false; }
+	virtual bool canStride() { return false; }
+
+private:
+	friend class Patch;
+
+	enum VoiceState {
+		IDLE,		//silent, not rendered
+		HELD,		//gate high
+		RELEASED	//gate low, rendered until silent
+	};
+
+	struct Voice {
+		Patch *patch;
+		VoiceControl *freq;
+		VoiceControl *gate;
+		VoiceControl *velocity;
+		VoiceState state;
+		int note;
+		unsigned long started;
+		double level;
+		int silent;		//frames below SILENCE_LEVEL since it was released
+	};
+
+	enum EventType {
+		NOTE_ON,
+		NOTE_OFF,
+		ALL_NOTES_OFF
+	};
+
+	struct Event {
+		EventType type;
+		int note;
+		double freq;
+		double velocity;
+	};
+
+	//bounded multi-producer queue, only the audio thread pops
+	static const unsigned QUEUE_SIZE = 256;
+	struct Slot {
+		std::atomic<unsigned> sequence;
+		Event event;
+	};
+
+	bool push(const Event &e);
+	bool pop(Event &e);
+
+	void start(const Event &e);
+	void release(int note);
+	Voice *allocate(int note);
+
+	std::vector<Voice> m_voices;
+	StealPolicy m_policy;
+	bool m_valid;
+	unsigned long m_clock;
+	std::atomic<int> m_active;
+	std::atomic<double> m_hold;
+
+	Slot m_queue[QUEUE_SIZE];
+	std::atomic<unsigned> m_head;
+	unsigned m_tail;
+};
+
+}
+#endif
@@ -21,159 +21,865 @@ THE SOFTWARE.
 */
 
 #include "waffle.h"
+#ifndef WAFFLE_NO_JACK
+#include "jackbackend.h"
+#endif
 
 #include <algorithm>
 #include <cmath>
 #include <ctime>
 #include <cstdlib>
 #include <iostream>
+#include <set>
+#include <sstream>
 
 using namespace waffle;
 
 float Waffle::sampleRate;
 int Waffle::bufferSize;
+std::atomic<uint64_t> Waffle::ms_frame(0);
+std::atomic<double> Waffle::ms_clockOrigin(0.0);
 
+#ifndef WAFFLE_NO_JACK
 Waffle::Waffle(const std::string &name){
+	init(new JackBackend(name));
+}
+#endif
+
+Waffle::Waffle(AudioBackend *backend){
+	init(backend);
+}
+
+void Waffle::init(AudioBackend *backend){
 	pthread_mutex_init(&m_lock, NULL);
-	
-	//connect to jack
-	jack_status_t jack_status;
-	if(!(m_jackClient = jack_client_open(name.c_str(),JackNoStartServer,&jack_status))){
-		std::cerr << "Jack Error: Failed to connect client" << std::endl;
-		exit(1);
-	}
-	
-	//register callbacks
-	jack_set_sample_rate_callback(m_jackClient, Waffle::samplerate_callback, NULL);
-	jack_set_buffer_size_callback(m_jackClient, Waffle::buffersize_callback, NULL);
-	jack_set_process_callback(m_jackClient, Waffle::process_callback, this);
+	m_backend = backend;
+	m_table = new PatchTable();
+	m_pool = NULL;
+	m_epoch = 0;
+	m_xrunBase = 0;
+	m_optimize = false;
+	m_bytecode = false;
+	m_controlPeriod = 0;
 	
 	srand(time(NULL));
 	
-	Waffle::sampleRate = (float)jack_get_sample_rate(m_jackClient);
-	Waffle::bufferSize = jack_get_buffer_size(m_jackClient);
+	Waffle::sampleRate = m_backend->getSampleRate();
+	Waffle::bufferSize = m_backend->getBufferSize();
 	
-	jack_activate(m_jackClient);
+	m_backend->activate(Waffle::process_callback, this);
 }
 
 Waffle::~Waffle(){
+	//the audio thread is gone after this, everything can be freed directly
+	m_backend->deactivate();
+
 	pthread_mutex_lock(&m_lock);
+	for(int i = 0, len = m_retired.size(); i < len; ++i)
+		release(m_retired[i]);
+	m_retired.clear();
+
 	std::map<std::string, Patch *>::iterator it = m_patches.begin();
 	std::map<std::string, Patch *>::iterator end_cached = m_patches.end();
 	for(; it != end_cached; ++it) {
-		jack_port_unregister(m_jackClient, it->second->m_jackPort);
+		if(it->second->m_port)
+			m_backend->unregisterPort(it->second->m_port);
 		delete it->second;
 	}
 	m_patches.clear();
+
+	std::map<std::string, Bus *>::iterator bus = m_buses.begin();
+	for(; bus != m_buses.end(); ++bus) {
+		for(int c = 0, len = bus->second->ports.size(); c < len; ++c)
+			m_backend->unregisterPort(bus->second->ports[c]);
+		delete bus->second;
+	}
+	m_buses.clear();
+	delete m_table.load();
+	delete m_pool.load();
 	pthread_mutex_unlock(&m_lock);
 		
 	pthread_mutex_destroy(&m_lock);
 
-	jack_client_close(m_jackClient);
+	delete m_backend;
 }
 
-void Waffle::addPatch(const std::string &name, Patch *p){
-	std::map<std::string, Patch *>::iterator it = m_patches.find(name);
-	if(it == m_patches.end()) {
-		//register an output port
-		if(!(p->m_jackPort = jack_port_register(m_jackClient,name.c_str(),JACK_DEFAULT_AUDIO_TYPE,JackPortIsOutput,0))){
-			std::cerr << "Jack Error: Failed to register port: " << name << std::endl;
-			exit(1);
+//a patch edit on the trace, if one is running
+static void traceEdit(const char *what, const std::string &name) {
+	if(Trace::isEnabled())
+		Trace::instant(Trace::EDIT, Trace::intern(std::string(what) + " " + name));
+}
+
+bool Waffle::addPatch(const std::string &name, Patch *p, const std::string &bus, float gain, float pan){
+	traceEdit("add", name);
+
+	//a patch the audio thread may be rendering can't be rebuilt, nor replace itself
+	std::string added;
+	bool live = false;
+	pthread_mutex_lock(&m_lock);
+	for(std::map<std::string, Patch *>::iterator it = m_patches.begin(); it != m_patches.end() && !live; ++it) {
+		if(it->second == p) {
+			added = it->first;
+			live = true;
 		}
+	}
+	pthread_mutex_unlock(&m_lock);
+	if(live) {
+		if(added == name)
+			return true;
+		std::cerr << "Patch is already added as \"" << added << "\", not adding it as \"" << name << "\"." << std::endl;
+		return false;
+	}
 
+	if(m_optimize)
+		p->optimize();
+	if(m_controlPeriod > 0)
+		p->inferControlRate(m_controlPeriod);
+	if(!p->compile()) {
+		std::cerr << "Failed to compile patch \"" << name << "\", not adding." << std::endl;
+		return false;
+	}
+	if(m_bytecode)
+		p->lower();
+	p->attachEvents();
+	p->m_profiler = &m_profiler;
+	//interned names live for good, so only while there's a trace to name them in
+	if(Trace::isEnabled())
+		p->m_traceName = Trace::intern(name);
+
+	pthread_mutex_lock(&m_lock);
+	std::map<std::string, Patch *>::iterator it = m_patches.find(name);
+	if(it == m_patches.end()) {
+		route(name, p, NULL, bus, gain, pan);
 		m_patches[name] = p;
+		publish();
 	} else {
 		std::cerr << "Patch already exists for name \"" << name << "\", replacing." << std::endl;
+		//the new patch takes over the old one's port if it wants one
+		Patch *old = it->second;
+		if(old == p) {
+			pthread_mutex_unlock(&m_lock);
+			return true;
+		}
+		AudioBackend::Port unused = route(name, p, old->m_port, bus, gain, pan);
+		//sends go by name, so they carry over, unless the patch turns into an aux bus or out of one
+		if(p->m_auxInput == NULL) {
+			p->m_sends = old->m_sends;
+			p->m_sentLevels = old->m_sentLevels;
+		} else if(!old->m_sends.empty()) {
+			std::cerr << "Aux bus \"" << name << "\" can't send to another, dropping its sends." << std::endl;
+		}
+		if(old->m_auxInput != NULL && p->m_auxInput == NULL)
+			dropSends(name);
 		it->second = p;
+		publish();
+		retire(NULL, old, unused);
 	}
+	reclaim();
+	pthread_mutex_unlock(&m_lock);
+	return true;
+}
+
+void Waffle::dropSends(const std::string &aux){
+	for(std::map<std::string, Patch *>::iterator it = m_patches.begin(); it != m_patches.end(); ++it)
+		it->second->m_sends.erase(aux);
 }
 
 bool Waffle::deletePatch(const std::string &name){
+	bool found = false;
+	traceEdit("delete", name);
+
+	pthread_mutex_lock(&m_lock);
 	std::map<std::string, Patch *>::iterator it = m_patches.find(name);
 	if(it != m_patches.end()){
-		jack_port_unregister(m_jackClient, it->second->m_jackPort);
-		delete it->second;
+		Patch *old = it->second;
 		m_patches.erase(it);
-		return true;
-	}else{
+		if(old->m_auxInput != NULL)
+			dropSends(name);
+		publish();
+		retire(NULL, old, old->m_port);
+		found = true;
+	}
+	reclaim();
+	pthread_mutex_unlock(&m_lock);
+
+	return found;
+}
+
+
+bool Waffle::setRoute(const std::string &name, const std::string &bus, float gain, float pan){
+	bool found = false;
+	traceEdit("route", name);
+
+	pthread_mutex_lock(&m_lock);
+	std::map<std::string, Patch *>::iterator it = m_patches.find(name);
+	if(it != m_patches.end()) {
+		if(bus.empty() || m_buses.find(bus) != m_buses.end()) {
+			Patch *p = it->second;
+			AudioBackend::Port unused = route(name, p, p->m_port, bus, gain, pan);
+			publish();
+			if(unused)
+				retire(NULL, NULL, unused);
+			found = true;
+		} else {
+			std::cerr << "No bus named \"" << bus << "\", not moving patch \"" << name << "\"." << std::endl;
+		}
+	}
+	reclaim();
+	pthread_mutex_unlock(&m_lock);
+
+	return found;
+}
+
+AudioBackend::Port Waffle::route(const std::string &name, Patch *p, AudioBackend::Port port, const std::string &bus, float gain, float pan){
+	std::string target = bus;
+	if(!target.empty() && m_buses.find(target) == m_buses.end()) {
+		std::cerr << "No bus named \"" << target << "\", patch \"" << name << "\" gets its own port." << std::endl;
+		target.clear();
+	}
+
+	//gains only ramp within a bus
+	if(target != p->m_bus)
+		p->m_busGains.clear();
+	p->m_bus = target;
+	p->m_gain = gain;
+	p->m_pan = pan;
+
+	if(target.empty()) {
+		p->m_port = port ? port : m_backend->registerPort(name);
+		return NULL;
+	}
+	p->m_port = NULL;
+	return port;
+}
+
+bool Waffle::addBus(const std::string &name, int channels){
+	if(channels < 1) {
+		std::cerr << "Bus \"" << name << "\" needs at least one channel, not adding." << std::endl;
+		return false;
+	}
+	traceEdit("add bus", name);
+
+	pthread_mutex_lock(&m_lock);
+	if(m_buses.find(name) != m_buses.end()) {
+		std::cerr << "Bus already exists for name \"" << name << "\", not adding." << std::endl;
+		pthread_mutex_unlock(&m_lock);
 		return false;
 	}
+
+	Bus *bus = new Bus();
+	for(int c = 0; c < channels; ++c) {
+		std::stringstream port;
+		port << name;
+		if(channels == 2)
+			port << (c == 0 ? "_L" : "_R");
+		else if(channels > 2)
+			port << "_" << c + 1;
+		bus->ports.push_back(m_backend->registerPort(port.str()));
+	}
+	bus->buffers.resize(channels, NULL);
+	m_buses[name] = bus;
+	publish();
+	reclaim();
+	pthread_mutex_unlock(&m_lock);
+
+	return true;
 }
 
+bool Waffle::deleteBus(const std::string &name){
+	bool deleted = false;
+	traceEdit("delete bus", name);
+
+	pthread_mutex_lock(&m_lock);
+	std::map<std::string, Bus *>::iterator it = m_buses.find(name);
+	if(it != m_buses.end()) {
+		bool used = false;
+		std::map<std::string, Patch *>::iterator patch = m_patches.begin();
+		for( ; patch != m_patches.end(); ++patch)
+			used = used || patch->second->m_bus == name;
+
+		if(used) {
+			std::cerr << "Bus \"" << name << "\" still has patches routed to it, not deleting." << std::endl;
+		} else {
+			Bus *bus = it->second;
+			m_buses.erase(it);
+			publish();
+
+			Retired r;
+			r.epoch = m_epoch.load();
+			r.table = NULL;
+			r.patch = NULL;
+			r.port = NULL;
+			r.pool = NULL;
+			r.bus = bus;
+			m_retired.push_back(r);
+			deleted = true;
+		}
+	}
+	reclaim();
+	pthread_mutex_unlock(&m_lock);
+
+	return deleted;
+}
+
+//free a module graph that never made it into a patch
+static void deleteGraph(Module *root) {
+	std::set<Module *> modules;
+	modules.insert(root);
+	root->gatherSubModules(modules);
+	for(std::set<Module *>::iterator it = modules.begin(); it != modules.end(); ++it)
+		delete *it;
+}
+
+bool Waffle::addAux(const std::string &name, EffectBuilder build, void *arg, const std::string &bus, float gain, float pan){
+	AuxInput *input = new AuxInput();
+	Module *effect = build(input, arg);
+
+	std::set<Module *> modules;
+	if(effect != NULL) {
+		modules.insert(effect);
+		effect->gatherSubModules(modules);
+	}
+	if(modules.find(input) == modules.end()) {
+		std::cerr << "Effect for aux \"" << name << "\" doesn't use its input, not adding." << std::endl;
+		delete input;
+		if(effect != NULL)
+			deleteGraph(effect);
+		return false;
+	}
+
+	Patch *p = new Patch(effect);
+	p->m_auxInput = input;
+	if(!addPatch(name, p, bus, gain, pan)) {
+		//the patch owns input along with the rest of the effect
+		delete p;
+		return false;
+	}
+	start(name);
+	return true;
+}
+
+bool Waffle::setSend(const std::string &patch, const std::string &aux, float level){
+	bool sent = false;
+	traceEdit("send", patch + " to " + aux);
+
+	pthread_mutex_lock(&m_lock);
+	std::map<std::string, Patch *>::iterator from = m_patches.find(patch);
+	std::map<std::string, Patch *>::iterator to = m_patches.find(aux);
+	if(from == m_patches.end()) {
+		std::cerr << "No patch named \"" << patch << "\", not sending." << std::endl;
+	} else if(to == m_patches.end() || to->second->m_auxInput == NULL) {
+		std::cerr << "No aux bus named \"" << aux << "\", not sending." << std::endl;
+	} else if(from->second->m_auxInput != NULL) {
+		std::cerr << "Aux bus \"" << patch << "\" can't send to another, not sending." << std::endl;
+	} else {
+		if(level == 0.0f)
+			from->second->m_sends.erase(aux);
+		else
+			from->second->m_sends[aux] = level;
+		publish();
+		sent = true;
+	}
+	reclaim();
+	pthread_mutex_unlock(&m_lock);
+
+	return sent;
+}
 
 std::map< std::string, bool > Waffle::validatePatches() {
 	std::map< std::string, bool > results;
 	
+	pthread_mutex_lock(&m_lock);
 	std::map<std::string, Patch *>::iterator it = m_patches.begin();
 	for( ; it != m_patches.end(); ++it)
 		results[it->first] = it->second->m_module->isValid();
+	pthread_mutex_unlock(&m_lock);
 
 	return results;
 }
 
-double Waffle::midiToFreq(int note){
-	return 8.1758 * pow(2.0, (double)note/12.0);
+//a patch's gain on each channel of a bus: equal power between the two channels nearest pan
+static void panGains(int channels, float gain, float pan, std::vector<float> &gains) {
+	gains.assign(channels, 0.0f);
+	if(channels == 1) {
+		gains[0] = gain;
+		return;
+	}
+
+	double position = (std::max(-1.0f, std::min(1.0f, pan)) + 1.0) * 0.5 * (channels - 1);
+	int first = std::min((int)position, channels - 2);
+	double angle = (position - first) * M_PI * 0.5;
+	gains[first] = (float)(gain * cos(angle));
+	gains[first + 1] = (float)(gain * sin(angle));
 }
 
-//callbacks
-int Waffle::samplerate_callback(jack_nframes_t nframes, void *arg){
-	Waffle::sampleRate = (double)nframes;
-	return 0;
+void Waffle::publish(){
+	PatchTable *table = new PatchTable();
+	table->patches.reserve(m_patches.size());
+
+	//aux buses go last, they render after the others
+	std::map<std::string, int> auxes;
+	std::map<std::string, Patch *>::iterator it = m_patches.begin();
+	for( ; it != m_patches.end(); ++it)
+		if(it->second->m_auxInput == NULL)
+			table->patches.push_back(it->second);
+	table->firstAux = table->patches.size();
+	for(it = m_patches.begin(); it != m_patches.end(); ++it) {
+		if(it->second->m_auxInput != NULL) {
+			auxes[it->first] = table->patches.size() - table->firstAux;
+			table->patches.push_back(it->second);
+		}
+	}
+	table->buffers.resize(table->patches.size(), NULL);
+	table->ports.resize(table->patches.size(), NULL);
+
+	//buses in name order, and a mix slot for each patch on one
+	std::map<std::string, int> buses;
+	std::map<std::string, Bus *>::iterator bus = m_buses.begin();
+	for( ; bus != m_buses.end(); ++bus) {
+		buses[bus->first] = table->buses.size();
+		table->buses.push_back(bus->second);
+	}
+
+	int slots = 0;
+	table->routes.resize(table->patches.size());
+	for(int i = 0, len = table->patches.size(); i < len; ++i) {
+		Patch *p = table->patches[i];
+		PatchTable::Route &route = table->routes[i];
+		route.port = p->m_port;
+		route.bus = -1;
+		route.slot = -1;
+		if(p->m_bus.empty())
+			continue;
+
+		route.bus = buses[p->m_bus];
+		route.slot = slots++;
+		panGains(table->buses[route.bus]->ports.size(), p->m_gain, p->m_pan, route.to);
+		route.from = p->m_busGains.size() == route.to.size() ? p->m_busGains : route.to;
+		p->m_busGains = route.to;
+	}
+	table->mixFrames = std::max(bufferSize, MAX_BLOCK_SIZE);
+	table->auxIn.resize(auxes.size() * table->mixFrames);
+	table->ramped = false;
+
+	//sends ramp up from nothing when they start, and down to nothing once when they stop
+	table->sends.resize(table->firstAux);
+	for(int i = 0; i < table->firstAux; ++i) {
+		Patch *p = table->patches[i];
+		std::map<std::string, float> levels = p->m_sentLevels;
+		for(std::map<std::string, float>::iterator level = levels.begin(); level != levels.end(); ++level)
+			level->second = 0.0f;
+		for(std::map<std::string, float>::iterator level = p->m_sends.begin(); level != p->m_sends.end(); ++level)
+			levels[level->first] = level->second;
+
+		for(std::map<std::string, float>::iterator level = levels.begin(); level != levels.end(); ++level) {
+			std::map<std::string, int>::iterator aux = auxes.find(level->first);
+			if(aux == auxes.end())
+				continue;
+			PatchTable::Send send;
+			send.aux = aux->second;
+			send.from = p->m_sentLevels.count(level->first) ? p->m_sentLevels[level->first] : 0.0f;
+			send.to = level->second;
+			if(send.from != 0.0f || send.to != 0.0f)
+				table->sends[i].push_back(send);
+		}
+		//only what reached an aux, a send to one added later ramps up too
+		p->m_sentLevels.clear();
+		for(std::map<std::string, float>::iterator level = levels.begin(); level != levels.end(); ++level)
+			if(level->second != 0.0f && auxes.count(level->first))
+				p->m_sentLevels[level->first] = level->second;
+
+		//sends are taken before the clip, so a patch on its own port that sends renders into a slot too and
+		//is clipped on the way to its port
+		if(table->routes[i].bus < 0 && !table->sends[i].empty())
+			table->routes[i].slot = slots++;
+	}
+	table->mix.resize(slots * table->mixFrames);
+
+	for(int i = 0; i < table->firstAux; ++i) {
+		int parts = table->patches[i]->getPartCount();
+		PatchTable::Task task;
+		task.patch = i;
+		task.part = -1;
+		if(parts == 0) {
+			table->tasks.push_back(task);
+		} else {
+			for(task.part = 0; task.part < parts; ++task.part)
+				table->tasks.push_back(task);
+			table->split.push_back(i);
+		}
+	}
+	table->silent.resize(table->patches.size(), 0);
+
+	//the audio thread picks this up at its next block
+	retire(m_table.exchange(table), NULL, NULL);
 }
 
-int Waffle::buffersize_callback(jack_nframes_t nframes, void *arg){
-	Waffle::bufferSize = nframes;
-	return 0;
+void Waffle::retire(PatchTable *table, Patch *patch, AudioBackend::Port port){
+	Retired r;
+	r.epoch = m_epoch.load();
+	r.table = table;
+	r.patch = patch;
+	r.port = port;
+	r.pool = NULL;
+	r.bus = NULL;
+	m_retired.push_back(r);
 }
 
-int Waffle::process_callback(jack_nframes_t nframes, void *arg){
+void Waffle::reclaim(){
+	unsigned long epoch = m_epoch.load();
+
+	std::vector<Retired>::iterator it = m_retired.begin();
+	while(it != m_retired.end()) {
+		//retired outside run() (even epoch) or run() has returned since
+		if(it->epoch % 2 == 0 || epoch > it->epoch) {
+			release(*it);
+			it = m_retired.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
+void Waffle::release(Retired &r){
+	if(r.port)
+		m_backend->unregisterPort(r.port);
+	if(r.bus) {
+		for(int c = 0, len = r.bus->ports.size(); c < len; ++c)
+			m_backend->unregisterPort(r.bus->ports[c]);
+	}
+	delete r.patch;
+	delete r.table;
+	delete r.pool;
+	delete r.bus;
+}
+
+double Waffle::midiToFreq(int note){
+	return 8.1758 * pow(2.0, (double)note/12.0);
+}
+
+//callbacks
+void Waffle::process_callback(int nframes, void *arg){
 	static_cast<Waffle *>(arg)->run(nframes);
-	return 0;
 }
 
 void Waffle::start(const std::string &name){
+	traceEdit("start", name);
+	pthread_mutex_lock(&m_lock);
 	std::map<std::string, Patch *>::iterator it = m_patches.find(name);
 	if(it != m_patches.end()){
 		it->second->setPlaying(true);
 	}
+	reclaim();
+	pthread_mutex_unlock(&m_lock);
 }
 
 void Waffle::stop(const std::string &name){
+	traceEdit("stop", name);
+	pthread_mutex_lock(&m_lock);
 	std::map<std::string, Patch *>::iterator it = m_patches.find(name);
 	if(it != m_patches.end()){
 		it->second->setPlaying(false);
 	}
+	reclaim();
+	pthread_mutex_unlock(&m_lock);
 }
 
-void Waffle::run(jack_nframes_t nframes){
+void Waffle::setWorkerThreads(int count, const std::vector<int> &cpus){
+	ThreadPool *pool = NULL;
+	if(count > 0)
+		pool = new ThreadPool(count, m_backend->getRealtimePriority(), cpus);
+
 	pthread_mutex_lock(&m_lock);
-	
+	Retired r;
+	r.epoch = m_epoch.load();
+	r.table = NULL;
+	r.patch = NULL;
+	r.port = NULL;
+	r.pool = m_pool.exchange(pool);
+	r.bus = NULL;
+	m_retired.push_back(r);
+	reclaim();
+	pthread_mutex_unlock(&m_lock);
+}
+
+void Waffle::renderTask(void *context, int task){
+	RenderJob *job = static_cast<RenderJob *>(context);
+	int patch = job->first + task;
+	Patch *p = job->table->patches[patch];
+	Trace::Scope trace(Trace::PATCH, p->m_traceName, job->nframes);
+	uint64_t start = ticks();
+	p->render(job->table->buffers[patch], job->nframes, job->frame, job->table->routes[patch].slot < 0);
+	p->m_load.add(ticks() - start);
+}
+
+void Waffle::renderPartTask(void *context, int task){
+	RenderJob *job = static_cast<RenderJob *>(context);
+	PatchTable::Task &t = job->table->tasks[task];
+	Patch *p = job->table->patches[t.patch];
+
+	Trace::Scope trace(Trace::PATCH, p->m_traceName, job->nframes);
+	uint64_t start = ticks();
+	if(t.part < 0)
+		p->render(job->table->buffers[t.patch] + job->offset, job->nframes, job->frame + job->offset, job->table->routes[t.patch].slot < 0);
+	else
+		p->renderPart(t.part, job->nframes, job->table->silent[t.patch]);
+	p->m_load.add(ticks() - start);
+}
+
+void Waffle::renderTailTask(void *context, int task){
+	RenderJob *job = static_cast<RenderJob *>(context);
+	int patch = job->table->split[task];
+	Patch *p = job->table->patches[patch];
+	Trace::Scope trace(Trace::PATCH, p->m_traceName, job->nframes);
+	uint64_t start = ticks();
+	p->renderTail(job->table->buffers[patch] + job->offset, job->nframes, job->table->silent[patch],
+		job->table->routes[patch].slot < 0);
+	p->m_load.add(ticks() - start);
+}
+
+//most expensive first
+static bool costlier(const LoadReport::Patch &a, const LoadReport::Patch &b) {
+	return a.seconds > b.seconds;
+}
+
+void Waffle::getLoad(LoadReport &report){
+	pthread_mutex_lock(&m_lock);
+	m_profiler.report(report);
+	report.xruns = m_backend->getXrunCount() - m_xrunBase;
+
+	report.patches.clear();
 	std::map<std::string, Patch *>::iterator it = m_patches.begin();
-	std::map<std::string, Patch *>::iterator end_cached = m_patches.end();
-	for(; it != end_cached; ++it) {
-		//get jack output port buffer
-		jack_default_audio_sample_t *out;
-		out = (jack_default_audio_sample_t *)jack_port_get_buffer(it->second->m_jackPort, nframes);
-
-		Module *m = it->second->m_module;
-		bool silent = it->second->m_silent;
-		for(int b=0; b < nframes; ++b){
-			double result = 0.0; 
-			if(!silent){
-				result = m->getValue();
-		
-				//Clip the audio
-				if(result < -1.0f) result = -1.0f;
-				if(result > 1.0f) result = 1.0f;
+	for( ; it != m_patches.end(); ++it) {
+		LoadReport::Patch patch;
+		patch.name = it->first;
+		m_profiler.report(patch, it->second->m_load);
+		report.patches.push_back(patch);
+	}
+	std::sort(report.patches.begin(), report.patches.end(), costlier);
+	pthread_mutex_unlock(&m_lock);
+}
+
+void Waffle::resetLoad(){
+	pthread_mutex_lock(&m_lock);
+	m_xrunBase = m_backend->getXrunCount();
+	m_profiler.requestReset();
+	pthread_mutex_unlock(&m_lock);
+}
+
+void Waffle::run(int nframes){
+	uint64_t startTicks = ticks();
+	uint64_t startNanos = Profiler::nanos();
+	if(Trace::isEnabled())
+		Trace::nameThread("audio");
+	Trace::Scope trace(Trace::CALLBACK, "process", nframes);
+
+	//odd while we're in here, see reclaim()
+	m_epoch.fetch_add(1);
+	PatchTable *table = m_table.load();
+	int count = table->patches.size();
+
+	if(m_profiler.begin()) {
+		for(int i = 0; i < count; ++i)
+			Profiler::reset(table->patches[i]->m_load);
+	}
+
+	//fetch the port buffers here, each patch then only touches its own
+	for(int i = 0; i < count; ++i) {
+		AudioBackend::Port port = table->routes[i].port;
+		table->ports[i] = port ? m_backend->getPortBuffer(port, nframes) : NULL;
+	}
+	for(int b = 0, len = table->buses.size(); b < len; ++b) {
+		Bus *bus = table->buses[b];
+		for(int c = 0, channels = bus->ports.size(); c < channels; ++c)
+			bus->buffers[c] = m_backend->getPortBuffer(bus->ports[c], nframes);
+	}
+
+	uint64_t frame = ms_frame.load(std::memory_order_relaxed);
+	syncClock(frame);
+	EventQueue::startCallback();
+
+	//patches on buses and aux inputs use slots of table->mixFrames, a longer callback goes in pieces
+	int piece = table->mix.empty() && table->auxIn.empty() ? nframes : table->mixFrames;
+	for(int offset = 0; offset < nframes; offset += piece) {
+		int len = std::min(piece, nframes - offset);
+		for(int i = 0; i < count; ++i) {
+			PatchTable::Route &route = table->routes[i];
+			table->buffers[i] = route.slot < 0 ? table->ports[i] + offset : &table->mix[route.slot * table->mixFrames];
+		}
+		render(table, frame + offset, len);
+		send(table, frame, offset, len, nframes);
+		mix(table, offset, len, nframes);
+	}
+	table->ramped = true;
+
+	for(int i = 0; i < count; ++i)
+		m_profiler.fold(table->patches[i]->m_load);
+	m_profiler.end(startTicks, startNanos, nframes);
+
+	ms_frame.store(frame + nframes, std::memory_order_release);
+	m_epoch.fetch_add(1);
+}
+
+void Waffle::render(PatchTable *table, uint64_t frame, int nframes){
+	RenderJob job;
+	job.table = table;
+	job.frame = frame;
+	job.first = 0;
+	job.offset = 0;
+	job.nframes = nframes;
+
+	//aux buses wait for send()
+	int count = table->firstAux;
+	ThreadPool *pool = m_pool.load();
+	if(pool && !table->split.empty()) {
+		//big patches run their parts alongside everything else, then their tails, a block at a time
+		for(int offset=0; offset < nframes; offset += job.nframes) {
+			job.offset = offset;
+			job.nframes = std::min(nframes - offset, MAX_BLOCK_SIZE);
+			//split patches go in lockstep, an event in any of them ends the block for all. A start() or stop()
+			//landing between the two passes waits for the next block
+			for(int i = 0, len = table->split.size(); i < len; ++i) {
+				Patch *p = table->patches[table->split[i]];
+				job.nframes = p->applyEvents(frame + offset, job.nframes);
+				table->silent[table->split[i]] = p->isSilent();
 			}
-			//put into the stream
-			out[b] = (jack_default_audio_sample_t)result;
+			pool->run(Waffle::renderPartTask, &job, table->tasks.size());
+			pool->run(Waffle::renderTailTask, &job, table->split.size());
+		}
+	} else if(pool && count > 1) {
+		pool->run(Waffle::renderTask, &job, count);
+	} else {
+		for(int i = 0; i < count; ++i)
+			renderTask(&job, i);
+	}
+}
+
+//a gain at offset into a callback of total frames and its change per sample: the first callback with a new
+//table ramps from the gain before it
+static float ramp(float from, float to, bool ramped, int offset, int total, float &step) {
+	step = 0.0f;
+	if(ramped || from == to)
+		return to;
+	step = (to - from) / total;
+	return from + step * offset;
+}
+
+//out += in * gain, the gain moving by step every sample. Plain loops, the compiler vectorizes them
+static void mixInto(float *__restrict out, const float *__restrict in, float gain, float step, int nframes) {
+	if(step == 0.0f) {
+		for(int i = 0; i < nframes; ++i)
+			out[i] += in[i] * gain;
+	} else {
+		for(int i = 0; i < nframes; ++i)
+			out[i] += in[i] * (gain + step * i);
+	}
+}
 
-			//reset patch
-			m->reset();
+void Waffle::send(PatchTable *table, uint64_t frame, int offset, int nframes, int total){
+	int count = table->patches.size();
+	if(table->firstAux == count)
+		return;
+
+	for(int a = 0, len = count - table->firstAux; a < len; ++a) {
+		float *in = &table->auxIn[a * table->mixFrames];
+		for(int i = 0; i < nframes; ++i)
+			in[i] = 0.0f;
+	}
+
+	for(int i = 0; i < table->firstAux; ++i) {
+		if(table->patches[i]->isSilent())
+			continue;
+		for(int s = 0, len = table->sends[i].size(); s < len; ++s) {
+			PatchTable::Send &send = table->sends[i][s];
+			float step;
+			float level = ramp(send.from, send.to, table->ramped, offset, total, step);
+			mixInto(&table->auxIn[send.aux * table->mixFrames], table->buffers[i], level, step, nframes);
+		}
+	}
+
+	//then the effects, each once on its sum
+	for(int i = table->firstAux; i < count; ++i)
+		table->patches[i]->m_auxInput->m_in = &table->auxIn[(i - table->firstAux) * table->mixFrames];
+
+	RenderJob job;
+	job.table = table;
+	job.frame = frame + offset;
+	job.first = table->firstAux;
+	job.offset = 0;
+	job.nframes = nframes;
+
+	ThreadPool *pool = m_pool.load();
+	if(pool && count - table->firstAux > 1) {
+		pool->run(Waffle::renderTask, &job, count - table->firstAux);
+	} else {
+		for(int task = 0; task < count - table->firstAux; ++task)
+			renderTask(&job, task);
+	}
+}
+
+void Waffle::mix(PatchTable *table, int offset, int nframes, int total){
+	int buses = table->buses.size();
+	for(int b = 0; b < buses; ++b) {
+		Bus *bus = table->buses[b];
+		for(int c = 0, channels = bus->buffers.size(); c < channels; ++c) {
+			float *out = bus->buffers[c] + offset;
+			for(int i = 0; i < nframes; ++i)
+				out[i] = 0.0f;
+		}
+	}
+
+	for(int i = 0, len = table->patches.size(); i < len; ++i) {
+		PatchTable::Route &route = table->routes[i];
+		//a patch on its own port that rendered into a slot for its sends, silent or not
+		if(route.bus < 0 && route.slot >= 0) {
+			float *out = table->ports[i] + offset;
+			const float *in = table->buffers[i];
+			for(int b = 0; b < nframes; ++b)
+				out[b] = std::max(-1.0f, std::min(1.0f, in[b]));
+			continue;
+		}
+		if(route.bus < 0 || table->patches[i]->isSilent())
+			continue;
+
+		Bus *bus = table->buses[route.bus];
+		for(int c = 0, channels = route.to.size(); c < channels; ++c) {
+			float step;
+			float gain = ramp(route.from[c], route.to[c], table->ramped, offset, total, step);
+			if(gain == 0.0f && step == 0.0f)
+				continue;
+			mixInto(bus->buffers[c] + offset, table->buffers[i], gain, step, nframes);
+		}
+	}
+
+	//the hard clip, once per bus channel instead of once per patch
+	for(int b = 0; b < buses; ++b) {
+		Bus *bus = table->buses[b];
+		for(int c = 0, channels = bus->buffers.size(); c < channels; ++c) {
+			float *out = bus->buffers[c] + offset;
+			for(int i = 0; i < nframes; ++i)
+				out[i] = std::max(-1.0f, std::min(1.0f, out[i]));
 		}
 	}
-	pthread_mutex_unlock(&m_lock);
 }
 
+void Waffle::syncClock(uint64_t frame){
+	timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	double origin = now.tv_sec + now.tv_nsec * 1e-9 - frame / (double)sampleRate;
 
+	//callbacks wake up with some jitter, follow it slowly. Start over when it's off by more than a buffer:
+	//the first callback, frames that were never rendered, or the clock being set
+	double current = ms_clockOrigin.load(std::memory_order_relaxed);
+	if(fabs(origin - current) > bufferSize / (double)sampleRate)
+		current = origin;
+	else
+		current += (origin - current) * (1.0 / 64.0);
+	ms_clockOrigin.store(current, std::memory_order_relaxed);
+}
+
+uint64_t Waffle::frameAt(double seconds){
+	double origin = ms_clockOrigin.load(std::memory_order_relaxed);
+	if(origin == 0.0 || seconds <= origin)
+		return 0;
+	return (uint64_t)((seconds - origin) * sampleRate + 0.5);
+}
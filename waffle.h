@@ -26,15 +26,23 @@ THE SOFTWARE.
 #define _WAFFLE_H_
 
 #include "Module.h"
+#include "backend.h"
+#include "offline.h"
 #include "generators.h"
+#include "wavetable.h"
 #include "filters.h"
 #include "patch.h"
+#include "voicepool.h"
+#include "controlrate.h"
+#include "aux.h"
 #include "osc.h"
+#include "threadpool.h"
+#include "trace.h"
 
+#include <atomic>
 #include <map>
 #include <string>
-#include <jack/jack.h>
-#include <jack/types.h>
+#include <vector>
 #include <pthread.h>
 
 namespace waffle {
@@ -43,33 +51,195 @@ namespace waffle {
 //the actual synth
 class Waffle {
 public:
+#ifndef WAFFLE_NO_JACK
+	//realtime output through jack
 	Waffle(const std::string &name = "waffle");
+#endif
+	//output through any backend, waffle takes ownership of it
+	Waffle(AudioBackend *backend);
 	~Waffle();
 	
 	static double midiToFreq(int note);
+
+	//! builds an aux bus's effect around its input, see addAux()
+	typedef Module *(*EffectBuilder)(Module *input, void *arg);
 	
-	//patch management
-	void addPatch(const std::string &name, Patch *p);
+	//patch management. A patch gets an output port of its own, or goes into a bus with a gain and a pan, see addBus().
+	//False if the patch doesn't compile, or is already added under another name. Adding it again under its own
+	//name does nothing
+	bool addPatch(const std::string &name, Patch *p, const std::string &bus = "", float gain = 1.0f, float pan = 0.0f);
+	//optimize patches added from now on, see Patch::optimize(). Off by default: it deletes modules the
+	//caller may still hold
+	void setOptimize(bool optimize) { m_optimize = optimize; }
+	//run patches added from now on as bytecode, see Patch::lower(). Off by default: setters on the modules
+	//other than Value::setValue() stop having an effect
+	void setBytecode(bool bytecode) { m_bytecode = bytecode; }
+	//move slow modulation sources of patches added from now on to control rate, evaluated every period
+	//samples, see Patch::inferControlRate(). 0, the default, turns it off
+	void setControlRate(int period) { m_controlPeriod = period; }
 	bool deletePatch(const std::string &name);
+	//move a playing patch to a bus, or back to a port of its own with an empty bus name, or change its gain and
+	//pan. Gain changes ramp over a callback
+	bool setRoute(const std::string &name, const std::string &bus, float gain = 1.0f, float pan = 0.0f);
+
+	//output buses: one set of ports summing every patch routed to it, clipped at the output. A mono bus has a
+	//port called name, stereo name_L and name_R, more channels name_1 to name_N. Pan goes from -1 (first
+	//channel) to 1 (last), equal power between the two nearest channels
+	bool addBus(const std::string &name, int channels = 2);
+	//fails while patches are routed to the bus
+	bool deleteBus(const std::string &name);
+
+	//aux buses: an effect that runs once per block on the sum of what patches send it (see setSend()), instead
+	//of a copy in every patch. build makes it around its input. It plays like a patch called name, routed to
+	//bus (or a port of its own) with gain and pan and started right away; setRoute(), stop() and deletePatch()
+	//work on it too
+	bool addAux(const std::string &name, EffectBuilder build, void *arg = NULL, const std::string &bus = "", float gain = 1.0f, float pan = 0.0f);
+	//send a patch's output, scaled by level, to an aux bus. 0 stops sending. Level changes ramp over a callback.
+	//Aux buses can't send to each other
+	bool setSend(const std::string &patch, const std::string &aux, float level);
 	std::map< std::string, bool > validatePatches();
 	
 	void start(const std::string &name);
 	void stop(const std::string &name);
+
+	//render patches in parallel on count extra threads (0 for none), pinned round-robin to cpus if given
+	void setWorkerThreads(int count, const std::vector<int> &cpus = std::vector<int>());
+
+	//CPU accounting since the last resetLoad() (or the start): DSP load, callback durations, xruns and the
+	//time spent on each patch, most expensive first. See profiler.h, the audio thread never waits for it
+	void getLoad(LoadReport &report);
+	void resetLoad();
+	//also time every module by class, for LoadReport::classes. Off by default, it reads the counter twice per module
+	void setModuleProfiling(bool on) { m_profiler.setProfilingModules(on); }
 	
 	static float sampleRate;
 	static int bufferSize;
 
+	//frames rendered so far: the absolute frame the next callback starts at. Timed events (see events.h) count
+	//in these, so Value::setValue(v, Waffle::getFrame() + n) lands n frames into the next callback
+	static uint64_t getFrame() { return ms_frame.load(std::memory_order_acquire); }
+	//the frame that starts at a wall clock time (CLOCK_REALTIME, in seconds since 1970), as of the latest
+	//callback. 0 before the first one. Used for OSC bundle timetags
+	static uint64_t frameAt(double seconds);
+
 private:
-	//jack callbacks
-	static int samplerate_callback(jack_nframes_t nframes, void *arg);
-	static int buffersize_callback(jack_nframes_t nframes, void *arg);
-	static int process_callback(jack_nframes_t nframes, void *arg);
+	//an output bus, see addBus()
+	struct Bus {
+		std::vector<AudioBackend::Port> ports;
+		std::vector<float *> buffers;	//audio thread: the ports' buffers this callback
+	};
+
+	//immutable snapshot of the playing patches, read by the audio thread
+	struct PatchTable {
+		PatchTable() : mixFrames(0), firstAux(0), ramped(false) {}
+
+		std::vector<Patch *> patches;
+		std::vector<float *> buffers;	//where each patch renders the current piece of the callback, filled by run()
+		std::vector<float *> ports;		//each patch's own port buffer, filled by run()
+
+		//how a patch is mixed: bus -1 for its own port, or its slot in mix and gains per bus channel, ramping
+		//from the previous table's over the first callback. A patch on its own port gets a slot too if it
+		//sends, so the sends aren't clipped
+		struct Route {
+			AudioBackend::Port port;
+			int bus;
+			int slot;
+			std::vector<float> from;
+			std::vector<float> to;
+		};
+		std::vector<Route> routes;
+		std::vector<Bus *> buses;
+		std::vector<float> mix;
+		int mixFrames;
 
-	void run(jack_nframes_t nframes);
+		//patches from firstAux on are aux buses, rendered once what the others send them is summed into
+		//their slots of auxIn
+		struct Send {
+			int aux;
+			float from;
+			float to;
+		};
+		int firstAux;
+		std::vector< std::vector<Send> > sends;
+		std::vector<float> auxIn;
+		bool ramped;	//audio thread only
 
+		//when some patch is split into parts: whole patches and parts, then the split patches' tails
+		struct Task {
+			int patch;
+			int part;	//-1 for the whole patch
+		};
+		std::vector<Task> tasks;
+		std::vector<int> split;
+		//a split patch's isSilent(), read once a block so its parts and its tail agree. Audio thread only
+		std::vector<char> silent;
+	};
+
+	//one piece of a callback's patch rendering, shared with the worker threads
+	struct RenderJob {
+		PatchTable *table;
+		uint64_t frame;	//where the callback starts
+		int first;		//patch of the first task
+		int offset;
+		int nframes;
+	};
+
+	//something the audio thread may still be looking at, freed once it is done
+	struct Retired {
+		unsigned long epoch;
+		PatchTable *table;
+		Patch *patch;
+		AudioBackend::Port port;
+		ThreadPool *pool;
+		Bus *bus;
+	};
+
+	void init(AudioBackend *backend);
+
+	//control side, called with m_lock held
+	void publish();
+	void retire(PatchTable *table, Patch *patch, AudioBackend::Port port);
+	void reclaim();
+	void release(Retired &r);
+	//put p on bus, or give it a port of its own: port if there is one, or a new one. Returns port if p no longer
+	//needs it, to retire once it's published
+	AudioBackend::Port route(const std::string &name, Patch *p, AudioBackend::Port port, const std::string &bus, float gain, float pan);
+	//stop every send to an aux bus that is going away, with m_lock held
+	void dropSends(const std::string &aux);
+
+	static void process_callback(int nframes, void *arg);
+	static void renderTask(void *context, int task);
+	static void renderPartTask(void *context, int task);
+	static void renderTailTask(void *context, int task);
+	void run(int nframes);
+	void render(PatchTable *table, uint64_t frame, int nframes);
+	void send(PatchTable *table, uint64_t frame, int offset, int nframes, int total);
+	void mix(PatchTable *table, int offset, int nframes, int total);
+	static void syncClock(uint64_t frame);
+
+	//control side copy of the patches, guarded by m_lock
 	std::map<std::string, Patch *> m_patches;
+	std::map<std::string, Bus *> m_buses;
+	std::vector<Retired> m_retired;
+
+	//current snapshot and a counter that is odd while the audio thread is inside run()
+	std::atomic<PatchTable *> m_table;
+	std::atomic<ThreadPool *> m_pool;
+	std::atomic<unsigned long> m_epoch;
 	
-	jack_client_t *m_jackClient;
+	AudioBackend *m_backend;
+	Profiler m_profiler;
+	//the backend's xrun count at the last resetLoad()
+	unsigned long m_xrunBase;
+	bool m_optimize;
+	bool m_bytecode;
+	int m_controlPeriod;
+
+	//see getFrame(), and the wall clock time of frame 0 smoothed over callbacks, see frameAt()
+	static std::atomic<uint64_t> ms_frame;
+	static std::atomic<double> ms_clockOrigin;
+
+	//serializes control threads, the audio thread never takes it
 	pthread_mutex_t m_lock;
 };
 
@@ -0,0 +1,148 @@
+/*
+Copyright (c) 2009-2010 Brett Lajzer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "wavetable.h"
+#include "waffle.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+using namespace waffle;
+
+static const double TWO_PI = 2.0 * 3.14159265358979323846264;
+
+//Wavetable
+Wavetable::Wavetable(const std::vector<double> &cycle) {
+	//harmonics of the input by plain DFT, it only runs once per table
+	int length = cycle.size();
+	int harmonics = std::min((length - 1) / 2, TABLE_SIZE / 2 - 1);
+	std::vector<double> cosines(harmonics + 1, 0.0), sines(harmonics + 1, 0.0);
+	double dc = 0.0;
+
+	//nothing to take the harmonics of, a silent table beats one full of NaNs
+	if(length == 0)
+		std::cerr << "Wavetable Error: empty cycle, the table will be silent" << std::endl;
+
+	for(int i = 0; i < length; ++i)
+		dc += cycle[i];
+	if(length > 0)
+		dc /= length;
+
+	for(int h = 1; h <= harmonics; ++h) {
+		for(int i = 0; i < length; ++i) {
+			double angle = TWO_PI * (double)(((long)h * i) % length) / length;
+			cosines[h] += cycle[i] * cos(angle);
+			sines[h] += cycle[i] * sin(angle);
+		}
+		cosines[h] *= 2.0 / length;
+		sines[h] *= 2.0 / length;
+	}
+
+	build(dc, cosines, sines);
+}
+
+std::shared_ptr<const Wavetable> Wavetable::fromHarmonics(const std::vector<double> &amplitudes) {
+	int harmonics = std::min((int)amplitudes.size(), TABLE_SIZE / 2 - 1);
+	std::vector<double> cosines(harmonics + 1, 0.0), sines(harmonics + 1, 0.0);
+
+	for(int h = 1; h <= harmonics; ++h)
+		sines[h] = amplitudes[h - 1];
+
+	Wavetable *table = new Wavetable();
+	table->build(0.0, cosines, sines);
+	return std::shared_ptr<const Wavetable>(table);
+}
+
+void Wavetable::build(double dc, const std::vector<double> &cosines, const std::vector<double> &sines) {
+	std::vector<double> cosTable(TABLE_SIZE), sinTable(TABLE_SIZE);
+	for(int i = 0; i < TABLE_SIZE; ++i) {
+		cosTable[i] = cos(TWO_PI * i / TABLE_SIZE);
+		sinTable[i] = sin(TWO_PI * i / TABLE_SIZE);
+	}
+
+	int available = cosines.size() - 1;
+	m_data.assign(LEVELS * (TABLE_SIZE + 2), 0.0);
+
+	for(int level = 0; level < LEVELS; ++level) {
+		int harmonics = std::min((TABLE_SIZE / 2) >> level, available);
+		double *data = &m_data[level * (TABLE_SIZE + 2)];
+
+		for(int i = 0; i < TABLE_SIZE; ++i) {
+			double v = dc;
+			for(int h = 1; h <= harmonics; ++h) {
+				int n = (h * i) & (TABLE_SIZE - 1);
+				v += cosines[h] * cosTable[n] + sines[h] * sinTable[n];
+			}
+			data[i] = v;
+		}
+
+		data[TABLE_SIZE] = data[0];
+		data[TABLE_SIZE + 1] = data[1];
+	}
+}
+
+int Wavetable::getLevel(double freq, double sampleRate) const {
+	//harmonic h of level n lands at h * freq, keep (TABLE_SIZE / 2 >> n) * freq under nyquist
+	double steps = fabs(freq) * TABLE_SIZE / sampleRate;
+	int level = 0;
+	while(level < LEVELS - 1 && (double)(1 << level) < steps)
+		++level;
+	return level;
+}
+
+//Wavetable Generator
+GenWavetable::GenWavetable(std::shared_ptr<const Wavetable> table, Module *f, Module *p) : WaveformGenerator(f, p), m_table(table) {
+}
+
+void GenWavetable::setTable(std::shared_ptr<const Wavetable> table) {
+	m_table = table;
+}
+
+void GenWavetable::process(sample_t * __restrict out, int nframes){
+	//one level per block, picked for the highest frequency in it
+	const sample_t *freq = m_freq->getOutput();
+	sample_t lanes[4] = { 0.0, 0.0, 0.0, 0.0 };	//separate maxima so the loop vectorizes
+	int i = 0;
+	for(; i + 4 <= nframes; i += 4) {
+		for(int j = 0; j < 4; ++j) {
+			sample_t f = std::fabs(freq[i + j]);
+			lanes[j] = (f > lanes[j]) ? f : lanes[j];
+		}
+	}
+	for(; i < nframes; ++i) {
+		sample_t f = std::fabs(freq[i]);
+		lanes[0] = (f > lanes[0]) ? f : lanes[0];
+	}
+	double highest = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+	const double * __restrict data = m_table->getLevelData(m_table->getLevel(highest, Waffle::sampleRate));
+
+	alignas(32) double pos[MAX_BLOCK_SIZE];
+	advance(pos, nframes);
+
+	for(i = 0; i < nframes; ++i) {
+		double index = pos[i] * Wavetable::TABLE_SIZE;
+		int n = (int)index;
+		double frac = index - n;
+		out[i] = data[n] + frac * (data[n + 1] - data[n]);
+	}
+}
@@ -0,0 +1,77 @@
+/*
+Copyright (c) 2009-2010 Brett Lajzer
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef _WAFFLE_WAVETABLE_H_
+#define _WAFFLE_WAVETABLE_H_
+
+#include "generators.h"
+
+#include <memory>
+#include <vector>
+
+namespace waffle {
+
+//! A single cycle waveform, band-limited into one table per octave when it's built.
+//! Tables are read-only once built, so any number of oscillators can share one.
+class Wavetable {
+public:
+	static const int TABLE_SIZE = 2048;	//samples per cycle in every level
+	static const int LEVELS = 11;		//level n holds at most (TABLE_SIZE / 2) >> n harmonics
+
+	//! one cycle of any length, resampled to TABLE_SIZE. An empty cycle gives a silent table
+	Wavetable(const std::vector<double> &cycle);
+
+	//! amplitudes of harmonics 1, 2, 3... as sines, e.g. instead of stacking GenSines with Adds
+	static std::shared_ptr<const Wavetable> fromHarmonics(const std::vector<double> &amplitudes);
+
+	//! the level that won't alias at this frequency
+	int getLevel(double freq, double sampleRate) const;
+
+	//! TABLE_SIZE samples, followed by two guard samples that repeat the start of the cycle
+	const double *getLevelData(int level) const { return &m_data[level * (TABLE_SIZE + 2)]; }
+
+private:
+	Wavetable() {}
+
+	//dc plus cosine and sine coefficients, harmonic n at index n
+	void build(double dc, const std::vector<double> &cosines, const std::vector<double> &sines);
+
+	std::vector<double> m_data;
+};
+
+class GenWavetable : public WaveformGenerator {
+public:
+	GenWavetable(std::shared_ptr<const Wavetable> table, Module *f, Module *p);
+	void setTable(std::shared_ptr<const Wavetable> table);
+
+	virtual void process(sample_t *out, int nframes);
+	virtual bool isValid() { return m_table && WaveformGenerator::isValid(); }
+	virtual bool equivalent(Module *other) {
+		return m_table == static_cast<GenWavetable *>(other)->m_table && WaveformGenerator::equivalent(other);
+	}
+
+protected:
+	std::shared_ptr<const Wavetable> m_table;
+};
+
+}
+#endif